@@ -0,0 +1,403 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <benchmark/benchmark.h>
+#include <glib.h>
+#include <libusb.h>
+#include <functional>
+#include <vector>
+
+#include "usb_endpoint.hpp"
+#include "usb_gsource.hpp"
+#include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_mock.hpp"
+
+using namespace unsebu;
+
+namespace {
+
+constexpr int num_endpoints = 15;
+
+/** Simulated devices with IN and OUT endpoints 1 to 15 on interface
+    0, all completing immediately, removed again on destruction */
+class MockDevices
+{
+public:
+  MockDevices(int count, bool open = true) :
+    m_devices(),
+    m_handles()
+  {
+    for(int i = 0; i < count; ++i)
+    {
+      USBMockDeviceConfig config;
+      config.bus = static_cast<uint8_t>(1 + i / 100);
+      config.address = static_cast<uint8_t>(1 + i % 100);
+      config.port_numbers = { static_cast<uint8_t>(1 + i % 100) };
+      for(int ep = 1; ep <= num_endpoints; ++ep)
+      {
+        USBMockEndpointConfig in;
+        in.address = static_cast<uint8_t>(LIBUSB_ENDPOINT_IN | ep);
+        config.endpoints.push_back(in);
+
+        USBMockEndpointConfig out;
+        out.address = static_cast<uint8_t>(LIBUSB_ENDPOINT_OUT | ep);
+        config.endpoints.push_back(out);
+      }
+
+      libusb_device* dev = usb_mock_add_device(config);
+      m_devices.push_back(dev);
+
+      if (open)
+      {
+        libusb_device_handle* handle = nullptr;
+        libusb_open(dev, &handle);
+        m_handles.push_back(handle);
+      }
+    }
+  }
+
+  ~MockDevices()
+  {
+    for(libusb_device_handle* handle : m_handles)
+    {
+      libusb_close(handle);
+    }
+    usb_mock_reset();
+  }
+
+  libusb_device* get_device(int i) const { return m_devices[static_cast<size_t>(i)]; }
+  libusb_device_handle* get_handle(int i) const { return m_handles[static_cast<size_t>(i)]; }
+
+private:
+  std::vector<libusb_device*> m_devices;
+  std::vector<libusb_device_handle*> m_handles;
+
+private:
+  MockDevices(const MockDevices&);
+  MockDevices& operator=(const MockDevices&);
+};
+
+/** Handle events without blocking until done() returns true */
+void drain_events(std::function<bool ()> const& done)
+{
+  while (!done())
+  {
+    struct timeval tv = { 0, 0 };
+    libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+    USBInterface::flush_batches();
+  }
+}
+
+struct EndpointReceiver
+{
+  bool on_read(uint8_t const* data, int /*len*/)
+  {
+    benchmark::DoNotOptimize(data);
+    return running;
+  }
+
+  bool running = true;
+};
+
+void BM_SubmitRead(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+
+  int completed = 0;
+  for(auto _ : state)
+  {
+    for(int ep = 1; ep <= num_endpoints; ++ep)
+    {
+      iface.submit_read(ep, 64, [&completed](uint8_t*, int) { completed += 1; return false; });
+    }
+
+    state.PauseTiming();
+    drain_events([&completed]{ return completed == num_endpoints; });
+    completed = 0;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * num_endpoints);
+}
+BENCHMARK(BM_SubmitRead);
+
+void BM_SubmitWrite(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+
+  uint8_t data[64] = {};
+  int completed = 0;
+  for(auto _ : state)
+  {
+    for(int ep = 1; ep <= num_endpoints; ++ep)
+    {
+      iface.submit_write(ep, data, sizeof(data), [&completed](libusb_transfer*) { completed += 1; return false; });
+    }
+
+    state.PauseTiming();
+    drain_events([&completed]{ return completed == num_endpoints; });
+    completed = 0;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * num_endpoints);
+}
+BENCHMARK(BM_SubmitWrite);
+
+/** Completion dispatch through on_read_data() with range(0)
+    endpoints continuously reading, one event pass per iteration */
+void BM_ReadDispatch(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+
+  int const endpoints = static_cast<int>(state.range(0));
+  bool running = true;
+  int stopped = 0;
+  uint64_t completions = 0;
+  for(int ep = 1; ep <= endpoints; ++ep)
+  {
+    iface.submit_read(ep, 64, [&](uint8_t* data, int) {
+      benchmark::DoNotOptimize(data);
+      completions += 1;
+      stopped += running ? 0 : 1;
+      return running;
+    });
+  }
+
+  for(auto _ : state)
+  {
+    libusb_handle_events(nullptr);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(completions));
+
+  running = false;
+  drain_events([&]{ return stopped == endpoints; });
+}
+BENCHMARK(BM_ReadDispatch)->Arg(1)->Arg(4)->Arg(num_endpoints);
+
+/** Completion dispatch through on_write_data() */
+void BM_WriteDispatch(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+
+  int const endpoints = static_cast<int>(state.range(0));
+  uint8_t data[64] = {};
+  bool running = true;
+  int stopped = 0;
+  uint64_t completions = 0;
+  for(int ep = 1; ep <= endpoints; ++ep)
+  {
+    iface.submit_write(ep, data, sizeof(data), [&](libusb_transfer*) {
+      completions += 1;
+      stopped += running ? 0 : 1;
+      return running;
+    });
+  }
+
+  for(auto _ : state)
+  {
+    libusb_handle_events(nullptr);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(completions));
+
+  running = false;
+  drain_events([&]{ return stopped == endpoints; });
+}
+BENCHMARK(BM_WriteDispatch)->Arg(1)->Arg(4)->Arg(num_endpoints);
+
+/** Baseline for the callback overhead: a plain libusb transfer
+    resubmitted from its C callback, no library code involved */
+void BM_CallbackRawLibusb(benchmark::State& state)
+{
+  MockDevices devices(1);
+
+  struct RawRead
+  {
+    bool running;
+    uint64_t completions;
+  };
+  RawRead raw{true, 0};
+
+  uint8_t buffer[64];
+  libusb_transfer* transfer = libusb_alloc_transfer(0);
+  libusb_fill_interrupt_transfer(transfer, devices.get_handle(0), LIBUSB_ENDPOINT_IN | 1, buffer, sizeof(buffer),
+                                 [](libusb_transfer* transfer_) {
+                                   RawRead* read = static_cast<RawRead*>(transfer_->user_data);
+                                   read->completions += 1;
+                                   if (read->running)
+                                   {
+                                     libusb_submit_transfer(transfer_);
+                                   }
+                                 },
+                                 &raw, 0);
+  libusb_submit_transfer(transfer);
+
+  for(auto _ : state)
+  {
+    libusb_handle_events(nullptr);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(raw.completions));
+
+  raw.running = false;
+  libusb_handle_events(nullptr);
+  libusb_free_transfer(transfer);
+}
+BENCHMARK(BM_CallbackRawLibusb);
+
+/** The same read with USBInterface, going through std::function */
+void BM_CallbackUSBInterface(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+
+  bool running = true;
+  bool stopped = false;
+  uint64_t completions = 0;
+  iface.submit_read(1, 64, [&](uint8_t* data, int) {
+    benchmark::DoNotOptimize(data);
+    completions += 1;
+    stopped = !running;
+    return running;
+  });
+
+  for(auto _ : state)
+  {
+    libusb_handle_events(nullptr);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(completions));
+
+  running = false;
+  drain_events([&]{ return stopped; });
+}
+BENCHMARK(BM_CallbackUSBInterface);
+
+/** The same read with USBEndpoint and its compile time bound callback */
+void BM_CallbackUSBEndpoint(benchmark::State& state)
+{
+  MockDevices devices(1);
+  USBInterface iface(devices.get_handle(0), 0);
+  USBEndpoint<LIBUSB_ENDPOINT_IN | 1, USBEndpointType::Interrupt, 64> endpoint(iface);
+
+  EndpointReceiver receiver;
+  endpoint.start_read<EndpointReceiver, &EndpointReceiver::on_read>(receiver);
+
+  uint64_t const start = usb_mock_get_completion_count();
+  for(auto _ : state)
+  {
+    libusb_handle_events(nullptr);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(usb_mock_get_completion_count() - start));
+
+  receiver.running = false;
+  drain_events([&endpoint]{ return !endpoint.is_active(); });
+}
+BENCHMARK(BM_CallbackUSBEndpoint);
+
+/** One main loop iteration with a completion ready, the USBGSource
+    polls the fds of range(0) open devices plus the event timer */
+void BM_GSourceDispatch(benchmark::State& state)
+{
+  GMainContext* context = g_main_context_new();
+  {
+    MockDevices devices(static_cast<int>(state.range(0)));
+    USBGSource source;
+    source.attach(context);
+
+    USBInterface iface(devices.get_handle(0), 0);
+    bool running = true;
+    bool stopped = false;
+    uint64_t completions = 0;
+    iface.submit_read(1, 64, [&](uint8_t*, int) {
+      completions += 1;
+      stopped = !running;
+      return running;
+    });
+
+    for(auto _ : state)
+    {
+      g_main_context_iteration(context, FALSE);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(completions));
+    state.counters["pollfds"] = static_cast<double>(state.range(0) + 1);
+
+    running = false;
+    drain_events([&]{ return stopped; });
+  }
+  g_main_context_unref(context);
+}
+BENCHMARK(BM_GSourceDispatch)->RangeMultiplier(4)->Range(1, 256);
+
+/** One main loop iteration with nothing to do, the cost of
+    prepare/poll/check alone */
+void BM_GSourceIdle(benchmark::State& state)
+{
+  GMainContext* context = g_main_context_new();
+  {
+    MockDevices devices(static_cast<int>(state.range(0)));
+    USBGSource source;
+    source.attach(context);
+
+    for(auto _ : state)
+    {
+      g_main_context_iteration(context, FALSE);
+    }
+    state.counters["pollfds"] = static_cast<double>(state.range(0) + 1);
+  }
+  g_main_context_unref(context);
+}
+BENCHMARK(BM_GSourceIdle)->RangeMultiplier(4)->Range(1, 256);
+
+/** Looks up the last of range(0) devices */
+void BM_FindDeviceByPath(benchmark::State& state)
+{
+  int const count = static_cast<int>(state.range(0));
+  MockDevices devices(count, false);
+
+  libusb_device* const last = devices.get_device(count - 1);
+  uint8_t const busnum = libusb_get_bus_number(last);
+  uint8_t const devnum = libusb_get_device_address(last);
+
+  for(auto _ : state)
+  {
+    libusb_device* dev = usb_find_device_by_path(busnum, devnum);
+    benchmark::DoNotOptimize(dev);
+    libusb_unref_device(dev);
+  }
+}
+BENCHMARK(BM_FindDeviceByPath)->RangeMultiplier(4)->Range(1, 256);
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  libusb_init(nullptr);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+  {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  libusb_exit(nullptr);
+  return 0;
+}
+
+/* EOF */
@@ -19,9 +19,36 @@
 
 namespace unsebu {
 
+class USBBufferArena;
+class USBDescriptorCache;
+class USBDevice;
+class USBEndpointBase;
 class USBGSource;
+struct USBHIDField;
+class USBHIDReportDescriptor;
+class USBHIDReportLayout;
+class USBHotplug;
 class USBInterface;
+class USBMetrics;
+class USBMetricsExporter;
+struct USBMonFilter;
+struct USBMonHeader;
+class USBMonReader;
+class USBMonRing;
+class USBPcapngWriter;
+class USBReadLease;
+struct USBReadRecord;
+class USBReconnectSupervisor;
+struct USBRecord;
+class USBRecorder;
+class USBReplayer;
+class USBReportFilter;
+class USBReportPublisher;
+class USBReportSubscriber;
+class USBSubmitQueue;
 class USBSubsystem;
+class USBTrace;
+class USBWatchdog;
 
 } // namespace unsebu
 
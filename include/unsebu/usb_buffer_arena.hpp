@@ -0,0 +1,97 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_BUFFER_ARENA_HPP
+#define HEADER_UNSEBU_USB_BUFFER_ARENA_HPP
+
+#include <libusb.h>
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+namespace unsebu {
+
+/** Transfer buffer allocator backed by libusb_dev_mem_alloc(). On
+    Linux that memory is mapped from usbfs, which lets the kernel do
+    DMA straight from it instead of copying every transfer. The block
+    is mapped once and carved into slabs of fixed size classes.
+    Requests that don't fit, or all requests when the kernel lacks
+    support, fall back to aligned heap memory. Not thread-safe. */
+class USBBufferArena
+{
+public:
+  USBBufferArena(std::shared_ptr<libusb_device_handle> handle, size_t size = 256 * 1024);
+  ~USBBufferArena();
+
+  uint8_t* allocate(size_t len);
+
+  /** Also takes buffers of arenas taken over with adopt() */
+  void free(uint8_t* buffer);
+
+  /** Take over the buffers still handed out by the arena of a
+      previous handle of the same device. They can be freed through
+      this arena and the previous one, along with its handle, is let
+      go once the last of them is back. */
+  void adopt(std::shared_ptr<USBBufferArena> previous);
+
+  /** Returns buffer when it belongs to this arena or the heap,
+      otherwise a copy of the first len bytes from this arena, with
+      buffer going back to the adopted arena it came from. Buffers of
+      a previous handle must pass through this before they are
+      submitted again. */
+  uint8_t* migrate(uint8_t* buffer, size_t len);
+
+  bool has_device_memory() const { return m_memory != nullptr; }
+
+private:
+  struct SizeClass
+  {
+    size_t block_size;
+    std::vector<uint8_t*> free_blocks;
+  };
+
+private:
+  /** buffer is device memory of this arena */
+  bool owns(uint8_t const* buffer) const;
+
+  /** buffer is device memory of this arena or one it adopted */
+  bool holds(uint8_t const* buffer) const;
+
+  /** No device memory of this arena or one it adopted is handed out */
+  bool is_idle() const;
+
+private:
+  std::shared_ptr<libusb_device_handle> m_handle;
+  uint8_t* m_memory;
+  size_t m_memory_size;
+  size_t m_region_size;
+  std::vector<SizeClass> m_classes;
+
+  /** Device memory blocks currently handed out */
+  size_t m_outstanding;
+
+  std::vector<std::shared_ptr<USBBufferArena>> m_adopted;
+
+private:
+  USBBufferArena(const USBBufferArena&);
+  USBBufferArena& operator=(const USBBufferArena&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,114 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_DESCRIPTOR_CACHE_HPP
+#define HEADER_UNSEBU_USB_DESCRIPTOR_CACHE_HPP
+
+#include <libusb.h>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace unsebu {
+
+/** Persistent cache for descriptors that would otherwise require
+    control transfers to the device (string descriptors, HID report
+    descriptors, ...)
+
+    Entries are keyed by port path, idVendor:idProduct and bcdDevice
+    and are only considered valid as long as the device keeps its
+    device address. The address and the device descriptor come from
+    sysfs on Linux, so validating an entry costs no bus I/O.
+
+    The cache file is memory-mapped read-only, new entries are kept in
+    memory until save() is called, which rewrites the file atomically. */
+class USBDescriptorCache
+{
+public:
+  USBDescriptorCache(std::string const& filename);
+  ~USBDescriptorCache();
+
+  /** Returns the cached descriptor or std::nullopt when there is no
+      valid entry for the device */
+  std::optional<std::vector<uint8_t>> lookup(libusb_device* dev,
+                                             uint8_t desc_type, uint8_t desc_index, uint16_t w_index) const;
+  void store(libusb_device* dev,
+             uint8_t desc_type, uint8_t desc_index, uint16_t w_index,
+             uint8_t const* data, int len);
+
+  /** Returns the string descriptor in ASCII, reading it from the
+      device on a cache miss, or "" when it isn't available */
+  std::string get_string_descriptor(libusb_device_handle* handle, uint8_t desc_index);
+
+  /** Write the cache back to disk, dropping the entries of devices
+      that are no longer attached under the same port and address */
+  void save();
+
+private:
+  struct Key
+  {
+    std::string port_path;
+    uint16_t id_vendor;
+    uint16_t id_product;
+    uint16_t bcd_device;
+    uint8_t devnum;
+    uint8_t desc_type;
+    uint8_t desc_index;
+    uint16_t w_index;
+
+    bool same_device(Key const& other) const {
+      return (std::tie(port_path, id_vendor, id_product, bcd_device, devnum) ==
+              std::tie(other.port_path, other.id_vendor, other.id_product, other.bcd_device, other.devnum));
+    }
+
+    bool operator<(Key const& other) const {
+      return (std::tie(port_path, id_vendor, id_product, bcd_device, devnum, desc_type, desc_index, w_index) <
+              std::tie(other.port_path, other.id_vendor, other.id_product, other.bcd_device, other.devnum,
+                       other.desc_type, other.desc_index, other.w_index));
+    }
+  };
+
+  /** Points into the memory-mapped cache file */
+  struct MappedEntry
+  {
+    uint8_t const* data;
+    uint16_t len;
+  };
+
+private:
+  Key make_key(libusb_device* dev, uint8_t desc_type, uint8_t desc_index, uint16_t w_index) const;
+  void load();
+  void unmap();
+
+private:
+  std::string m_filename;
+  uint8_t* m_mmap_data;
+  size_t m_mmap_size;
+  std::map<Key, MappedEntry> m_mapped;
+  std::map<Key, std::vector<uint8_t>> m_pending;
+
+private:
+  USBDescriptorCache(const USBDescriptorCache&);
+  USBDescriptorCache& operator=(const USBDescriptorCache&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
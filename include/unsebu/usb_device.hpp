@@ -0,0 +1,92 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_DEVICE_HPP
+#define HEADER_UNSEBU_USB_DEVICE_HPP
+
+#include <libusb.h>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "fwd.hpp"
+
+namespace unsebu {
+
+/** Owns an open libusb_device_handle along with the descriptors of
+    the device. Interfaces handed out by claim_interface() share the
+    handle and keep it open until the last of them is gone. */
+class USBDevice
+{
+public:
+  /** Open the given device */
+  USBDevice(libusb_device* dev, USBDescriptorCache* descriptor_cache = nullptr);
+
+  /** Take ownership of an already open handle, e.g. one returned by
+      USBSubsystem::open_devices() */
+  USBDevice(libusb_device_handle* handle, USBDescriptorCache* descriptor_cache = nullptr);
+
+  ~USBDevice();
+
+  libusb_device* get_device() const { return m_dev; }
+  libusb_device_handle* get_handle() const { return m_handle.get(); }
+
+  libusb_device_descriptor const& get_descriptor() const { return m_descriptor; }
+
+  /** Returns the active configuration or nullptr when the device is
+      unconfigured */
+  libusb_config_descriptor const* get_config_descriptor() const { return m_config_descriptor.get(); }
+
+  /** Returns the string descriptor in ASCII or "" when it isn't
+      available, results are cached */
+  std::string const& get_string(uint8_t desc_index);
+
+  std::string const& get_manufacturer() { return get_string(m_descriptor.iManufacturer); }
+  std::string const& get_product() { return get_string(m_descriptor.iProduct); }
+  std::string const& get_serial() { return get_string(m_descriptor.iSerialNumber); }
+
+  /** Interfaces claimed through this allocate their transfer
+      buffers from the device's USBBufferArena */
+  std::unique_ptr<USBInterface> claim_interface(int interface, bool try_detach = false);
+
+  /** Move an interface of a previous incarnation of this device over
+      to this handle, the interface must already be claimed on it with
+      USBInterface::claim_on(). The interface switches to the
+      USBBufferArena of this handle, see USBInterface::reattach() */
+  void reattach_interface(USBInterface& iface);
+
+private:
+  void init();
+
+private:
+  libusb_device* m_dev;
+  std::shared_ptr<libusb_device_handle> m_handle;
+  std::shared_ptr<USBBufferArena> m_buffer_arena;
+  libusb_device_descriptor m_descriptor;
+  std::unique_ptr<libusb_config_descriptor, void (*)(libusb_config_descriptor*)> m_config_descriptor;
+  USBDescriptorCache* m_descriptor_cache;
+  std::map<uint8_t, std::string> m_strings;
+
+private:
+  USBDevice(const USBDevice&);
+  USBDevice& operator=(const USBDevice&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
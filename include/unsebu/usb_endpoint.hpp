@@ -0,0 +1,204 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_ENDPOINT_HPP
+#define HEADER_UNSEBU_USB_ENDPOINT_HPP
+
+#include <libusb.h>
+#include <array>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fwd.hpp"
+#include "usb_metrics.hpp"
+#include "usb_trace.hpp"
+#include "usb_watchdog.hpp"
+
+namespace unsebu {
+
+enum class USBEndpointType
+{
+  Interrupt = LIBUSB_TRANSFER_TYPE_INTERRUPT,
+  Bulk = LIBUSB_TRANSFER_TYPE_BULK
+};
+
+/** The part of USBEndpoint that doesn't depend on the template
+    arguments: a single transfer on an endpoint of a claimed
+    USBInterface. On disconnect the transfer is suspended with the
+    interface and USBInterface::reattach() resubmits it on the new
+    handle. */
+class USBEndpointBase
+{
+public:
+  bool is_active() const { return m_active; }
+
+  /** Cancel the transfer, the callback won't be called anymore */
+  void cancel();
+
+protected:
+  /** The derived class sets m_transfer->buffer */
+  USBEndpointBase(USBInterface& iface, uint8_t address, USBEndpointType type);
+  ~USBEndpointBase();
+
+  /** Throws std::runtime_error when the transfer can't be submitted */
+  void submit(int len, libusb_transfer_cb_fn callback, void* receiver);
+  void resubmit();
+
+  /** Marks the transfer as done, logging unexpected errors. A
+      transfer that lost the device is suspended instead. */
+  void finish(libusb_transfer* transfer);
+
+  /** Cancel and handle libusb events until the transfer is back, must
+      be called by the destructor of the derived class */
+  void cancel_and_wait();
+
+protected:
+  USBInterface& m_iface;
+  USBEndpointMetrics* m_metrics;
+  libusb_transfer* m_transfer;
+  void* m_receiver;
+  bool m_active;
+  bool m_cancelled;
+
+private:
+  USBEndpointBase(const USBEndpointBase&);
+  USBEndpointBase& operator=(const USBEndpointBase&);
+};
+
+/** An endpoint with address, transfer type and maximum packet size
+    fixed at compile time, for devices whose layout is known in
+    advance. The buffer lives inline in the object and completions go
+    straight to a member function given as template argument, so the
+    per transfer path has no std::function, no virtual call and no
+    heap allocation:
+
+      class Gamepad
+      {
+        USBEndpoint<0x81, USBEndpointType::Interrupt, 32> m_in;
+        bool on_report(uint8_t const* data, int len);
+        ...
+        m_in.start_read<Gamepad, &Gamepad::on_report>(*this);
+      };
+
+    The object must outlive the transfer, destroying it while a
+    transfer is in flight cancels the transfer and waits for libusb to
+    hand it back. */
+template<uint8_t Address, USBEndpointType Type, int Size>
+class USBEndpoint : public USBEndpointBase
+{
+  static_assert((Address & LIBUSB_ENDPOINT_ADDRESS_MASK) != 0, "endpoint 0 is the control endpoint");
+  static_assert((Address & ~(LIBUSB_ENDPOINT_ADDRESS_MASK | LIBUSB_ENDPOINT_DIR_MASK)) == 0,
+                "reserved bits set in endpoint address");
+  static_assert(Size > 0, "endpoint size must be positive");
+  static_assert(Type != USBEndpointType::Interrupt || Size <= 3 * 1024,
+                "interrupt transfers are limited to 3072 bytes per interval");
+
+public:
+  static constexpr uint8_t address = Address;
+  static constexpr USBEndpointType type = Type;
+  static constexpr int size = Size;
+  static constexpr bool is_input = (Address & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+
+public:
+  explicit USBEndpoint(USBInterface& iface) :
+    USBEndpointBase(iface, Address, Type),
+    m_buffer()
+  {
+    m_transfer->buffer = m_buffer.data();
+  }
+
+  ~USBEndpoint()
+  {
+    cancel_and_wait();
+  }
+
+  /** Keep reading from the endpoint, Callback gets each completed
+      transfer and returns false to stop reading */
+  template<typename T, bool (T::*Callback)(uint8_t const*, int)>
+  void start_read(T& receiver)
+  {
+    static_assert(is_input, "start_read() requires an IN endpoint");
+    submit(Size, &USBEndpoint::on_read<T, Callback>, &receiver);
+  }
+
+  /** Copy data into the endpoint buffer and send it. Returns false
+      when the previous write is still in flight. */
+  bool write(uint8_t const* data, int len)
+  {
+    static_assert(!is_input, "write() requires an OUT endpoint");
+    assert(0 <= len && len <= Size);
+
+    if (m_active)
+    {
+      return false;
+    }
+    else
+    {
+      memcpy(m_buffer.data(), data, static_cast<size_t>(len));
+      submit(len, &USBEndpoint::on_write, nullptr);
+      return true;
+    }
+  }
+
+  template<size_t N>
+  bool write(std::array<uint8_t, N> const& data)
+  {
+    static_assert(N <= static_cast<size_t>(Size), "data exceeds the endpoint size");
+    return write(data.data(), static_cast<int>(N));
+  }
+
+private:
+  template<typename T, bool (T::*Callback)(uint8_t const*, int)>
+  static void LIBUSB_CALL on_read(libusb_transfer* transfer)
+  {
+    USBEndpoint* self = static_cast<USBEndpoint*>(static_cast<USBEndpointBase*>(transfer->user_data));
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !self->m_cancelled &&
+        self->template invoke<T, Callback>(transfer->actual_length) &&
+        !self->m_cancelled)
+    {
+      self->resubmit();
+    }
+    else
+    {
+      self->finish(transfer);
+    }
+  }
+
+  template<typename T, bool (T::*Callback)(uint8_t const*, int)>
+  bool invoke(int len)
+  {
+    UNSEBU_TRACE_SCOPE(Callback, Address);
+    USBWatchdogScope watchdog(m_transfer->dev_handle, Address);
+    USBMetricsTimer timer(&m_metrics->callback_duration);
+    return (static_cast<T*>(m_receiver)->*Callback)(m_buffer.data(), len);
+  }
+
+  static void LIBUSB_CALL on_write(libusb_transfer* transfer)
+  {
+    static_cast<USBEndpoint*>(static_cast<USBEndpointBase*>(transfer->user_data))->finish(transfer);
+  }
+
+private:
+  alignas(64) std::array<uint8_t, Size> m_buffer;
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -19,8 +19,11 @@
 #ifndef HEADER_UNSEBU_USB_GSOURCE_HPP
 #define HEADER_UNSEBU_USB_GSOURCE_HPP
 
+#include <chrono>
 #include <list>
 #include <memory>
+#include <vector>
+#include <poll.h>
 
 #include <glib.h>
 
@@ -42,8 +45,19 @@ public:
 
   void attach(GMainContext* context);
 
+  /** Limit a single dispatch to max_completions transfer completions
+      or max_time, whichever is reached first, 0 disables the
+      respective limit. Events are then handled without blocking and
+      when more are pending the source stays ready, so the remaining
+      work continues in the next main loop iteration after the other
+      sources had their turn. By default all pending events are
+      handled in one go. */
+  void set_dispatch_budget(int max_completions, std::chrono::microseconds max_time);
+
 private:
   gboolean on_source();
+  void dispatch_budgeted();
+  bool has_pending_events();
 
   // libusb callbacks
   void on_usb_pollfd_added(int fd, short events);
@@ -60,6 +74,10 @@ private:
   gint m_source_id;
   std::list<std::unique_ptr<GPollFD> > m_pollfds;
 
+  int m_max_completions;
+  std::chrono::microseconds m_max_time;
+  std::vector<pollfd> m_pending_fds;
+
 private:
   USBGSource(const USBGSource&);
   USBGSource& operator=(const USBGSource&);
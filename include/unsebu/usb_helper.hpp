@@ -20,12 +20,31 @@
 #define HEADER_UNSEBU_USB_HELPER_HPP
 
 #include <libusb.h>
+#include <string>
 
 namespace unsebu {
 
 int usb_claim_n_detach_interface(libusb_device_handle* handle, int interface, bool try_detach);
 libusb_device* usb_find_device_by_path(uint8_t busnum, uint8_t devnum);
 
+/** Returns the first device with the given ids with a reference
+    held, or nullptr */
+libusb_device* usb_find_device_by_id(uint16_t vendor_id, uint16_t product_id);
+
+/** Returns the physical location of the device in sysfs notation
+    (e.g. "1-2.3"), which stays stable across re-enumeration */
+std::string usb_get_port_path(libusb_device* dev);
+
+/** Port path plus vendor and product id, e.g. "1-2.3 (045e:028e)",
+    for log messages and metrics */
+std::string usb_get_device_label(libusb_device* dev);
+
+/** Counts the transfer completions handled by the library callbacks,
+    USBGSource uses it to limit the work done per dispatch. Only to
+    be used from the thread handling libusb events. */
+void usb_count_completion();
+uint64_t usb_get_completion_count();
+
 } // namespace unsebu
 
 #endif
@@ -0,0 +1,109 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_HID_REPORT_HPP
+#define HEADER_UNSEBU_USB_HID_REPORT_HPP
+
+#include <libusb.h>
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include "fwd.hpp"
+
+namespace unsebu {
+
+struct USBHIDField
+{
+  uint16_t usage_page;
+  uint16_t usage; // 0 for array fields
+  bool is_array;
+  uint32_t bit_offset; // from the start of the report, including the report id
+  uint8_t bit_size;
+
+  /** 64 bits wide, unsigned 32 bit fields go up to 2^32 - 1 */
+  int64_t logical_min;
+  int64_t logical_max;
+};
+
+/** The layout of one input report compiled into a flat extraction
+    plan: per field a byte offset, shift and mask, stored as separate
+    arrays so the unpack loop runs without branches */
+class USBHIDReportLayout
+{
+public:
+  USBHIDReportLayout(uint8_t report_id, std::vector<USBHIDField> const& fields);
+
+  uint8_t get_report_id() const { return m_report_id; }
+  std::vector<USBHIDField> const& get_fields() const { return m_fields; }
+
+  /** Size of the report in bytes, including the report id */
+  int get_report_size() const { return m_report_size; }
+
+  /** Unpack all fields into values, which must have room for
+      get_fields().size() entries. Returns false when the report is
+      too short. Fields with a logical minimum of 0 or more are
+      unsigned, a 32 bit one has to be read back as uint32_t. */
+  bool extract(uint8_t const* data, int len, int32_t* values) const;
+
+  /** Like extract(), but scales each value from its logical range to
+      0.0 - 1.0 */
+  bool extract_normalized(uint8_t const* data, int len, float* values) const;
+
+private:
+  uint8_t m_report_id;
+  std::vector<USBHIDField> m_fields;
+  int m_report_size;
+
+  std::vector<uint32_t> m_byte_offsets;
+  std::vector<uint32_t> m_shifts;
+  std::vector<uint64_t> m_masks;
+  std::vector<uint32_t> m_sign_shifts;
+  std::vector<float> m_scales;
+  std::vector<float> m_biases;
+};
+
+class USBHIDReportDescriptor
+{
+public:
+  /** Throws std::runtime_error on malformed descriptors */
+  static USBHIDReportDescriptor parse(uint8_t const* data, int len);
+
+  std::vector<USBHIDReportLayout> const& get_input_reports() const { return m_input_reports; }
+
+  /** Returns nullptr when there is no input report with the given id */
+  USBHIDReportLayout const* find_input_report(uint8_t report_id) const;
+
+private:
+  USBHIDReportDescriptor(std::vector<USBHIDReportLayout> input_reports);
+
+private:
+  std::vector<USBHIDReportLayout> m_input_reports;
+};
+
+/** Fetch the HID report descriptor of interface with an asynchronous
+    control transfer. callback receives LIBUSB_SUCCESS and the
+    descriptor or a libusb error code. With a descriptor_cache a cached
+    descriptor is passed to callback right away. */
+void usb_hid_fetch_report_descriptor(libusb_device_handle* handle, int interface,
+                                     std::function<void (int, std::vector<uint8_t> const&)> const& callback,
+                                     USBDescriptorCache* descriptor_cache = nullptr);
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,59 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_HOTPLUG_HPP
+#define HEADER_UNSEBU_USB_HOTPLUG_HPP
+
+#include <libusb.h>
+#include <functional>
+#include <map>
+
+namespace unsebu {
+
+/** Registry that shares a single libusb hotplug callback between any
+    number of listeners. Callbacks run from within libusb event
+    handling, so they should defer anything that talks to the device. */
+class USBHotplug
+{
+public:
+  using Callback = std::function<void (libusb_device*, libusb_hotplug_event)>;
+
+public:
+  USBHotplug();
+  ~USBHotplug();
+
+  /** Returns an id for use with remove_callback() */
+  int add_callback(Callback const& callback);
+  void remove_callback(int id);
+
+private:
+  void on_hotplug(libusb_device* dev, libusb_hotplug_event event);
+
+private:
+  libusb_hotplug_callback_handle m_handle;
+  std::map<int, Callback> m_callbacks;
+  int m_next_id;
+
+private:
+  USBHotplug(const USBHotplug&);
+  USBHotplug& operator=(const USBHotplug&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
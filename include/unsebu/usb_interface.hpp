@@ -22,21 +22,105 @@
 #include <libusb.h>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 namespace unsebu {
 
+class USBBufferArena;
+struct USBEndpointMetrics;
+class USBPcapngWriter;
+class USBRecorder;
+class USBReportFilter;
+class USBSubmitQueue;
+struct USBQueuedRead;
 struct USBReadData;
 struct USBWriteData;
 
+/** One completed transfer of a batched read, the data is only valid
+    for the duration of the callback */
+struct USBReadRecord
+{
+  uint8_t* data;
+  int len;
+  libusb_transfer_status status;
+};
+
+/** A completed read handed out by USBInterface::submit_read_leased().
+    The buffer stays valid until the lease is released or destroyed,
+    at which point the transfer gets resubmitted. Leases must be
+    released on the thread running the main loop. */
+class USBReadLease
+{
+public:
+  USBReadLease();
+  USBReadLease(USBReadLease&& other);
+  USBReadLease& operator=(USBReadLease&& other);
+  ~USBReadLease();
+
+  uint8_t* data() const;
+  int size() const;
+  libusb_transfer_status status() const;
+
+  /** Return the credit, the lease is empty afterwards */
+  void release();
+
+  explicit operator bool() const { return m_transfer != nullptr; }
+
+private:
+  friend class USBInterface;
+  USBReadLease(USBQueuedRead* read, libusb_transfer* transfer);
+
+private:
+  USBQueuedRead* m_read;
+  libusb_transfer* m_transfer;
+
+private:
+  USBReadLease(const USBReadLease&);
+  USBReadLease& operator=(const USBReadLease&);
+};
+
 class USBInterface
 {
+  friend class USBReadLease;
+
 public:
   USBInterface(libusb_device_handle* handle, int interface, bool try_detach = false);
+
+  /** Keeps the handle open for as long as the interface exists */
+  USBInterface(std::shared_ptr<libusb_device_handle> handle, int interface, bool try_detach = false);
   ~USBInterface();
 
   void submit_read(int endpoint, int len,
                    const std::function<bool (uint8_t*, int)>& callback);
-  void cancel_read(int endpoint);
+  /** Transfers of leased and batched reads are only freed once libusb
+      hands them back and their leases are released, on_freed is
+      called after the last of them, right away for plain reads. The
+      handle must stay open until then. */
+  void cancel_read(int endpoint, std::function<void ()> const& on_freed = {});
+
+  /** Flow controlled variant of submit_read(). The endpoint has
+      credits transfers of len bytes, completed transfers are passed
+      to the callback as leases and only resubmitted once the lease is
+      released, so a slow consumer throttles the endpoint instead of
+      losing data or growing memory. */
+  void submit_read_leased(int endpoint, int len, int credits,
+                          std::function<void (USBReadLease)> const& callback);
+
+  /** Batched variant of submit_read() with depth transfers in
+      flight. Completions from the same event handling pass are
+      collected and delivered with a single callback invocation from
+      flush_batches(), after which the transfers are resubmitted. */
+  void submit_read_batched(int endpoint, int len, int depth,
+                           std::function<void (USBReadRecord const*, size_t)> const& callback);
+
+  /** Deliver the completions collected by batched reads, USBGSource
+      calls this after each libusb_handle_events(), code running its
+      own libusb event loop has to do the same */
+  static void flush_batches();
 
   // FIXME: could add a prepare_write() that does what submit_write()
   // does, but uses the callback to fill the data instead of getting
@@ -45,17 +129,134 @@ public:
                     const std::function<bool (libusb_transfer*)>& callback);
   void cancel_write(int endpoint);
 
+  /** Only reports that pass the filter reach the callback of reads on
+      endpoint, filtered reports are resubmitted right away. nullptr
+      removes the filter. */
+  void set_read_filter(int endpoint, std::unique_ptr<USBReportFilter> filter);
+  USBReportFilter* get_read_filter(int endpoint) const;
+
+  /** Allocate transfer buffers from the given arena instead of the
+      heap, must be set before any transfer is submitted */
+  void set_buffer_arena(std::shared_ptr<USBBufferArena> arena);
+
+  /** Set up the queue used by post_write(), must be called from the
+      thread running the main loop before the first post_write() */
+  void enable_threaded_submit();
+
+  /** Thread-safe variant of submit_write() for one-shot writes, the
+      data gets copied and submitted from the main loop. Throws
+      std::logic_error without enable_threaded_submit(). */
+  void post_write(int endpoint, uint8_t const* data, int len);
+
+  /** Called once when the transfers start failing with
+      LIBUSB_ERROR_NO_DEVICE. The transfers are kept around and can be
+      restarted with reattach(). */
+  void set_disconnect_callback(std::function<void ()> const& callback);
+  bool is_disconnected() const { return m_disconnected; }
+
+  /** Claim the interface on a freshly opened handle of the same
+      device without moving over to it yet, throws on failure */
+  void claim_on(libusb_device_handle* handle) const;
+
+  /** Move over to a handle the interface was claimed on with
+      claim_on() and resubmit all transfers that were suspended by the
+      disconnect, keeping their callbacks. When arena is given, it
+      replaces the arena of the old handle and buffers are moved over
+      to it as they get resubmitted. */
+  void reattach(std::shared_ptr<libusb_device_handle> handle,
+                std::shared_ptr<USBBufferArena> arena = {});
+
+  /** Keep a transfer of the caller that completed with
+      LIBUSB_TRANSFER_NO_DEVICE until reattach() resubmits it, used by
+      USBEndpoint. The buffer stays owned by the caller. */
+  void suspend_transfer(libusb_transfer* transfer);
+
+  /** Take back a transfer given to suspend_transfer(), returns false
+      when it isn't suspended */
+  bool take_suspended(libusb_transfer* transfer);
+
+  /** Pass every completed transfer to recorder before it is
+      handled, nullptr stops recording */
+  void set_recorder(std::shared_ptr<USBRecorder> recorder);
+
+  /** Write every completed transfer to a pcapng capture, nullptr
+      stops capturing */
+  void set_capture(std::shared_ptr<USBPcapngWriter> capture);
+
+  libusb_device_handle* get_handle() const { return m_handle; }
+  int get_interface() const { return m_interface; }
+
+  /** LIBUSB_TRANSFER_TYPE_BULK or LIBUSB_TRANSFER_TYPE_INTERRUPT, as
+      declared by the endpoint descriptor, transfers are submitted
+      with the matching type */
+  libusb_transfer_type get_transfer_type(int address) const;
+
+  /** The counters of the endpoint with the given address, as exported
+      by USBMetrics */
+  USBEndpointMetrics* get_metrics(int address);
+
 private:
+  void detect_transfer_types();
   void cancel_transfer(int endpoint);
+  uint8_t* allocate_buffer(int len);
+  void free_transfer(libusb_transfer* transfer);
+  void discard_transfer(libusb_transfer* transfer);
+  void migrate_buffer(libusb_transfer* transfer);
+  bool pass_read_filter(libusb_transfer* transfer);
+  void on_transfer_disconnected(libusb_transfer* transfer);
+  void forget_transfer(libusb_transfer* transfer);
+  bool forget_suspended(libusb_transfer* transfer);
 
   void on_read_data(USBReadData* callback, libusb_transfer *transfer);
+  bool invoke_read_callback(USBReadData* userdata, libusb_transfer* transfer);
+  bool invoke_write_callback(USBWriteData* userdata, libusb_transfer* transfer);
+  void submit_queued_read(int endpoint, int len, int count, USBQueuedRead* read);
+  void on_queued_read_data(USBQueuedRead* read, libusb_transfer* transfer);
+  static void resubmit_queued_transfer(USBQueuedRead* read, libusb_transfer* transfer);
+  static void free_queued_transfer(USBQueuedRead* read, libusb_transfer* transfer);
+  static void delete_queued_read(USBQueuedRead* read);
+  void cancel_queued_read(std::map<int, USBQueuedRead*>::iterator it);
+  void mark_batch_dirty(USBQueuedRead* read);
+  void unmark_batch_dirty(USBQueuedRead* read);
+  static void deliver_batch(USBQueuedRead* read);
   void on_write_data(USBWriteData* callback, libusb_transfer *transfer);
+  libusb_transfer* start_write(int endpoint, uint8_t* data, int len,
+                               std::function<bool (libusb_transfer*)> const& callback);
 
 private:
+  std::shared_ptr<libusb_device_handle> m_handle_ref;
   libusb_device_handle* m_handle;
   int m_interface;
+  bool m_try_detach;
   std::map<int, libusb_transfer*> m_endpoints;
 
+  /** One-shot writes from post_write(), any number of them can be in
+      flight per endpoint */
+  std::map<int, std::set<libusb_transfer*>> m_posted_writes;
+  std::map<int, USBQueuedRead*> m_queued_reads;
+
+  /** Batched reads with completions waiting for flush_batches(),
+      guarded by s_dirty_mutex */
+  std::vector<USBQueuedRead*> m_dirty_batches;
+  std::map<int, std::unique_ptr<USBReportFilter>> m_read_filters;
+
+  bool m_disconnected;
+  std::function<void ()> m_disconnect_callback;
+  std::vector<libusb_transfer*> m_suspended;
+
+  std::unique_ptr<USBSubmitQueue> m_submit_queue;
+  std::shared_ptr<USBBufferArena> m_buffer_arena;
+  std::shared_ptr<USBRecorder> m_recorder;
+  std::shared_ptr<USBPcapngWriter> m_capture;
+  std::map<int, libusb_transfer_type> m_transfer_types;
+
+  std::string m_device_label;
+  std::map<int, USBEndpointMetrics*> m_metrics;
+
+  /** The interfaces with a non-empty m_dirty_batches */
+  static std::mutex s_dirty_mutex;
+  static std::vector<USBInterface*> s_dirty_interfaces;
+
 private:
   USBInterface(const USBInterface&);
   USBInterface& operator=(const USBInterface&);
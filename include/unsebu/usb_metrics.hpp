@@ -0,0 +1,176 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_METRICS_HPP
+#define HEADER_UNSEBU_USB_METRICS_HPP
+
+#include <libusb.h>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+namespace unsebu {
+
+/** Latency histogram with fixed buckets, updated with relaxed atomics */
+class USBMetricsHistogram
+{
+public:
+  static constexpr size_t num_bounds = 8;
+  static const uint64_t bounds_us[num_bounds];
+
+public:
+  USBMetricsHistogram();
+
+  void observe(std::chrono::microseconds duration);
+
+  /** Append the histogram in Prometheus text format */
+  void format(std::string& out, char const* name, std::string const& labels) const;
+
+private:
+  std::atomic<uint64_t> m_buckets[num_bounds + 1];
+  std::atomic<uint64_t> m_sum_us;
+  std::atomic<uint64_t> m_count;
+
+private:
+  USBMetricsHistogram(const USBMetricsHistogram&);
+  USBMetricsHistogram& operator=(const USBMetricsHistogram&);
+};
+
+/** Counters of a single endpoint of a device */
+struct USBEndpointMetrics
+{
+  USBEndpointMetrics(std::string const& device_, uint8_t endpoint_);
+
+  void on_submit() { in_flight.fetch_add(1, std::memory_order_relaxed); }
+  void on_complete(libusb_transfer const* transfer);
+
+  /** A submitted transfer got cancelled and freed without its
+      completion being delivered */
+  void on_cancel();
+
+  std::string const device;
+  uint8_t const endpoint;
+
+  std::atomic<uint64_t> transfers;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> cancelled;
+  std::atomic<uint64_t> errors[LIBUSB_TRANSFER_OVERFLOW + 1]; // indexed by libusb_transfer_status
+  std::atomic<uint64_t> filtered;
+
+  std::atomic<int64_t> in_flight;
+  std::atomic<int64_t> leased;
+
+  USBMetricsHistogram callback_duration;
+
+  // registry list, never unlinked
+  USBEndpointMetrics* next;
+
+private:
+  USBEndpointMetrics(const USBEndpointMetrics&);
+  USBEndpointMetrics& operator=(const USBEndpointMetrics&);
+};
+
+/** Process wide registry of the counters maintained by the library.
+    All counters are plain atomics updated with relaxed ordering and
+    the registry is an append-only list, so reading them for an export
+    never blocks the thread handling USB events. Entries are never
+    freed, pointers to them stay valid for the lifetime of the
+    process. */
+class USBMetrics
+{
+public:
+  static USBMetrics& instance();
+
+public:
+  /** Find or create the counters of endpoint on device, where device
+      is a label as returned by usb_get_device_label(). Only to be
+      called from the thread handling USB events. */
+  USBEndpointMetrics* get_endpoint(std::string const& device, uint8_t endpoint);
+
+  /** Callback and dispatch durations are only measured while timing
+      is enabled, as that needs a clock read before and after. Timing
+      stays enabled until each enable_timing() got its
+      disable_timing(). */
+  void enable_timing() { m_timing_users.fetch_add(1, std::memory_order_relaxed); }
+  void disable_timing() { m_timing_users.fetch_sub(1, std::memory_order_relaxed); }
+  bool is_timing_enabled() const { return m_timing_users.load(std::memory_order_relaxed) > 0; }
+
+  void on_arena_allocate(size_t size_class, bool from_arena);
+  void on_arena_free(size_t size_class, bool from_arena);
+
+  USBMetricsHistogram& get_dispatch_duration() { return m_dispatch_duration; }
+
+  /** All counters in the Prometheus text exposition format */
+  std::string format_prometheus() const;
+
+private:
+  USBMetrics();
+
+private:
+  static constexpr size_t num_size_classes = 4;
+
+  std::atomic<USBEndpointMetrics*> m_endpoints;
+  std::atomic<int> m_timing_users;
+
+  std::atomic<int64_t> m_arena_blocks_in_use[num_size_classes];
+  std::atomic<int64_t> m_heap_buffers_in_use;
+  std::atomic<uint64_t> m_heap_allocations;
+
+  USBMetricsHistogram m_dispatch_duration;
+
+private:
+  USBMetrics(const USBMetrics&);
+  USBMetrics& operator=(const USBMetrics&);
+};
+
+/** Measures the enclosing scope into histogram while timing is enabled */
+class USBMetricsTimer
+{
+public:
+  USBMetricsTimer(USBMetricsHistogram* histogram) :
+    m_histogram(histogram && USBMetrics::instance().is_timing_enabled() ? histogram : nullptr),
+    m_start()
+  {
+    if (m_histogram)
+    {
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~USBMetricsTimer()
+  {
+    if (m_histogram)
+    {
+      m_histogram->observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - m_start));
+    }
+  }
+
+private:
+  USBMetricsHistogram* m_histogram;
+  std::chrono::steady_clock::time_point m_start;
+
+private:
+  USBMetricsTimer(const USBMetricsTimer&);
+  USBMetricsTimer& operator=(const USBMetricsTimer&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
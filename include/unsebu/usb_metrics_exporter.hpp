@@ -0,0 +1,60 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_METRICS_EXPORTER_HPP
+#define HEADER_UNSEBU_USB_METRICS_EXPORTER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+namespace unsebu {
+
+/** Serves USBMetrics in Prometheus text format over HTTP from its own
+    thread, so scrapes never run on the main loop. Timing of callbacks
+    and dispatches is enabled while the exporter exists. */
+class USBMetricsExporter
+{
+public:
+  /** Listen on a unix socket */
+  USBMetricsExporter(std::string const& socket_path);
+
+  /** Listen on 127.0.0.1:port */
+  USBMetricsExporter(uint16_t port);
+
+  ~USBMetricsExporter();
+
+private:
+  void start(int listen_fd);
+  void run();
+  void serve(int client);
+
+private:
+  int m_listen_fd;
+  int m_stop_fd;
+  std::string m_socket_path;
+  std::thread m_thread;
+
+private:
+  USBMetricsExporter(const USBMetricsExporter&);
+  USBMetricsExporter& operator=(const USBMetricsExporter&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
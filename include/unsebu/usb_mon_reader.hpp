@@ -0,0 +1,142 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_MON_READER_HPP
+#define HEADER_UNSEBU_USB_MON_READER_HPP
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "usb_pcapng_writer.hpp"
+
+namespace unsebu {
+
+/** Selects packets by their header, -1 matches anything */
+struct USBMonFilter
+{
+  int busnum = -1;
+  int devnum = -1;
+
+  /** Endpoint number without the direction bit */
+  int endpoint = -1;
+
+  bool match(USBMonHeader const& header) const
+  {
+    return ((busnum < 0 || header.busnum == busnum) &&
+            (devnum < 0 || header.devnum == devnum) &&
+            (endpoint < 0 || (header.epnum & 0x0f) == endpoint));
+  }
+};
+
+/** Packets are handed out in place: data points at the header.len_cap
+    bytes following the header, isochronous descriptors first, and
+    is only valid during the callback */
+using USBMonCallback = std::function<void (USBMonHeader const& header, uint8_t const* data)>;
+
+/** View of a usbmon ring buffer as laid out by the kernel: each packet
+    is a USBMonHeader followed by its captured bytes, padded to 64
+    bytes, and filler packets of type '@' pad the end of the ring
+    before it wraps. The memory can be the mapped ring or the ring
+    image of a fixture. */
+class USBMonRing
+{
+public:
+  USBMonRing(uint8_t const* data, size_t size);
+
+  /** Deliver the packets at the given ring offsets that pass filter,
+      returns the number delivered. Throws std::runtime_error when an
+      offset or packet doesn't fit into the ring. */
+  size_t dispatch(uint32_t const* offsets, size_t count,
+                  USBMonFilter const& filter, USBMonCallback const& callback) const;
+
+  /** Bytes a packet occupies in the ring */
+  static size_t get_packet_size(USBMonHeader const& header);
+
+private:
+  USBMonHeader const* get_header(size_t offset) const;
+
+private:
+  uint8_t const* m_data;
+  size_t m_size;
+};
+
+/** Passive capture from /dev/usbmonN through the mapped ring buffer
+    and MON_IOCX_MFETCH, packets are filtered and delivered without
+    copying them out of the ring. Needs the usbmon module and read
+    access to the device file, no interface gets claimed.
+
+    A fixture replaces the kernel with a recorded ring: a file holding
+    the ring size and the number of events as 32 bit little endian
+    values, followed by the ring image and the ring offset of each
+    event in the order the kernel produced them, filler packets
+    included. Fetching and flushing work the same for both. */
+class USBMonReader
+{
+public:
+  /** Open the usbmon device of bus, 0 for all buses. A ring_size of
+      0 keeps the kernel default. Throws std::runtime_error. */
+  USBMonReader(int bus, size_t ring_size = 0);
+
+  /** Replay the given fixture file. Throws std::runtime_error. */
+  explicit USBMonReader(std::string const& fixture);
+
+  ~USBMonReader();
+
+  void set_filter(USBMonFilter const& filter) { m_filter = filter; }
+
+  /** Wait up to timeout milliseconds for packets and deliver the ones
+      passing the filter, returns the number delivered. Packets of
+      the previous call are released back to the kernel first. */
+  size_t fetch(int timeout, USBMonCallback const& callback);
+
+  /** Events the kernel dropped since opening, because the ring was full */
+  uint32_t get_kernel_dropped() const;
+
+  size_t get_ring_size() const { return m_ring_size; }
+
+  /** Only a fixture runs out, once all its events got released */
+  bool is_exhausted() const { return m_fd < 0 && m_fixture_head >= m_fixture_offsets.size(); }
+
+private:
+  /** MON_IOCX_MFETCH: release nflush events, then store the offsets
+      of up to nfetch of the remaining ones. Returns -1 with errno
+      set on failure. */
+  int mfetch(uint32_t nflush, uint32_t& nfetch);
+
+private:
+  int m_fd;
+  uint8_t* m_ring;
+  size_t m_ring_size;
+  USBMonFilter m_filter;
+  std::vector<uint32_t> m_offsets;
+  uint32_t m_pending_flush;
+
+  std::vector<uint8_t> m_fixture_ring;
+  std::vector<uint32_t> m_fixture_offsets;
+  size_t m_fixture_head;
+
+private:
+  USBMonReader(const USBMonReader&);
+  USBMonReader& operator=(const USBMonReader&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
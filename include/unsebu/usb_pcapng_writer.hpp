@@ -0,0 +1,135 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_PCAPNG_WRITER_HPP
+#define HEADER_UNSEBU_USB_PCAPNG_WRITER_HPP
+
+#include <libusb.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace unsebu {
+
+/** Packet header of the binary usbmon interface (struct mon_bin_hdr
+    in the kernel), which is also the packet format of the pcap link
+    type LINKTYPE_USB_LINUX_MMAPPED. Fields are in host byte order. */
+struct USBMonHeader
+{
+  uint64_t id;
+  uint8_t type;          // 'S'ubmit, 'C'omplete or 'E'rror
+  uint8_t xfer_type;     // 0 iso, 1 interrupt, 2 control, 3 bulk
+  uint8_t epnum;         // with LIBUSB_ENDPOINT_IN for IN endpoints
+  uint8_t devnum;
+  uint16_t busnum;
+  char flag_setup;
+  char flag_data;
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;        // 0 or a negative errno
+  uint32_t length;
+  uint32_t len_cap;
+  uint8_t setup[8];
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;
+};
+static_assert(sizeof(USBMonHeader) == 64, "USBMonHeader must match struct mon_bin_hdr");
+
+constexpr uint16_t usb_linktype_linux_mmapped = 220;
+
+/** Writes USB packets to a pcapng file that Wireshark can open.
+    Packets are collected in large buffers that a writer thread puts
+    to disk, with O_DIRECT when the file system supports it, so
+    write_packet() never waits for I/O. When all buffers are waiting
+    to be written, packets get dropped and counted instead. Packets
+    must be written from a single thread. */
+class USBPcapngWriter
+{
+public:
+  /** Throws std::runtime_error when filename can't be created */
+  USBPcapngWriter(std::string const& filename,
+                  size_t buffer_size = 4 * 1024 * 1024, int max_buffers = 64);
+
+  /** Writes out all remaining packets and waits for the writer thread */
+  ~USBPcapngWriter();
+
+  /** Append a packet with header.len_cap bytes of data, timestamp is
+      in nanoseconds since the epoch. Returns false when the packet
+      was dropped. */
+  bool write_packet(USBMonHeader const& header, uint8_t const* data, uint64_t timestamp);
+
+  /** Append the completion of transfer, timestamped now */
+  bool write_transfer(libusb_transfer const* transfer);
+
+  /** Hand the packets collected so far to the writer thread */
+  void flush();
+
+  uint64_t get_packet_count() const { return m_packets; }
+  uint64_t get_dropped_count() const { return m_dropped; }
+
+  /** errno of the first failed write, 0 if there was none */
+  int get_error() const { return m_error.load(); }
+
+private:
+  struct Buffer;
+
+  void append(void const* data, size_t len);
+  void append_padding(size_t len);
+  bool reserve(size_t len);
+  bool submit_current(bool final);
+  Buffer* acquire_buffer();
+  void write_interface_statistics();
+  void writer_thread();
+  void write_buffer(Buffer* buffer);
+
+private:
+  int m_fd;
+  std::atomic<bool> m_direct;
+  size_t m_buffer_size;
+  int m_max_buffers;
+
+  std::vector<std::unique_ptr<Buffer>> m_buffers;
+  Buffer* m_current;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<Buffer*> m_full;
+  std::vector<Buffer*> m_free;
+  std::thread m_thread;
+
+  uint64_t m_packets;
+  uint64_t m_dropped;
+  uint64_t m_start_time;
+  std::atomic<int> m_error;
+
+private:
+  USBPcapngWriter(const USBPcapngWriter&);
+  USBPcapngWriter& operator=(const USBPcapngWriter&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,91 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_RECONNECT_SUPERVISOR_HPP
+#define HEADER_UNSEBU_USB_RECONNECT_SUPERVISOR_HPP
+
+#include <libusb.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "fwd.hpp"
+
+namespace unsebu {
+
+/** Keeps a device and its claimed interfaces alive across unplug and
+    replug. When the device disappears the interfaces suspend their
+    transfers, when a device with the same serial number (or, lacking
+    one, on the same port) shows up again it gets opened, the
+    interfaces reclaimed and the suspended transfers resubmitted with
+    their original buffers and callbacks. */
+class USBReconnectSupervisor
+{
+public:
+  USBReconnectSupervisor(USBHotplug& hotplug, std::unique_ptr<USBDevice> device,
+                         USBDescriptorCache* descriptor_cache = nullptr);
+  ~USBReconnectSupervisor();
+
+  /** The returned interface stays valid across reconnects */
+  USBInterface& claim_interface(int interface, bool try_detach = false);
+
+  /** Called with false on disconnect and with true after a successful
+      reconnect */
+  void set_connection_callback(std::function<void (bool)> const& callback);
+
+  bool is_connected() const { return m_connected; }
+
+  /** The currently open device, nullptr while disconnected */
+  USBDevice* get_device() const { return m_connected ? m_device.get() : nullptr; }
+
+private:
+  void on_disconnect();
+  void on_hotplug(libusb_device* dev, libusb_hotplug_event event);
+  bool on_idle();
+  void reconnect(libusb_device* dev);
+
+private:
+  USBHotplug& m_hotplug;
+  USBDescriptorCache* m_descriptor_cache;
+  int m_hotplug_id;
+
+  std::unique_ptr<USBDevice> m_device;
+  std::vector<std::unique_ptr<USBInterface>> m_interfaces;
+
+  uint16_t m_id_vendor;
+  uint16_t m_id_product;
+  std::string m_serial;
+  std::string m_port_path;
+
+  bool m_connected;
+  std::function<void (bool)> m_connection_callback;
+
+  std::vector<libusb_device*> m_candidates;
+  guint m_idle_id;
+
+private:
+  USBReconnectSupervisor(const USBReconnectSupervisor&);
+  USBReconnectSupervisor& operator=(const USBReconnectSupervisor&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,78 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_RECORDER_HPP
+#define HEADER_UNSEBU_USB_RECORDER_HPP
+
+#include <libusb.h>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace unsebu {
+
+/** Recording file format, all integers are little endian:
+
+    header:  "USBREC\0\0", uint32 version, uint32 interface,
+             int64 start time (CLOCK_REALTIME in ns),
+             uint16 label length, device label
+    record:  varint ns since the previous record (or since the start),
+             uint8 endpoint, uint8 libusb_transfer_status,
+             varint length, payload
+
+    Payloads are the received data for IN and the sent data for OUT
+    transfers, records of failed transfers have no payload. */
+constexpr char usb_recording_magic[8] = { 'U', 'S', 'B', 'R', 'E', 'C', '\0', '\0' };
+constexpr uint32_t usb_recording_version = 1;
+
+/** Captures the transfer completions of a USBInterface into a
+    recording file, see USBInterface::set_recorder(). Records are
+    collected in memory and written out in large chunks. */
+class USBRecorder
+{
+public:
+  /** Throws std::runtime_error when filename can't be created */
+  USBRecorder(std::string const& filename, libusb_device_handle* handle, int interface);
+  ~USBRecorder();
+
+  /** Called for each completed transfer */
+  void record(libusb_transfer const* transfer);
+
+  /** Write out what has been recorded so far */
+  void flush();
+
+  uint64_t get_record_count() const { return m_count; }
+
+private:
+  void put_varint(uint64_t value);
+
+private:
+  int m_fd;
+  std::vector<uint8_t> m_buffer;
+  std::chrono::steady_clock::time_point m_last_time;
+  uint64_t m_count;
+
+private:
+  USBRecorder(const USBRecorder&);
+  USBRecorder& operator=(const USBRecorder&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,108 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_REPLAYER_HPP
+#define HEADER_UNSEBU_USB_REPLAYER_HPP
+
+#include <libusb.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "fwd.hpp"
+
+namespace unsebu {
+
+/** A single completion from a recording */
+struct USBRecord
+{
+  /** Time since the start of the recording */
+  std::chrono::nanoseconds time;
+  uint8_t endpoint;
+  libusb_transfer_status status;
+  uint8_t const* data;
+  int len;
+};
+
+/** Feeds a recording made with USBRecorder back into read callbacks,
+    so a report pipeline can be run deterministically without the
+    device. Callbacks and filters are registered like with
+    USBInterface and see the same sequence of reports. The replayer
+    stands in for USBInterface, it doesn't drive one, so code using
+    leased or batched reads has to be fed through
+    submit_read_records(). */
+class USBReplayer
+{
+public:
+  enum class Timing
+  {
+    /** Keep the time between completions as recorded */
+    Original,
+
+    /** Deliver the completions back to back */
+    AsFastAsPossible
+  };
+
+public:
+  /** Throws std::runtime_error when the recording can't be read */
+  USBReplayer(std::string const& filename);
+  ~USBReplayer();
+
+  void submit_read(int endpoint, std::function<bool (uint8_t*, int)> const& callback);
+
+  /** Like submit_read(), but the callback gets the recorded status
+      along with the data, as with USBInterface::submit_read_batched() */
+  void submit_read_records(int endpoint, std::function<bool (USBReadRecord const&)> const& callback);
+  void set_read_filter(int endpoint, std::unique_ptr<USBReportFilter> filter);
+
+  /** Deliver the recorded IN completions to the callbacks, blocks
+      until the end of the recording or until all callbacks returned
+      false. Returns the number of callback invocations. */
+  uint64_t run(Timing timing = Timing::Original);
+
+  std::vector<USBRecord> const& get_records() const { return m_records; }
+  std::string const& get_device_label() const { return m_device_label; }
+  int get_interface() const { return m_interface; }
+
+private:
+  void parse();
+
+private:
+  std::vector<uint8_t> m_data;
+  std::vector<USBRecord> m_records;
+  std::string m_device_label;
+  int m_interface;
+
+  std::map<int, std::function<bool (USBReadRecord const&)>> m_callbacks;
+  std::map<int, std::unique_ptr<USBReportFilter>> m_read_filters;
+
+  /** Callbacks get a copy, they are free to modify the data */
+  std::vector<uint8_t> m_scratch;
+
+private:
+  USBReplayer(const USBReplayer&);
+  USBReplayer& operator=(const USBReplayer&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
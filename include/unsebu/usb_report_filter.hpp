@@ -0,0 +1,67 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_REPORT_FILTER_HPP
+#define HEADER_UNSEBU_USB_REPORT_FILTER_HPP
+
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+namespace unsebu {
+
+/** Suppresses reports that are identical to the previous one, as
+    sent by gamepads at a fixed rate even when nothing changed. Bits
+    set in ignore_mask are excluded from the comparison (counters,
+    noisy sensor bits), bytes beyond the end of the mask are compared
+    in full. With a non-zero heartbeat an unchanged report is still
+    passed on once per heartbeat interval. */
+class USBReportFilter
+{
+public:
+  USBReportFilter(std::vector<uint8_t> const& ignore_mask = {},
+                  std::chrono::milliseconds heartbeat = std::chrono::milliseconds(0));
+
+  /** Returns true when the report should be passed on */
+  bool check(uint8_t const* data, int len);
+
+  uint64_t get_passed_count() const { return m_passed; }
+  uint64_t get_suppressed_count() const { return m_suppressed; }
+
+private:
+  bool equals_last(uint8_t const* data, size_t len) const;
+  void store(uint8_t const* data, size_t len);
+
+private:
+  std::vector<uint8_t> m_ignore_mask;
+  std::chrono::milliseconds m_heartbeat;
+
+  // the last report and the compare mask are padded to a multiple of 16
+  std::vector<uint8_t> m_last;
+  std::vector<uint8_t> m_compare_mask;
+  size_t m_last_len;
+  bool m_has_last;
+  std::chrono::steady_clock::time_point m_last_passed;
+
+  uint64_t m_passed;
+  uint64_t m_suppressed;
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
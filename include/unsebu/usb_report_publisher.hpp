@@ -0,0 +1,77 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_REPORT_PUBLISHER_HPP
+#define HEADER_UNSEBU_USB_REPORT_PUBLISHER_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include <glib.h>
+
+#include "fwd.hpp"
+
+namespace unsebu {
+
+struct USBReportRingHeader;
+
+/** Publishes reports into a memfd backed ring that any number of
+    USBReportSubscribers in other processes can map and read at their
+    own pace. The publisher never waits for readers, a reader that
+    falls more than slot_count reports behind gets overrun. */
+class USBReportPublisher
+{
+public:
+  USBReportPublisher(uint32_t slot_count = 1024, uint32_t slot_size = 64);
+  ~USBReportPublisher();
+
+  /** Hand out the ring to every process that connects to the unix
+      socket at socket_path, accepting happens in the main loop */
+  void listen(std::string const& socket_path);
+
+  /** Read len byte reports from endpoint of iface and publish each
+      completed read */
+  void attach(USBInterface& iface, int endpoint, int len);
+
+  /** Reports larger than slot_size are truncated */
+  void publish(uint8_t endpoint, uint8_t const* data, int len);
+
+  int get_fd() const { return m_memfd; }
+  uint64_t get_seq() const { return m_seq; }
+
+private:
+  bool on_accept();
+
+private:
+  int m_memfd;
+  size_t m_size;
+  USBReportRingHeader* m_header;
+  uint64_t m_seq;
+
+  int m_listen_fd;
+  guint m_source_id;
+  std::string m_socket_path;
+
+private:
+  USBReportPublisher(const USBReportPublisher&);
+  USBReportPublisher& operator=(const USBReportPublisher&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
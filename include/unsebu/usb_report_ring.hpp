@@ -0,0 +1,89 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_REPORT_RING_HPP
+#define HEADER_UNSEBU_USB_REPORT_RING_HPP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace unsebu {
+
+/** Memory layout of the report ring shared between a
+    USBReportPublisher and its USBReportSubscribers. The header is
+    followed by slot_count slots of slot_stride bytes each. Report n
+    (counting from 1) goes into slot n % slot_count, its seq is 2n-1
+    while the publisher writes it and 2n once it is complete, so
+    readers can tell a torn read and an overrun apart from a slot that
+    is simply not written yet. */
+struct USBReportRingHeader
+{
+  static constexpr uint32_t magic_value = 0x52425355; // "USBR"
+  static constexpr uint32_t version_value = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;   // maximum payload per slot
+  uint32_t slot_stride; // bytes per slot including USBReportRingSlot
+  uint32_t reserved;
+
+  /** Sequence number of the last completed report */
+  alignas(64) std::atomic<uint64_t> write_seq;
+};
+
+struct alignas(64) USBReportRingSlot
+{
+  std::atomic<uint64_t> seq;
+  uint64_t timestamp; // CLOCK_MONOTONIC in nanoseconds
+  uint8_t endpoint;
+  uint8_t reserved;
+  uint16_t len;
+  // payload follows
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the report ring requires lock-free 64-bit atomics");
+
+inline size_t usb_report_ring_stride(uint32_t slot_size)
+{
+  return (sizeof(USBReportRingSlot) + slot_size + 63) & ~static_cast<size_t>(63);
+}
+
+inline size_t usb_report_ring_size(uint32_t slot_count, uint32_t slot_size)
+{
+  size_t const header_size = (sizeof(USBReportRingHeader) + 63) & ~static_cast<size_t>(63);
+  return header_size + slot_count * usb_report_ring_stride(slot_size);
+}
+
+inline USBReportRingSlot* usb_report_ring_slot(USBReportRingHeader* header, uint64_t seq)
+{
+  size_t const header_size = (sizeof(USBReportRingHeader) + 63) & ~static_cast<size_t>(63);
+  return reinterpret_cast<USBReportRingSlot*>(reinterpret_cast<uint8_t*>(header) + header_size +
+                                              (seq % header->slot_count) * header->slot_stride);
+}
+
+inline uint8_t* usb_report_ring_payload(USBReportRingSlot* slot)
+{
+  return reinterpret_cast<uint8_t*>(slot) + sizeof(USBReportRingSlot);
+}
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
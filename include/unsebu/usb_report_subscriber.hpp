@@ -0,0 +1,83 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_REPORT_SUBSCRIBER_HPP
+#define HEADER_UNSEBU_USB_REPORT_SUBSCRIBER_HPP
+
+#include <stdint.h>
+#include <string>
+
+namespace unsebu {
+
+struct USBReportRingHeader;
+
+/** A report read from the ring, data points into the caller supplied
+    buffer */
+struct USBReport
+{
+  uint64_t seq;
+  uint64_t timestamp;
+  uint8_t endpoint;
+  uint8_t const* data;
+  int len;
+};
+
+/** Reader side of the ring written by USBReportPublisher. Doesn't
+    depend on libusb or glib and only reads the shared mapping, so any
+    number of subscribers can follow the same publisher. */
+class USBReportSubscriber
+{
+public:
+  enum class Result { Report, Empty, Overrun };
+
+public:
+  /** Connect to the socket given to USBReportPublisher::listen() */
+  static USBReportSubscriber connect(std::string const& socket_path);
+
+  /** Map the ring from a memfd, takes ownership of fd. Reading starts
+      with the next report published. */
+  USBReportSubscriber(int fd);
+  USBReportSubscriber(USBReportSubscriber&& other);
+  ~USBReportSubscriber();
+
+  /** Copy the next report into buffer, which must hold
+      get_slot_size() bytes. Returns Empty when no new report is
+      available. Returns Overrun when the publisher has overwritten
+      reports that weren't read yet, reading then continues with the
+      oldest report still in the ring and get_lost_count() tells how
+      many were skipped. */
+  Result read(USBReport& report, uint8_t* buffer);
+
+  uint32_t get_slot_size() const;
+  uint64_t get_lost_count() const { return m_lost; }
+
+private:
+  int m_fd;
+  size_t m_size;
+  USBReportRingHeader* m_header;
+  uint64_t m_next_seq;
+  uint64_t m_lost;
+
+private:
+  USBReportSubscriber(const USBReportSubscriber&);
+  USBReportSubscriber& operator=(const USBReportSubscriber&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
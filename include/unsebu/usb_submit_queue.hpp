@@ -0,0 +1,82 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_SUBMIT_QUEUE_HPP
+#define HEADER_UNSEBU_USB_SUBMIT_QUEUE_HPP
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include <glib.h>
+
+namespace unsebu {
+
+/** Lock-free multi-producer single-consumer queue that hands writes
+    from arbitrary threads over to the thread running the main loop.
+    Producers link a node with a single atomic exchange and wake the
+    main loop through an eventfd, which then drains the queue and
+    passes each entry to the submit function. */
+class USBSubmitQueue
+{
+public:
+  using SubmitFunc = std::function<void (int endpoint, uint8_t* data, int len)>;
+
+public:
+  USBSubmitQueue(SubmitFunc const& submit);
+  ~USBSubmitQueue();
+
+  /** Thread-safe, the data is copied */
+  void push(int endpoint, uint8_t const* data, int len);
+
+private:
+  struct Node
+  {
+    std::atomic<Node*> next;
+    int endpoint;
+    std::vector<uint8_t> data;
+  };
+
+  enum class PopResult { Item, Empty, Retry };
+
+private:
+  PopResult pop(Node*& node);
+  void wakeup();
+  bool on_wakeup();
+
+private:
+  SubmitFunc m_submit;
+
+  // producers push at m_head, the consumer pops at m_tail
+  std::atomic<Node*> m_head;
+  Node* m_tail;
+  Node m_stub;
+
+  int m_eventfd;
+  guint m_source_id;
+  std::atomic<bool> m_wakeup_pending;
+
+private:
+  USBSubmitQueue(const USBSubmitQueue&);
+  USBSubmitQueue& operator=(const USBSubmitQueue&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
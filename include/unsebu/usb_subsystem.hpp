@@ -21,19 +21,57 @@
 
 #include <libusb.h>
 #include <memory>
+#include <vector>
 
 #include "fwd.hpp"
 
 namespace unsebu {
 
+struct USBOpenRequest
+{
+  libusb_device* device;
+  std::vector<int> interfaces;
+  bool try_detach;
+};
+
+struct USBOpenResult
+{
+  /** The opened handle with all requested interfaces claimed, or
+      nullptr on failure, the caller takes ownership */
+  libusb_device_handle* handle;
+
+  /** LIBUSB_SUCCESS or the error returned by libusb_open() or
+      usb_claim_n_detach_interface() */
+  int error;
+
+  /** The interface that failed to be claimed or -1 */
+  int failed_interface;
+};
+
 class USBSubsystem
 {
 public:
   USBSubsystem();
   ~USBSubsystem();
 
+  /** Open the given devices and claim their interfaces, using up to
+      max_workers threads so that slow kernel driver detaches run
+      concurrently. Results are returned in the order of the
+      requests. A device that fails is closed again with all its
+      interfaces released. Constructing a USBInterface on a returned
+      handle doesn't touch the kernel again, as libusb remembers the
+      claimed interfaces. When a worker thread can't be started the
+      devices opened so far are closed again and std::system_error is
+      thrown. */
+  std::vector<USBOpenResult> open_devices(std::vector<USBOpenRequest> const& requests,
+                                          int max_workers = 8);
+
+  /** Returns nullptr when libusb lacks hotplug support */
+  USBHotplug* get_hotplug() const { return m_usb_hotplug.get(); }
+
 private:
   std::unique_ptr<USBGSource> m_usb_gsource;
+  std::unique_ptr<USBHotplug> m_usb_hotplug;
 
 private:
   USBSubsystem(const USBSubsystem&);
@@ -0,0 +1,134 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_TRACE_HPP
+#define HEADER_UNSEBU_USB_TRACE_HPP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace unsebu {
+
+enum class USBTracePoint : uint8_t
+{
+  SourcePrepare,
+  SourceCheck,
+  SourceDispatch,
+  Submit,
+  Complete,
+  Callback,
+  Resubmit
+};
+
+enum class USBTracePhase : uint8_t
+{
+  Begin,
+  End,
+  Instant
+};
+
+struct USBTraceRecord
+{
+  uint64_t timestamp; // CLOCK_MONOTONIC in nanoseconds
+  USBTracePoint point;
+  USBTracePhase phase;
+  uint8_t endpoint;
+  uint8_t reserved;
+  int32_t value; // transfer status, length or similar
+};
+
+/** Records trace points into a fixed size ring per thread. Writing a
+    record takes no lock, the rings are only locked while a new thread
+    registers its ring and while dumping. While tracing is disabled a
+    trace point costs a single relaxed atomic load. */
+class USBTrace
+{
+public:
+  /** Start recording, each thread keeps the last ring_size records */
+  static void enable(size_t ring_size = 1 << 16);
+  static void disable();
+  static bool is_enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+  static void record(USBTracePoint point, USBTracePhase phase, uint8_t endpoint, int32_t value);
+
+  /** Write the content of all rings as Chrome trace event JSON, as
+      understood by chrome://tracing and the Perfetto UI. Returns false
+      when the file can't be written. */
+  static bool dump_chrome_json(std::string const& filename);
+
+private:
+  static std::atomic<bool> s_enabled;
+};
+
+/** Records a Begin and End pair around a scope */
+class USBTraceScope
+{
+public:
+  USBTraceScope(USBTracePoint point, uint8_t endpoint, int32_t value = 0) :
+    m_point(point),
+    m_endpoint(endpoint),
+    m_active(USBTrace::is_enabled())
+  {
+    if (m_active)
+    {
+      USBTrace::record(m_point, USBTracePhase::Begin, m_endpoint, value);
+    }
+  }
+
+  ~USBTraceScope()
+  {
+    if (m_active)
+    {
+      USBTrace::record(m_point, USBTracePhase::End, m_endpoint, 0);
+    }
+  }
+
+private:
+  USBTracePoint m_point;
+  uint8_t m_endpoint;
+  bool m_active;
+
+private:
+  USBTraceScope(const USBTraceScope&);
+  USBTraceScope& operator=(const USBTraceScope&);
+};
+
+} // namespace unsebu
+
+#ifdef UNSEBU_NO_TRACE
+#  define UNSEBU_TRACE(point, phase, endpoint, value) do {} while(false)
+#  define UNSEBU_TRACE_SCOPE(point, endpoint) do {} while(false)
+#else
+#  define UNSEBU_TRACE(point, phase, endpoint, value)                   \
+  do {                                                                  \
+    if (::unsebu::USBTrace::is_enabled())                               \
+    {                                                                   \
+      ::unsebu::USBTrace::record(::unsebu::USBTracePoint::point,        \
+                                 ::unsebu::USBTracePhase::phase,        \
+                                 static_cast<uint8_t>(endpoint),        \
+                                 static_cast<int32_t>(value));          \
+    }                                                                   \
+  } while(false)
+#  define UNSEBU_TRACE_SCOPE(point, endpoint)                           \
+  ::unsebu::USBTraceScope unsebu_trace_scope_(::unsebu::USBTracePoint::point, \
+                                              static_cast<uint8_t>(endpoint))
+#endif
+
+#endif
+
+/* EOF */
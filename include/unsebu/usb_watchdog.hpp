@@ -0,0 +1,139 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_WATCHDOG_HPP
+#define HEADER_UNSEBU_USB_WATCHDOG_HPP
+
+#include <libusb.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace unsebu {
+
+struct USBWatchdogEntry
+{
+  enum class Kind { Callback, EventPass };
+
+  Kind kind;
+  std::chrono::microseconds duration;
+  uint8_t endpoint; // 0 for event passes
+  std::string device; // port path and vendor:product, empty for event passes
+  std::chrono::system_clock::time_point when;
+};
+
+/** Times user callbacks and libusb event handling passes and reports
+    the ones that take longer than threshold, as a single blocking
+    callback stalls every device handled by the same loop. The
+    watchdog is active while it exists, only one can exist at a
+    time. Statistics can be queried from any thread. */
+class USBWatchdog
+{
+public:
+  /** The installed watchdog or nullptr */
+  static USBWatchdog* current() { return s_current.load(std::memory_order_acquire); }
+
+public:
+  USBWatchdog(std::chrono::microseconds threshold, size_t top_n = 10);
+  ~USBWatchdog();
+
+  void report_callback(libusb_device_handle* handle, uint8_t endpoint, std::chrono::microseconds duration);
+  void report_event_pass(std::chrono::microseconds duration);
+
+  uint64_t get_callback_count() const { return m_callbacks.load(std::memory_order_relaxed); }
+  uint64_t get_slow_callback_count() const { return m_slow_callbacks.load(std::memory_order_relaxed); }
+  uint64_t get_event_pass_count() const { return m_event_passes.load(std::memory_order_relaxed); }
+  uint64_t get_slow_event_pass_count() const { return m_slow_event_passes.load(std::memory_order_relaxed); }
+
+  /** The top_n slowest offenders seen so far, slowest first */
+  std::vector<USBWatchdogEntry> get_slowest() const;
+
+private:
+  void add_offender(USBWatchdogEntry entry);
+
+private:
+  static std::atomic<USBWatchdog*> s_current;
+
+  std::chrono::microseconds m_threshold;
+  size_t m_top_n;
+
+  std::atomic<uint64_t> m_callbacks;
+  std::atomic<uint64_t> m_slow_callbacks;
+  std::atomic<uint64_t> m_event_passes;
+  std::atomic<uint64_t> m_slow_event_passes;
+
+  mutable std::mutex m_mutex;
+  std::vector<USBWatchdogEntry> m_slowest;
+
+private:
+  USBWatchdog(const USBWatchdog&);
+  USBWatchdog& operator=(const USBWatchdog&);
+};
+
+/** Times the enclosing scope when a watchdog is installed. A handle
+    of nullptr times an event handling pass, otherwise a callback on
+    endpoint of that device. */
+class USBWatchdogScope
+{
+public:
+  USBWatchdogScope(libusb_device_handle* handle = nullptr, uint8_t endpoint = 0) :
+    m_watchdog(USBWatchdog::current()),
+    m_handle(handle),
+    m_endpoint(endpoint),
+    m_start()
+  {
+    if (m_watchdog)
+    {
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~USBWatchdogScope()
+  {
+    if (m_watchdog)
+    {
+      auto const duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - m_start);
+      if (m_handle)
+      {
+        m_watchdog->report_callback(m_handle, m_endpoint, duration);
+      }
+      else
+      {
+        m_watchdog->report_event_pass(duration);
+      }
+    }
+  }
+
+private:
+  USBWatchdog* m_watchdog;
+  libusb_device_handle* m_handle;
+  uint8_t m_endpoint;
+  std::chrono::steady_clock::time_point m_start;
+
+private:
+  USBWatchdogScope(const USBWatchdogScope&);
+  USBWatchdogScope& operator=(const USBWatchdogScope&);
+};
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
@@ -0,0 +1,1391 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_mock.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+// libusb changed a few enum parameters to int in 1.0.25
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000109)
+typedef int usb_mock_error_t;
+typedef int usb_mock_hotplug_event_t;
+typedef int usb_mock_hotplug_flag_t;
+#else
+typedef enum libusb_error usb_mock_error_t;
+typedef libusb_hotplug_event usb_mock_hotplug_event_t;
+typedef libusb_hotplug_flag usb_mock_hotplug_flag_t;
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct USBMockEndpointState
+{
+  unsebu::USBMockEndpointConfig const* config;
+  Clock::time_point next_report;
+  uint64_t report_seq;
+  uint64_t transfer_count;
+  bool stall_pending;
+};
+
+/** Bookkeeping placed in front of each libusb_transfer, like libusb
+    does with its own private transfer data */
+struct USBMockTransfer
+{
+  uint64_t generation;
+  bool in_flight;
+};
+
+constexpr size_t transfer_header_size =
+  (sizeof(USBMockTransfer) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+USBMockTransfer* get_mock_transfer(libusb_transfer* transfer)
+{
+  return reinterpret_cast<USBMockTransfer*>(reinterpret_cast<char*>(transfer) - transfer_header_size);
+}
+
+/** Index into libusb_device::endpoint_index for an endpoint address */
+int endpoint_slot(uint8_t address)
+{
+  return (address & LIBUSB_ENDPOINT_ADDRESS_MASK) | ((address & LIBUSB_ENDPOINT_IN) ? 16 : 0);
+}
+
+} // namespace
+
+struct libusb_device
+{
+  unsebu::USBMockDeviceConfig config;
+  bool present;
+  int refcount;
+  uint32_t claimed;
+  std::vector<USBMockEndpointState> endpoints;
+  int8_t endpoint_index[32];
+};
+
+struct libusb_device_handle
+{
+  libusb_device* dev;
+  uint32_t claimed;
+
+  /** Stands in for the usbfs fd libusb polls per open device, it
+      never becomes ready */
+  int fd;
+};
+
+namespace unsebu {
+
+namespace {
+
+struct USBMockPending
+{
+  Clock::time_point due;
+  uint64_t seq;
+  libusb_transfer* transfer;
+  uint64_t generation;
+  libusb_transfer_status status;
+  USBMockEndpointState* endpoint;
+  uint64_t report_seq;
+};
+
+struct USBMockPendingLater
+{
+  bool operator()(USBMockPending const& lhs, USBMockPending const& rhs) const
+  {
+    return lhs.due > rhs.due || (lhs.due == rhs.due && lhs.seq > rhs.seq);
+  }
+};
+
+struct USBMockHotplugCallback
+{
+  libusb_hotplug_callback_handle handle;
+  int events;
+  int vendor_id;
+  int product_id;
+  libusb_hotplug_callback_fn callback;
+  void* user_data;
+};
+
+struct USBMockHotplugEvent
+{
+  libusb_device* dev;
+  libusb_hotplug_event event;
+};
+
+struct USBMockConfigDescriptor
+{
+  libusb_config_descriptor config;
+  std::vector<libusb_interface> interfaces;
+  std::vector<libusb_interface_descriptor> altsettings;
+  std::vector<std::vector<libusb_endpoint_descriptor>> endpoints;
+  std::vector<std::vector<unsigned char>> extras;
+};
+
+/** State of the simulated bus, shared by the libusb entry points */
+class USBMockBackend
+{
+public:
+  static USBMockBackend& instance()
+  {
+    static USBMockBackend backend;
+    return backend;
+  }
+
+public:
+  USBMockBackend() :
+    m_mutex(),
+    m_devices(),
+    m_ready(),
+    m_timed(),
+    m_next_seq(0),
+    m_hotplug_events(),
+    m_hotplug_callbacks(),
+    m_next_hotplug_handle(1),
+    m_config_descriptors(),
+    m_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+    m_armed(Clock::time_point::max()),
+    m_handles(),
+    m_pollfd_added(nullptr),
+    m_pollfd_removed(nullptr),
+    m_pollfd_userdata(nullptr),
+    m_spare_batch(),
+    m_dispatching(nullptr),
+    m_completions(0)
+  {
+    if (m_timer_fd < 0)
+    {
+      throw std::runtime_error(fmt::format("timerfd_create() failed: {}", strerror(errno)));
+    }
+  }
+
+  libusb_device* add_device(USBMockDeviceConfig const& config)
+  {
+    auto dev = std::make_unique<libusb_device>();
+    dev->config = config;
+    dev->present = true;
+    dev->refcount = 0;
+    dev->claimed = 0;
+    std::fill(std::begin(dev->endpoint_index), std::end(dev->endpoint_index), -1);
+
+    dev->endpoints.reserve(dev->config.endpoints.size());
+    for(auto const& ep : dev->config.endpoints)
+    {
+      dev->endpoint_index[endpoint_slot(ep.address)] = static_cast<int8_t>(dev->endpoints.size());
+      dev->endpoints.push_back(USBMockEndpointState{&ep, Clock::time_point(), 0, 0, false});
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_devices.push_back(std::move(dev));
+    libusb_device* result = m_devices.back().get();
+    queue_hotplug_event(result, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    return result;
+  }
+
+  void set_present(libusb_device* dev, bool present)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (dev->present == present)
+    {
+      return;
+    }
+
+    dev->present = present;
+    dev->claimed = 0;
+
+    if (present)
+    {
+      for(auto& ep : dev->endpoints)
+      {
+        ep.next_report = Clock::time_point();
+        ep.stall_pending = false;
+      }
+      queue_hotplug_event(dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    }
+    else
+    {
+      // complete everything in flight on the device right away
+      std::vector<USBMockPending> pending;
+      auto collect = [dev, &pending](USBMockPending const& entry) {
+        USBMockTransfer* mock = get_mock_transfer(entry.transfer);
+        if (mock->in_flight && mock->generation == entry.generation &&
+            entry.transfer->dev_handle->dev == dev)
+        {
+          pending.push_back(entry);
+        }
+      };
+      std::for_each(m_ready.begin(), m_ready.end(), collect);
+      std::for_each(m_timed.begin(), m_timed.end(), collect);
+
+      Clock::time_point const now = Clock::now();
+      for(auto& entry : pending)
+      {
+        enqueue_completion(entry.transfer, now, LIBUSB_TRANSFER_NO_DEVICE, nullptr, 0, now);
+      }
+
+      queue_hotplug_event(dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+    }
+  }
+
+  void stall(libusb_device* dev, uint8_t endpoint)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (USBMockEndpointState* ep = find_endpoint(dev, endpoint))
+    {
+      ep->stall_pending = true;
+    }
+  }
+
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ready.clear();
+    m_timed.clear();
+    m_hotplug_events.clear();
+    m_devices.clear();
+  }
+
+  uint64_t get_completion_count() const
+  {
+    return m_completions.load(std::memory_order_relaxed);
+  }
+
+  ssize_t get_device_list(libusb_device*** list)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    libusb_device** result = static_cast<libusb_device**>(calloc(m_devices.size() + 1, sizeof(libusb_device*)));
+    if (!result)
+    {
+      return LIBUSB_ERROR_NO_MEM;
+    }
+
+    ssize_t count = 0;
+    for(auto const& dev : m_devices)
+    {
+      if (dev->present)
+      {
+        dev->refcount += 1;
+        result[count++] = dev.get();
+      }
+    }
+
+    *list = result;
+    return count;
+  }
+
+  libusb_device* ref_device(libusb_device* dev)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    dev->refcount += 1;
+    return dev;
+  }
+
+  void unref_device(libusb_device* dev)
+  {
+    // devices are owned by the backend and live until reset()
+    std::lock_guard<std::mutex> lock(m_mutex);
+    dev->refcount -= 1;
+  }
+
+  int open(libusb_device* dev, libusb_device_handle** handle)
+  {
+    libusb_pollfd_added_cb added;
+    void* userdata;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!dev->present)
+      {
+        return LIBUSB_ERROR_NO_DEVICE;
+      }
+
+      int const fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (fd < 0)
+      {
+        return LIBUSB_ERROR_NO_MEM;
+      }
+
+      dev->refcount += 1;
+      *handle = new libusb_device_handle{dev, 0, fd};
+      m_handles.push_back(*handle);
+
+      added = m_pollfd_added;
+      userdata = m_pollfd_userdata;
+    }
+
+    if (added)
+    {
+      added((*handle)->fd, POLLIN, userdata);
+    }
+    return LIBUSB_SUCCESS;
+  }
+
+  void close(libusb_device_handle* handle)
+  {
+    libusb_pollfd_removed_cb removed;
+    void* userdata;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      handle->dev->claimed &= ~handle->claimed;
+      handle->dev->refcount -= 1;
+      m_handles.erase(std::remove(m_handles.begin(), m_handles.end(), handle), m_handles.end());
+
+      removed = m_pollfd_removed;
+      userdata = m_pollfd_userdata;
+    }
+
+    if (removed)
+    {
+      removed(handle->fd, userdata);
+    }
+    ::close(handle->fd);
+    delete handle;
+  }
+
+  void set_pollfd_notifiers(libusb_pollfd_added_cb added, libusb_pollfd_removed_cb removed, void* userdata)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pollfd_added = added;
+    m_pollfd_removed = removed;
+    m_pollfd_userdata = userdata;
+  }
+
+  /** The timer followed by the fds of all open handles */
+  std::vector<int> get_fds() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<int> fds{m_timer_fd};
+    for(libusb_device_handle const* handle : m_handles)
+    {
+      fds.push_back(handle->fd);
+    }
+    return fds;
+  }
+
+  int claim_interface(libusb_device_handle* handle, int interface)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    libusb_device* dev = handle->dev;
+    if (!dev->present)
+    {
+      return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (interface < 0 || interface >= dev->config.num_interfaces || interface >= 32)
+    {
+      return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    uint32_t const bit = 1u << interface;
+    if ((dev->claimed & bit) && !(handle->claimed & bit))
+    {
+      return LIBUSB_ERROR_BUSY;
+    }
+
+    dev->claimed |= bit;
+    handle->claimed |= bit;
+    return LIBUSB_SUCCESS;
+  }
+
+  int release_interface(libusb_device_handle* handle, int interface)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (interface < 0 || interface >= 32 || !(handle->claimed & (1u << interface)))
+    {
+      return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    handle->claimed &= ~(1u << interface);
+    handle->dev->claimed &= ~(1u << interface);
+    return handle->dev->present ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  int get_config_descriptor(libusb_device* dev, libusb_config_descriptor** config);
+  void free_config_descriptor(libusb_config_descriptor* config);
+
+  int submit(libusb_transfer* transfer);
+  int cancel(libusb_transfer* transfer);
+
+  /** Forget all pending completions of a transfer that is about to be
+      freed, USBInterface frees cancelled transfers right away */
+  void forget(libusb_transfer* transfer);
+
+  int register_hotplug(int events, int flags, int vendor_id, int product_id,
+                       libusb_hotplug_callback_fn callback, void* user_data,
+                       libusb_hotplug_callback_handle* handle);
+  void deregister_hotplug(libusb_hotplug_callback_handle handle);
+
+  int handle_events(struct timeval* tv);
+
+private:
+  USBMockEndpointState* find_endpoint(libusb_device* dev, uint8_t address)
+  {
+    int const idx = dev->endpoint_index[endpoint_slot(address)];
+    return idx < 0 ? nullptr : &dev->endpoints[static_cast<size_t>(idx)];
+  }
+
+  void queue_hotplug_event(libusb_device* dev, libusb_hotplug_event event)
+  {
+    m_hotplug_events.push_back(USBMockHotplugEvent{dev, event});
+    arm_timer(Clock::time_point());
+  }
+
+  /** Must be called with m_mutex held */
+  void enqueue_completion(libusb_transfer* transfer, Clock::time_point due, libusb_transfer_status status,
+                          USBMockEndpointState* endpoint, uint64_t report_seq, Clock::time_point now)
+  {
+    USBMockTransfer* mock = get_mock_transfer(transfer);
+    mock->in_flight = true;
+    mock->generation += 1;
+
+    USBMockPending const entry{due, m_next_seq++, transfer, mock->generation, status, endpoint, report_seq};
+    if (due <= now)
+    {
+      m_ready.push_back(entry);
+    }
+    else
+    {
+      m_timed.push_back(entry);
+      std::push_heap(m_timed.begin(), m_timed.end(), USBMockPendingLater());
+    }
+    arm_timer(due);
+  }
+
+  /** Make sure the timerfd becomes readable no later than due */
+  void arm_timer(Clock::time_point due)
+  {
+    if (due < m_armed)
+    {
+      set_timer(due);
+    }
+  }
+
+  void set_timer(Clock::time_point due)
+  {
+    itimerspec spec = {};
+    if (due != Clock::time_point::max())
+    {
+      // steady_clock is CLOCK_MONOTONIC, a time in the past fires
+      // immediately, but a zero it_value would disarm
+      auto const ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          due.time_since_epoch()).count());
+      spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+      spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+    }
+
+    if (timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    {
+      throw std::runtime_error(fmt::format("timerfd_settime() failed: {}", strerror(errno)));
+    }
+    m_armed = due;
+  }
+
+  /** Rearm the timer for what is left after an event pass, the timer
+      is left alone while it has fired and more work is ready, so
+      back-to-back completions cost no syscalls */
+  void update_timer(Clock::time_point now)
+  {
+    Clock::time_point next = Clock::time_point::max();
+    if (!m_ready.empty() || !m_hotplug_events.empty())
+    {
+      next = now;
+    }
+    else if (!m_timed.empty())
+    {
+      next = m_timed.front().due;
+    }
+
+    if (next <= now && m_armed <= now)
+    {
+      return;
+    }
+
+    uint64_t expirations;
+    if (read(m_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+      throw std::runtime_error(fmt::format("read() from timerfd failed: {}", strerror(errno)));
+    }
+    set_timer(next);
+  }
+
+  bool has_due_work(Clock::time_point now) const
+  {
+    return !m_ready.empty() || !m_hotplug_events.empty() ||
+      (!m_timed.empty() && m_timed.front().due <= now);
+  }
+
+  void complete(USBMockPending const& entry);
+  int handle_control(libusb_device* dev, libusb_transfer* transfer);
+  void deliver_hotplug(std::vector<USBMockHotplugEvent> const& events);
+
+private:
+  mutable std::mutex m_mutex;
+  std::vector<std::unique_ptr<libusb_device>> m_devices;
+
+  /** Completions that are due immediately, in submit order */
+  std::deque<USBMockPending> m_ready;
+
+  /** Completions due in the future, a min-heap on due time */
+  std::vector<USBMockPending> m_timed;
+  uint64_t m_next_seq;
+
+  std::vector<USBMockHotplugEvent> m_hotplug_events;
+  std::vector<USBMockHotplugCallback> m_hotplug_callbacks;
+  libusb_hotplug_callback_handle m_next_hotplug_handle;
+
+  std::map<libusb_config_descriptor*, std::unique_ptr<USBMockConfigDescriptor>> m_config_descriptors;
+
+  int m_timer_fd;
+  Clock::time_point m_armed;
+
+  std::vector<libusb_device_handle*> m_handles;
+  libusb_pollfd_added_cb m_pollfd_added;
+  libusb_pollfd_removed_cb m_pollfd_removed;
+  void* m_pollfd_userdata;
+
+  std::vector<USBMockPending> m_spare_batch;
+
+  /** The batch handle_events() is delivering, its entries of freed
+      transfers are cleared by forget() */
+  std::vector<USBMockPending>* m_dispatching;
+
+  std::atomic<uint64_t> m_completions;
+
+private:
+  USBMockBackend(const USBMockBackend&);
+  USBMockBackend& operator=(const USBMockBackend&);
+};
+
+int
+USBMockBackend::get_config_descriptor(libusb_device* dev, libusb_config_descriptor** config)
+{
+  auto desc = std::make_unique<USBMockConfigDescriptor>();
+  USBMockDeviceConfig const& cfg = dev->config;
+
+  size_t const num_interfaces = static_cast<size_t>(std::max(0, cfg.num_interfaces));
+  desc->interfaces.resize(num_interfaces);
+  desc->altsettings.resize(num_interfaces);
+  desc->endpoints.resize(num_interfaces);
+  desc->extras.resize(num_interfaces);
+
+  for(size_t i = 0; i < num_interfaces; ++i)
+  {
+    for(auto const& ep : cfg.endpoints)
+    {
+      if (ep.interface == static_cast<int>(i))
+      {
+        libusb_endpoint_descriptor ep_desc = {};
+        ep_desc.bLength = 7;
+        ep_desc.bDescriptorType = LIBUSB_DT_ENDPOINT;
+        ep_desc.bEndpointAddress = ep.address;
+        ep_desc.bmAttributes = ep.type;
+        ep_desc.wMaxPacketSize = ep.max_packet_size;
+        ep_desc.bInterval = static_cast<uint8_t>(std::min<int64_t>(255, std::max<int64_t>(1, ep.interval.count() / 1000)));
+        desc->endpoints[i].push_back(ep_desc);
+      }
+    }
+
+    libusb_interface_descriptor& alt = desc->altsettings[i];
+    alt = {};
+    alt.bLength = 9;
+    alt.bDescriptorType = LIBUSB_DT_INTERFACE;
+    alt.bInterfaceNumber = static_cast<uint8_t>(i);
+    alt.bNumEndpoints = static_cast<uint8_t>(desc->endpoints[i].size());
+    alt.bInterfaceClass = 0xff;
+    alt.endpoint = desc->endpoints[i].data();
+
+    if (!cfg.hid_report_descriptor.empty())
+    {
+      // HID class descriptor announcing the report descriptor length
+      uint16_t const len = static_cast<uint16_t>(cfg.hid_report_descriptor.size());
+      desc->extras[i] = { 9, LIBUSB_DT_HID, 0x11, 0x01, 0, 1, LIBUSB_DT_REPORT,
+                          static_cast<unsigned char>(len & 0xff), static_cast<unsigned char>(len >> 8) };
+      alt.bInterfaceClass = 3;
+      alt.extra = desc->extras[i].data();
+      alt.extra_length = static_cast<int>(desc->extras[i].size());
+    }
+
+    desc->interfaces[i].altsetting = &alt;
+    desc->interfaces[i].num_altsetting = 1;
+  }
+
+  desc->config = {};
+  desc->config.bLength = 9;
+  desc->config.bDescriptorType = LIBUSB_DT_CONFIG;
+  desc->config.bNumInterfaces = static_cast<uint8_t>(num_interfaces);
+  desc->config.bConfigurationValue = 1;
+  desc->config.bmAttributes = 0x80;
+  desc->config.MaxPower = 50;
+  desc->config.interface = desc->interfaces.data();
+
+  *config = &desc->config;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_config_descriptors[*config] = std::move(desc);
+  return LIBUSB_SUCCESS;
+}
+
+void
+USBMockBackend::free_config_descriptor(libusb_config_descriptor* config)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_config_descriptors.erase(config);
+}
+
+int
+USBMockBackend::submit(libusb_transfer* transfer)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  USBMockTransfer* mock = get_mock_transfer(transfer);
+  if (mock->in_flight)
+  {
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  libusb_device* dev = transfer->dev_handle->dev;
+  if (!dev->present)
+  {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  Clock::time_point const now = Clock::now();
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+  {
+    enqueue_completion(transfer, now, LIBUSB_TRANSFER_COMPLETED, nullptr, 0, now);
+    return LIBUSB_SUCCESS;
+  }
+
+  USBMockEndpointState* ep = find_endpoint(dev, transfer->endpoint);
+  if (!ep)
+  {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  USBMockEndpointConfig const& cfg = *ep->config;
+
+  ep->transfer_count += 1;
+  bool const stall = ep->stall_pending || (cfg.stall_every != 0 && ep->transfer_count % cfg.stall_every == 0);
+  ep->stall_pending = false;
+
+  Clock::time_point due = now + cfg.latency;
+  Clock::time_point report_time = now;
+  if ((cfg.address & LIBUSB_ENDPOINT_IN) && !stall)
+  {
+    // an IN endpoint has a report ready once per interval
+    report_time = std::max(now, ep->next_report);
+    due = report_time + cfg.latency;
+  }
+
+  if (transfer->timeout != 0 && due - now > std::chrono::milliseconds(transfer->timeout))
+  {
+    // the report slot isn't used up, the next transfer gets it
+    enqueue_completion(transfer, now + std::chrono::milliseconds(transfer->timeout),
+                       LIBUSB_TRANSFER_TIMED_OUT, ep, 0, now);
+    return LIBUSB_SUCCESS;
+  }
+
+  if (stall)
+  {
+    enqueue_completion(transfer, due, LIBUSB_TRANSFER_STALL, ep, 0, now);
+  }
+  else if (cfg.address & LIBUSB_ENDPOINT_IN)
+  {
+    ep->next_report = report_time + cfg.interval;
+    enqueue_completion(transfer, due, LIBUSB_TRANSFER_COMPLETED, ep, ep->report_seq++, now);
+  }
+  else
+  {
+    enqueue_completion(transfer, due, LIBUSB_TRANSFER_COMPLETED, ep, 0, now);
+  }
+
+  return LIBUSB_SUCCESS;
+}
+
+int
+USBMockBackend::cancel(libusb_transfer* transfer)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  USBMockTransfer* mock = get_mock_transfer(transfer);
+  if (!mock->in_flight)
+  {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  // supersedes the pending entry, which is skipped as stale
+  Clock::time_point const now = Clock::now();
+  enqueue_completion(transfer, now, LIBUSB_TRANSFER_CANCELLED, nullptr, 0, now);
+  return LIBUSB_SUCCESS;
+}
+
+void
+USBMockBackend::forget(libusb_transfer* transfer)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto const refers = [transfer](USBMockPending const& entry) { return entry.transfer == transfer; };
+
+  m_ready.erase(std::remove_if(m_ready.begin(), m_ready.end(), refers), m_ready.end());
+
+  auto const timed_end = std::remove_if(m_timed.begin(), m_timed.end(), refers);
+  if (timed_end != m_timed.end())
+  {
+    m_timed.erase(timed_end, m_timed.end());
+    std::make_heap(m_timed.begin(), m_timed.end(), USBMockPendingLater());
+  }
+
+  if (m_dispatching)
+  {
+    for(auto& entry : *m_dispatching)
+    {
+      if (entry.transfer == transfer)
+      {
+        entry.transfer = nullptr;
+      }
+    }
+  }
+}
+
+int
+USBMockBackend::register_hotplug(int events, int flags, int vendor_id, int product_id,
+                                 libusb_hotplug_callback_fn callback, void* user_data,
+                                 libusb_hotplug_callback_handle* handle)
+{
+  USBMockHotplugCallback entry;
+  std::vector<libusb_device*> enumerate;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    entry = USBMockHotplugCallback{m_next_hotplug_handle++, events, vendor_id, product_id, callback, user_data};
+    m_hotplug_callbacks.push_back(entry);
+
+    if ((flags & LIBUSB_HOTPLUG_ENUMERATE) && (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED))
+    {
+      for(auto const& dev : m_devices)
+      {
+        if (dev->present)
+        {
+          enumerate.push_back(dev.get());
+        }
+      }
+    }
+  }
+
+  if (handle)
+  {
+    *handle = entry.handle;
+  }
+
+  std::vector<USBMockHotplugEvent> arrivals;
+  for(libusb_device* dev : enumerate)
+  {
+    arrivals.push_back(USBMockHotplugEvent{dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED});
+  }
+  deliver_hotplug(arrivals);
+
+  return LIBUSB_SUCCESS;
+}
+
+void
+USBMockBackend::deregister_hotplug(libusb_hotplug_callback_handle handle)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_hotplug_callbacks.erase(std::remove_if(m_hotplug_callbacks.begin(), m_hotplug_callbacks.end(),
+                                           [handle](USBMockHotplugCallback const& cb) {
+                                             return cb.handle == handle;
+                                           }),
+                            m_hotplug_callbacks.end());
+}
+
+void
+USBMockBackend::deliver_hotplug(std::vector<USBMockHotplugEvent> const& events)
+{
+  for(auto const& event : events)
+  {
+    std::vector<USBMockHotplugCallback> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      callbacks = m_hotplug_callbacks;
+    }
+
+    USBMockDeviceConfig const& cfg = event.dev->config;
+    for(auto const& cb : callbacks)
+    {
+      if ((cb.events & event.event) &&
+          (cb.vendor_id == LIBUSB_HOTPLUG_MATCH_ANY || cb.vendor_id == cfg.vendor_id) &&
+          (cb.product_id == LIBUSB_HOTPLUG_MATCH_ANY || cb.product_id == cfg.product_id))
+      {
+        if (cb.callback(nullptr, event.dev, event.event, cb.user_data))
+        {
+          deregister_hotplug(cb.handle);
+        }
+      }
+    }
+  }
+}
+
+int
+USBMockBackend::handle_control(libusb_device* dev, libusb_transfer* transfer)
+{
+  uint8_t const* setup = transfer->buffer;
+  uint8_t const request_type = setup[0];
+  uint8_t const request = setup[1];
+  uint16_t const value = static_cast<uint16_t>(setup[2] | (setup[3] << 8));
+  uint16_t const index = static_cast<uint16_t>(setup[4] | (setup[5] << 8));
+  uint16_t const length = static_cast<uint16_t>(setup[6] | (setup[7] << 8));
+  uint8_t* data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+
+  USBMockDeviceConfig const& cfg = dev->config;
+
+  if ((request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN &&
+      request == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+      (value >> 8) == LIBUSB_DT_REPORT &&
+      !cfg.hid_report_descriptor.empty())
+  {
+    size_t const len = std::min<size_t>(length, cfg.hid_report_descriptor.size());
+    memcpy(data, cfg.hid_report_descriptor.data(), len);
+    return static_cast<int>(len);
+  }
+
+  if (cfg.control_handler)
+  {
+    return cfg.control_handler(request_type, request, value, index, data, length);
+  }
+
+  return (request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN ? -1 : length;
+}
+
+void
+USBMockBackend::complete(USBMockPending const& entry)
+{
+  libusb_transfer* transfer = entry.transfer;
+  transfer->status = entry.status;
+  transfer->actual_length = 0;
+
+  if (entry.status == LIBUSB_TRANSFER_COMPLETED)
+  {
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+    {
+      int const len = handle_control(transfer->dev_handle->dev, transfer);
+      if (len < 0)
+      {
+        transfer->status = LIBUSB_TRANSFER_STALL;
+      }
+      else
+      {
+        transfer->actual_length = len;
+      }
+    }
+    else if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+    {
+      USBMockEndpointConfig const& cfg = *entry.endpoint->config;
+      int const length = cfg.report_size > 0 ? std::min(cfg.report_size, transfer->length) : transfer->length;
+      if (cfg.generator)
+      {
+        transfer->actual_length = std::min(length, cfg.generator(transfer->buffer, length, entry.report_seq));
+      }
+      else
+      {
+        memset(transfer->buffer, 0, static_cast<size_t>(length));
+        for(int i = 0; i < std::min(length, 8); ++i)
+        {
+          transfer->buffer[i] = static_cast<uint8_t>(entry.report_seq >> (8 * i));
+        }
+        transfer->actual_length = length;
+      }
+    }
+    else
+    {
+      USBMockEndpointConfig const& cfg = *entry.endpoint->config;
+      if (cfg.sink)
+      {
+        cfg.sink(transfer->buffer, transfer->length);
+      }
+      transfer->actual_length = transfer->length;
+    }
+  }
+
+  m_completions.fetch_add(1, std::memory_order_relaxed);
+
+  // the callback is free to free or resubmit the transfer
+  bool const free_transfer = transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+  transfer->callback(transfer);
+  if (free_transfer)
+  {
+    libusb_free_transfer(transfer);
+  }
+}
+
+int
+USBMockBackend::handle_events(struct timeval* tv)
+{
+  std::vector<USBMockPending> batch;
+  std::vector<USBMockHotplugEvent> hotplug_events;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (!has_due_work(Clock::now()))
+    {
+      lock.unlock();
+
+      // wait for the timer, like libusb waits on its fds
+      timespec timeout = { 60, 0 };
+      if (tv)
+      {
+        timeout.tv_sec = tv->tv_sec;
+        timeout.tv_nsec = tv->tv_usec * 1000;
+      }
+
+      pollfd pfd = { m_timer_fd, POLLIN, 0 };
+      if (ppoll(&pfd, 1, &timeout, nullptr) < 0)
+      {
+        return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+      }
+
+      lock.lock();
+    }
+
+    Clock::time_point const now = Clock::now();
+
+    batch.swap(m_spare_batch);
+    batch.clear();
+    batch.insert(batch.end(), m_ready.begin(), m_ready.end());
+    m_ready.clear();
+
+    while (!m_timed.empty() && m_timed.front().due <= now)
+    {
+      std::pop_heap(m_timed.begin(), m_timed.end(), USBMockPendingLater());
+      batch.push_back(m_timed.back());
+      m_timed.pop_back();
+    }
+
+    // drop entries superseded by a cancel or an unplug, the rest is no
+    // longer in flight and may be resubmitted from its callback
+    batch.erase(std::remove_if(batch.begin(), batch.end(),
+                               [](USBMockPending const& entry) {
+                                 USBMockTransfer* mock = get_mock_transfer(entry.transfer);
+                                 if (!mock->in_flight || mock->generation != entry.generation)
+                                 {
+                                   return true;
+                                 }
+                                 mock->in_flight = false;
+                                 return false;
+                               }),
+                batch.end());
+
+    hotplug_events.swap(m_hotplug_events);
+    m_dispatching = &batch;
+  }
+
+  deliver_hotplug(hotplug_events);
+
+  for(auto const& entry : batch)
+  {
+    // a callback freed the transfer before its turn
+    if (entry.transfer)
+    {
+      complete(entry);
+    }
+  }
+
+  batch.clear();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_dispatching = nullptr;
+  if (m_spare_batch.capacity() < batch.capacity())
+  {
+    m_spare_batch.swap(batch);
+  }
+
+  // only now, as the callbacks typically resubmit right away
+  update_timer(Clock::now());
+
+  return LIBUSB_SUCCESS;
+}
+
+} // namespace
+
+libusb_device*
+usb_mock_add_device(USBMockDeviceConfig const& config)
+{
+  return USBMockBackend::instance().add_device(config);
+}
+
+void
+usb_mock_unplug(libusb_device* dev)
+{
+  USBMockBackend::instance().set_present(dev, false);
+}
+
+void
+usb_mock_replug(libusb_device* dev)
+{
+  USBMockBackend::instance().set_present(dev, true);
+}
+
+void
+usb_mock_stall(libusb_device* dev, uint8_t endpoint)
+{
+  USBMockBackend::instance().stall(dev, endpoint);
+}
+
+void
+usb_mock_reset()
+{
+  USBMockBackend::instance().reset();
+}
+
+uint64_t
+usb_mock_get_completion_count()
+{
+  return USBMockBackend::instance().get_completion_count();
+}
+
+} // namespace unsebu
+
+using unsebu::USBMockBackend;
+
+extern "C" {
+
+int LIBUSB_CALL libusb_init(libusb_context** ctx)
+{
+  USBMockBackend::instance();
+  if (ctx)
+  {
+    *ctx = nullptr;
+  }
+  return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context* /*ctx*/)
+{
+}
+
+const char* LIBUSB_CALL libusb_strerror(usb_mock_error_t errcode)
+{
+  switch (errcode)
+  {
+    case LIBUSB_SUCCESS: return "Success";
+    case LIBUSB_ERROR_IO: return "Input/Output Error";
+    case LIBUSB_ERROR_INVALID_PARAM: return "Invalid parameter";
+    case LIBUSB_ERROR_ACCESS: return "Access denied (insufficient permissions)";
+    case LIBUSB_ERROR_NO_DEVICE: return "No such device (it may have been disconnected)";
+    case LIBUSB_ERROR_NOT_FOUND: return "Entity not found";
+    case LIBUSB_ERROR_BUSY: return "Resource busy";
+    case LIBUSB_ERROR_TIMEOUT: return "Operation timed out";
+    case LIBUSB_ERROR_OVERFLOW: return "Overflow";
+    case LIBUSB_ERROR_PIPE: return "Pipe error";
+    case LIBUSB_ERROR_INTERRUPTED: return "System call interrupted (perhaps due to signal)";
+    case LIBUSB_ERROR_NO_MEM: return "Insufficient memory";
+    case LIBUSB_ERROR_NOT_SUPPORTED: return "Operation not supported or unimplemented on this platform";
+    default: return "Other error";
+  }
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+  return capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context* /*ctx*/, libusb_device*** list)
+{
+  return USBMockBackend::instance().get_device_list(list);
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+  if (!list)
+  {
+    return;
+  }
+
+  if (unref_devices)
+  {
+    for(libusb_device** it = list; *it != nullptr; ++it)
+    {
+      libusb_unref_device(*it);
+    }
+  }
+  free(list);
+}
+
+libusb_device* LIBUSB_CALL libusb_ref_device(libusb_device* dev)
+{
+  return USBMockBackend::instance().ref_device(dev);
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device* dev)
+{
+  if (dev)
+  {
+    USBMockBackend::instance().unref_device(dev);
+  }
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device* dev)
+{
+  return dev->config.bus;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device* dev)
+{
+  return dev->config.address;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device* dev, uint8_t* port_numbers, int port_numbers_len)
+{
+  std::vector<uint8_t> const& ports = dev->config.port_numbers;
+  if (port_numbers_len < static_cast<int>(ports.size()))
+  {
+    return LIBUSB_ERROR_OVERFLOW;
+  }
+  std::copy(ports.begin(), ports.end(), port_numbers);
+  return static_cast<int>(ports.size());
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+  unsebu::USBMockDeviceConfig const& cfg = dev->config;
+
+  *desc = {};
+  desc->bLength = 18;
+  desc->bDescriptorType = LIBUSB_DT_DEVICE;
+  desc->bcdUSB = 0x0200;
+  desc->bMaxPacketSize0 = 64;
+  desc->idVendor = cfg.vendor_id;
+  desc->idProduct = cfg.product_id;
+  desc->bcdDevice = 0x0100;
+  desc->iManufacturer = cfg.manufacturer.empty() ? 0 : 1;
+  desc->iProduct = cfg.product.empty() ? 0 : 2;
+  desc->iSerialNumber = cfg.serial.empty() ? 0 : 3;
+  desc->bNumConfigurations = 1;
+  return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device* dev, struct libusb_config_descriptor** config)
+{
+  return USBMockBackend::instance().get_config_descriptor(dev, config);
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor* config)
+{
+  if (config)
+  {
+    USBMockBackend::instance().free_config_descriptor(config);
+  }
+}
+
+int LIBUSB_CALL libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+  return USBMockBackend::instance().open(dev, dev_handle);
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle* dev_handle)
+{
+  if (dev_handle)
+  {
+    USBMockBackend::instance().close(dev_handle);
+  }
+}
+
+libusb_device* LIBUSB_CALL libusb_get_device(libusb_device_handle* dev_handle)
+{
+  return dev_handle->dev;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+  return USBMockBackend::instance().claim_interface(dev_handle, interface_number);
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+  return USBMockBackend::instance().release_interface(dev_handle, interface_number);
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle* /*dev_handle*/, int /*interface_number*/)
+{
+  // simulated devices never have a kernel driver bound
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index,
+                                                   unsigned char* data, int length)
+{
+  unsebu::USBMockDeviceConfig const& cfg = dev_handle->dev->config;
+
+  std::string const* str = nullptr;
+  switch (desc_index)
+  {
+    case 1: str = &cfg.manufacturer; break;
+    case 2: str = &cfg.product; break;
+    case 3: str = &cfg.serial; break;
+    default: return LIBUSB_ERROR_PIPE;
+  }
+
+  if (str->empty())
+  {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  if (length <= 0)
+  {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+
+  size_t const len = std::min(str->size(), static_cast<size_t>(length - 1));
+  memcpy(data, str->data(), len);
+  data[len] = '\0';
+  return static_cast<int>(len);
+}
+
+unsigned char* LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle* /*dev_handle*/, size_t /*length*/)
+{
+  // no DMA memory to hand out, callers fall back to the heap
+  return nullptr;
+}
+
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle* /*dev_handle*/, unsigned char* /*buffer*/, size_t /*length*/)
+{
+  return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+struct libusb_transfer* LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+  size_t const size = transfer_header_size + sizeof(libusb_transfer) +
+    static_cast<size_t>(std::max(0, iso_packets)) * sizeof(libusb_iso_packet_descriptor);
+
+  char* memory = static_cast<char*>(calloc(1, size));
+  if (!memory)
+  {
+    return nullptr;
+  }
+
+  new (memory) USBMockTransfer{0, false};
+  libusb_transfer* transfer = reinterpret_cast<libusb_transfer*>(memory + transfer_header_size);
+  transfer->num_iso_packets = iso_packets;
+  return transfer;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer* transfer)
+{
+  if (!transfer)
+  {
+    return;
+  }
+
+  USBMockBackend::instance().forget(transfer);
+
+  if ((transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) && transfer->buffer)
+  {
+    free(transfer->buffer);
+  }
+  free(get_mock_transfer(transfer));
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+  return USBMockBackend::instance().submit(transfer);
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+  return USBMockBackend::instance().cancel(transfer);
+}
+
+int LIBUSB_CALL libusb_handle_events(libusb_context* /*ctx*/)
+{
+  return USBMockBackend::instance().handle_events(nullptr);
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context* /*ctx*/, struct timeval* tv, int* /*completed*/)
+{
+  return USBMockBackend::instance().handle_events(tv);
+}
+
+int LIBUSB_CALL libusb_get_next_timeout(libusb_context* /*ctx*/, struct timeval* /*tv*/)
+{
+  // all timing is driven by the timerfd, like libusb does on Linux
+  return 0;
+}
+
+const struct libusb_pollfd** LIBUSB_CALL libusb_get_pollfds(libusb_context* /*ctx*/)
+{
+  std::vector<int> const fds = USBMockBackend::instance().get_fds();
+
+  // a single allocation, so the caller can release it with free()
+  size_t const table_size = (fds.size() + 1) * sizeof(libusb_pollfd*);
+  void* memory = malloc(table_size + fds.size() * sizeof(libusb_pollfd));
+  if (!memory)
+  {
+    return nullptr;
+  }
+
+  libusb_pollfd const** table = static_cast<libusb_pollfd const**>(memory);
+  libusb_pollfd* pollfds = reinterpret_cast<libusb_pollfd*>(static_cast<char*>(memory) + table_size);
+  for(size_t i = 0; i < fds.size(); ++i)
+  {
+    pollfds[i].fd = fds[i];
+    pollfds[i].events = POLLIN;
+    table[i] = &pollfds[i];
+  }
+  table[fds.size()] = nullptr;
+  return table;
+}
+
+void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context* /*ctx*/,
+                                             libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+                                             void* user_data)
+{
+  USBMockBackend::instance().set_pollfd_notifiers(added_cb, removed_cb, user_data);
+}
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context* /*ctx*/,
+                                                 usb_mock_hotplug_event_t events, usb_mock_hotplug_flag_t flags,
+                                                 int vendor_id, int product_id, int /*dev_class*/,
+                                                 libusb_hotplug_callback_fn cb_fn, void* user_data,
+                                                 libusb_hotplug_callback_handle* callback_handle)
+{
+  return USBMockBackend::instance().register_hotplug(events, flags, vendor_id, product_id,
+                                                     cb_fn, user_data, callback_handle);
+}
+
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context* /*ctx*/, libusb_hotplug_callback_handle callback_handle)
+{
+  USBMockBackend::instance().deregister_hotplug(callback_handle);
+}
+
+} // extern "C"
+
+/* EOF */
@@ -0,0 +1,132 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_UNSEBU_USB_MOCK_HPP
+#define HEADER_UNSEBU_USB_MOCK_HPP
+
+#include <libusb.h>
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace unsebu {
+
+/** A simulated endpoint of a USBMockDeviceConfig */
+struct USBMockEndpointConfig
+{
+  /** Endpoint address including the direction bit */
+  uint8_t address = LIBUSB_ENDPOINT_IN | 1;
+
+  /** LIBUSB_TRANSFER_TYPE_INTERRUPT or LIBUSB_TRANSFER_TYPE_BULK */
+  uint8_t type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+
+  int interface = 0;
+  uint16_t max_packet_size = 64;
+
+  /** Size of the reports an IN endpoint produces, capped at the
+      transfer length, 0 fills the whole transfer */
+  int report_size = 0;
+
+  /** Time between two reports of an IN endpoint, 0 produces a report
+      whenever a transfer is submitted */
+  std::chrono::microseconds interval = std::chrono::microseconds(0);
+
+  /** Time between submitting a transfer and its completion */
+  std::chrono::microseconds latency = std::chrono::microseconds(0);
+
+  /** Every n-th transfer completes with LIBUSB_TRANSFER_STALL, 0 never stalls */
+  uint64_t stall_every = 0;
+
+  /** Produces the payload of an IN report, returns its length. The
+      default writes the little endian report sequence number into an
+      otherwise zeroed report. */
+  std::function<int (uint8_t* data, int length, uint64_t seq)> generator = {};
+
+  /** Receives the payload of completed OUT transfers */
+  std::function<void (uint8_t const* data, int length)> sink = {};
+};
+
+/** Description of a simulated device, see usb_mock_add_device() */
+struct USBMockDeviceConfig
+{
+  uint16_t vendor_id = 0x1234;
+  uint16_t product_id = 0x5678;
+
+  uint8_t bus = 1;
+  uint8_t address = 1;
+  std::vector<uint8_t> port_numbers = { 1 };
+
+  std::string manufacturer = {};
+  std::string product = {};
+  std::string serial = {};
+
+  int num_interfaces = 1;
+  std::vector<USBMockEndpointConfig> endpoints = {};
+
+  /** Returned for a GET_DESCRIPTOR request of the HID report descriptor */
+  std::vector<uint8_t> hid_report_descriptor = {};
+
+  /** Handles all other control transfers, returns the number of bytes
+      transferred or -1 to stall. Without a handler OUT requests
+      succeed and IN requests stall. */
+  std::function<int (uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                     uint8_t* data, uint16_t length)> control_handler = {};
+};
+
+/*  The mock backend implements the parts of the libusb-1.0 API used by
+    unsebu in-process, so the library can be linked against it instead
+    of libusb (see the unsebu_mock target) and run without hardware.
+
+    Completions are delivered by libusb_handle_events*() like with the
+    real library. A timerfd plus an idle fd per open handle are exposed
+    via libusb_get_pollfds() and the pollfd notifiers, so USBGSource
+    works unchanged and sees as many fds as with libusb. Transfers
+    complete in order of their due time, transfers that are due
+    immediately take a path without timer syscalls, so the overhead of
+    the library itself can be measured at high completion rates.
+
+    Transfers must be submitted from the thread handling events, the
+    functions below are safe to call from any thread. */
+
+/** Adds a device, it shows up in libusb_get_device_list() and a
+    hotplug arrival is delivered with the next event handling pass.
+    The device stays valid until usb_mock_reset(). */
+libusb_device* usb_mock_add_device(USBMockDeviceConfig const& config);
+
+/** Simulates unplugging: pending transfers complete with
+    LIBUSB_TRANSFER_NO_DEVICE, new submits and opens fail with
+    LIBUSB_ERROR_NO_DEVICE and a hotplug departure is delivered */
+void usb_mock_unplug(libusb_device* dev);
+
+/** Plugs a previously unplugged device back in */
+void usb_mock_replug(libusb_device* dev);
+
+/** The next transfer submitted on endpoint completes with a stall */
+void usb_mock_stall(libusb_device* dev, uint8_t endpoint);
+
+/** Removes all devices, only to be called with no device open */
+void usb_mock_reset();
+
+/** Number of transfers completed by the mock since the start */
+uint64_t usb_mock_get_completion_count();
+
+} // namespace unsebu
+
+#endif
+
+/* EOF */
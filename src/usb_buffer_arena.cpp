@@ -0,0 +1,220 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_buffer_arena.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+#include <logmich/log.hpp>
+
+#include "usb_metrics.hpp"
+
+namespace unsebu {
+
+namespace {
+
+// interrupt reports, full speed bulk, high speed bulk bursts, large bulk
+size_t const size_classes[] = { 64, 512, 4096, 16384 };
+size_t const num_size_classes = sizeof(size_classes) / sizeof(size_classes[0]);
+
+// cache line alignment for the heap fallback
+size_t const heap_alignment = 64;
+
+} // namespace
+
+USBBufferArena::USBBufferArena(std::shared_ptr<libusb_device_handle> handle, size_t size) :
+  m_handle(std::move(handle)),
+  m_memory(nullptr),
+  m_memory_size(0),
+  m_region_size(0),
+  m_classes(),
+  m_outstanding(0),
+  m_adopted()
+{
+  for(size_t block_size : size_classes)
+  {
+    m_classes.push_back(SizeClass{block_size, {}});
+  }
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (m_handle)
+  {
+    m_memory = libusb_dev_mem_alloc(m_handle.get(), size);
+  }
+#endif
+
+  if (!m_memory)
+  {
+    log_debug("libusb_dev_mem_alloc() not available, using heap memory for transfers");
+  }
+  else
+  {
+    m_memory_size = size;
+
+    // each size class gets an equal share of the block, so the owning
+    // class of a buffer follows from its offset
+    m_region_size = m_memory_size / num_size_classes;
+    for(size_t i = 0; i < num_size_classes; ++i)
+    {
+      SizeClass& size_class = m_classes[i];
+      uint8_t* const region = m_memory + i * m_region_size;
+      for(size_t offset = 0; offset + size_class.block_size <= m_region_size; offset += size_class.block_size)
+      {
+        size_class.free_blocks.push_back(region + offset);
+      }
+    }
+  }
+}
+
+USBBufferArena::~USBBufferArena()
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (m_memory)
+  {
+    libusb_dev_mem_free(m_handle.get(), m_memory, m_memory_size);
+  }
+#endif
+}
+
+uint8_t*
+USBBufferArena::allocate(size_t len)
+{
+  for(size_t i = 0; i < m_classes.size(); ++i)
+  {
+    SizeClass& size_class = m_classes[i];
+    if (len <= size_class.block_size && !size_class.free_blocks.empty())
+    {
+      uint8_t* buffer = size_class.free_blocks.back();
+      size_class.free_blocks.pop_back();
+      m_outstanding += 1;
+      USBMetrics::instance().on_arena_allocate(i, true);
+      return buffer;
+    }
+  }
+
+  // aligned_alloc() wants the size to be a multiple of the alignment
+  size_t const heap_len = std::max<size_t>((len + heap_alignment - 1) / heap_alignment * heap_alignment,
+                                           heap_alignment);
+  void* buffer = aligned_alloc(heap_alignment, heap_len);
+  if (!buffer)
+  {
+    throw std::bad_alloc();
+  }
+  USBMetrics::instance().on_arena_allocate(0, false);
+  return static_cast<uint8_t*>(buffer);
+}
+
+void
+USBBufferArena::free(uint8_t* buffer)
+{
+  if (owns(buffer))
+  {
+    size_t const class_idx = static_cast<size_t>(buffer - m_memory) / m_region_size;
+    m_classes[class_idx].free_blocks.push_back(buffer);
+    m_outstanding -= 1;
+    USBMetrics::instance().on_arena_free(class_idx, true);
+    return;
+  }
+
+  for(auto it = m_adopted.begin(); it != m_adopted.end(); ++it)
+  {
+    if ((*it)->holds(buffer))
+    {
+      (*it)->free(buffer);
+      if ((*it)->is_idle())
+      {
+        // last buffer is back, this unmaps the block and lets go of
+        // the previous handle
+        m_adopted.erase(it);
+      }
+      return;
+    }
+  }
+
+  ::free(buffer);
+  USBMetrics::instance().on_arena_free(0, false);
+}
+
+void
+USBBufferArena::adopt(std::shared_ptr<USBBufferArena> previous)
+{
+  if (!previous || previous.get() == this)
+  {
+    return;
+  }
+
+  // heap buffers can be freed from anywhere, only device memory keeps
+  // the previous arena around
+  if (!previous->is_idle() &&
+      std::find(m_adopted.begin(), m_adopted.end(), previous) == m_adopted.end())
+  {
+    m_adopted.push_back(std::move(previous));
+  }
+}
+
+uint8_t*
+USBBufferArena::migrate(uint8_t* buffer, size_t len)
+{
+  for(auto const& adopted : m_adopted)
+  {
+    if (adopted->holds(buffer))
+    {
+      uint8_t* const copy = allocate(len);
+      memcpy(copy, buffer, len);
+      free(buffer);
+      return copy;
+    }
+  }
+
+  return buffer;
+}
+
+bool
+USBBufferArena::owns(uint8_t const* buffer) const
+{
+  return m_memory && buffer >= m_memory && buffer < m_memory + m_region_size * num_size_classes;
+}
+
+bool
+USBBufferArena::holds(uint8_t const* buffer) const
+{
+  if (owns(buffer))
+  {
+    return true;
+  }
+
+  for(auto const& adopted : m_adopted)
+  {
+    if (adopted->holds(buffer))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+USBBufferArena::is_idle() const
+{
+  return m_outstanding == 0 && m_adopted.empty();
+}
+
+} // namespace unsebu
+
+/* EOF */
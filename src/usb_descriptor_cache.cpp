@@ -0,0 +1,382 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_descriptor_cache.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_helper.hpp"
+
+namespace unsebu {
+
+namespace {
+
+// File layout, all values in host byte order:
+//
+//   header: char magic[8], uint32_t version, uint32_t count
+//   record: uint8_t path_len, uint8_t devnum,
+//           uint16_t id_vendor, uint16_t id_product, uint16_t bcd_device,
+//           uint8_t desc_type, uint8_t desc_index, uint16_t w_index,
+//           uint16_t data_len, char path[path_len], uint8_t data[data_len]
+char const cache_magic[8] = { 'U', 'N', 'S', 'E', 'B', 'U', 'D', 'C' };
+uint32_t const cache_version = 1;
+size_t const header_size = 16;
+size_t const record_header_size = 14;
+
+template<typename T>
+T read_value(uint8_t const* ptr)
+{
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  return value;
+}
+
+template<typename T>
+void write_value(std::vector<uint8_t>& out, T value)
+{
+  uint8_t const* ptr = reinterpret_cast<uint8_t const*>(&value);
+  out.insert(out.end(), ptr, ptr + sizeof(T));
+}
+
+} // namespace
+
+USBDescriptorCache::USBDescriptorCache(std::string const& filename) :
+  m_filename(filename),
+  m_mmap_data(nullptr),
+  m_mmap_size(0),
+  m_mapped(),
+  m_pending()
+{
+  load();
+}
+
+USBDescriptorCache::~USBDescriptorCache()
+{
+  unmap();
+}
+
+USBDescriptorCache::Key
+USBDescriptorCache::make_key(libusb_device* dev, uint8_t desc_type, uint8_t desc_index, uint16_t w_index) const
+{
+  libusb_device_descriptor desc;
+  int err = libusb_get_device_descriptor(dev, &desc);
+  if (err != LIBUSB_SUCCESS)
+  {
+    throw std::runtime_error(fmt::format("libusb_get_device_descriptor() failed: {}", libusb_strerror(err)));
+  }
+
+  return Key{usb_get_port_path(dev),
+             desc.idVendor, desc.idProduct, desc.bcdDevice,
+             libusb_get_device_address(dev),
+             desc_type, desc_index, w_index};
+}
+
+std::optional<std::vector<uint8_t>>
+USBDescriptorCache::lookup(libusb_device* dev, uint8_t desc_type, uint8_t desc_index, uint16_t w_index) const
+{
+  Key const key = make_key(dev, desc_type, desc_index, w_index);
+
+  auto const pending_it = m_pending.find(key);
+  if (pending_it != m_pending.end())
+  {
+    return pending_it->second;
+  }
+
+  auto const mapped_it = m_mapped.find(key);
+  if (mapped_it != m_mapped.end())
+  {
+    return std::vector<uint8_t>(mapped_it->second.data, mapped_it->second.data + mapped_it->second.len);
+  }
+
+  return std::nullopt;
+}
+
+void
+USBDescriptorCache::store(libusb_device* dev,
+                          uint8_t desc_type, uint8_t desc_index, uint16_t w_index,
+                          uint8_t const* data, int len)
+{
+  assert(len >= 0 && len <= UINT16_MAX);
+
+  m_pending[make_key(dev, desc_type, desc_index, w_index)] = std::vector<uint8_t>(data, data + len);
+}
+
+std::string
+USBDescriptorCache::get_string_descriptor(libusb_device_handle* handle, uint8_t desc_index)
+{
+  if (desc_index == 0)
+  {
+    // index 0 means the device doesn't provide the string
+    return {};
+  }
+
+  libusb_device* dev = libusb_get_device(handle);
+
+  // w_index 0 stands for the ASCII conversion done by libusb, not a real language id
+  std::optional<std::vector<uint8_t>> cached = lookup(dev, LIBUSB_DT_STRING, desc_index, 0);
+  if (cached)
+  {
+    return std::string(cached->begin(), cached->end());
+  }
+
+  unsigned char buf[256];
+  int ret = libusb_get_string_descriptor_ascii(handle, desc_index, buf, sizeof(buf));
+  if (ret < 0)
+  {
+    log_warn("libusb_get_string_descriptor_ascii() failed: {}", libusb_strerror(ret));
+    return {};
+  }
+
+  store(dev, LIBUSB_DT_STRING, desc_index, 0, buf, ret);
+  return std::string(reinterpret_cast<char const*>(buf), static_cast<size_t>(ret));
+}
+
+void
+USBDescriptorCache::load()
+{
+  int fd = open(m_filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno != ENOENT)
+    {
+      log_warn("{}: failed to open descriptor cache: {}", m_filename, strerror(errno));
+    }
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < header_size)
+  {
+    close(fd);
+    return;
+  }
+
+  void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    log_warn("{}: failed to mmap descriptor cache: {}", m_filename, strerror(errno));
+    return;
+  }
+
+  m_mmap_data = static_cast<uint8_t*>(data);
+  m_mmap_size = static_cast<size_t>(st.st_size);
+
+  uint8_t const* ptr = m_mmap_data;
+  uint8_t const* const end = m_mmap_data + m_mmap_size;
+
+  if (memcmp(ptr, cache_magic, sizeof(cache_magic)) != 0 ||
+      read_value<uint32_t>(ptr + 8) != cache_version)
+  {
+    log_warn("{}: not a descriptor cache or unsupported version, ignoring", m_filename);
+    unmap();
+    return;
+  }
+
+  uint32_t const count = read_value<uint32_t>(ptr + 12);
+  ptr += header_size;
+
+  for(uint32_t i = 0; i < count; ++i)
+  {
+    if (static_cast<size_t>(end - ptr) < record_header_size)
+    {
+      log_warn("{}: descriptor cache is truncated, ignoring", m_filename);
+      m_mapped.clear();
+      unmap();
+      return;
+    }
+
+    uint8_t const path_len = ptr[0];
+    uint16_t const data_len = read_value<uint16_t>(ptr + 12);
+    if (static_cast<size_t>(end - ptr) < record_header_size + path_len + data_len)
+    {
+      log_warn("{}: descriptor cache is truncated, ignoring", m_filename);
+      m_mapped.clear();
+      unmap();
+      return;
+    }
+
+    Key key{std::string(reinterpret_cast<char const*>(ptr + record_header_size), path_len),
+            read_value<uint16_t>(ptr + 2),
+            read_value<uint16_t>(ptr + 4),
+            read_value<uint16_t>(ptr + 6),
+            ptr[1],
+            ptr[8],
+            ptr[9],
+            read_value<uint16_t>(ptr + 10)};
+
+    m_mapped[key] = MappedEntry{ptr + record_header_size + path_len, data_len};
+    ptr += record_header_size + path_len + data_len;
+  }
+}
+
+void
+USBDescriptorCache::unmap()
+{
+  if (m_mmap_data)
+  {
+    munmap(m_mmap_data, m_mmap_size);
+    m_mmap_data = nullptr;
+    m_mmap_size = 0;
+  }
+}
+
+void
+USBDescriptorCache::save()
+{
+  // addresses aren't reused right away, so entries for devices that
+  // are no longer attached under the same address won't become valid
+  // again and get dropped
+  std::vector<Key> attached;
+  libusb_device** list;
+  ssize_t const num_devices = libusb_get_device_list(NULL, &list);
+  if (num_devices < 0)
+  {
+    log_warn("libusb_get_device_list() failed: {}", libusb_strerror(static_cast<int>(num_devices)));
+  }
+  for(ssize_t dev_it = 0; dev_it < num_devices; ++dev_it)
+  {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[dev_it], &desc) == LIBUSB_SUCCESS)
+    {
+      attached.push_back(Key{usb_get_port_path(list[dev_it]),
+                             desc.idVendor, desc.idProduct, desc.bcdDevice,
+                             libusb_get_device_address(list[dev_it]),
+                             0, 0, 0});
+    }
+  }
+  if (num_devices >= 0)
+  {
+    libusb_free_device_list(list, 1 /* unref_devices */);
+  }
+
+  auto is_stale = [&attached, num_devices](Key const& key) {
+    if (num_devices < 0)
+    {
+      return false;
+    }
+
+    for(auto const& it : attached)
+    {
+      if (it.same_device(key))
+      {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::vector<uint8_t> out;
+  uint32_t count = 0;
+
+  out.insert(out.end(), cache_magic, cache_magic + sizeof(cache_magic));
+  write_value<uint32_t>(out, cache_version);
+  write_value<uint32_t>(out, 0); // count, patched below
+
+  auto write_record = [&out, &count](Key const& key, uint8_t const* data, uint16_t len) {
+    out.push_back(static_cast<uint8_t>(key.port_path.size()));
+    out.push_back(key.devnum);
+    write_value<uint16_t>(out, key.id_vendor);
+    write_value<uint16_t>(out, key.id_product);
+    write_value<uint16_t>(out, key.bcd_device);
+    out.push_back(key.desc_type);
+    out.push_back(key.desc_index);
+    write_value<uint16_t>(out, key.w_index);
+    write_value<uint16_t>(out, len);
+    out.insert(out.end(), key.port_path.begin(), key.port_path.end());
+    out.insert(out.end(), data, data + len);
+    count += 1;
+  };
+
+  bool pruned = false;
+  for(auto const& it : m_mapped)
+  {
+    if (is_stale(it.first))
+    {
+      pruned = true;
+    }
+    else if (m_pending.find(it.first) == m_pending.end())
+    {
+      write_record(it.first, it.second.data, it.second.len);
+    }
+  }
+
+  if (m_pending.empty() && !pruned)
+  {
+    return;
+  }
+
+  for(auto const& it : m_pending)
+  {
+    write_record(it.first, it.second.data(), static_cast<uint16_t>(it.second.size()));
+  }
+
+  memcpy(out.data() + 12, &count, sizeof(count));
+
+  std::string tmp_filename = m_filename + ".XXXXXX";
+  int const fd = mkstemp(&tmp_filename[0]);
+  if (fd < 0)
+  {
+    throw std::runtime_error(fmt::format("{}: failed to create temporary file: {}", m_filename, strerror(errno)));
+  }
+
+  // mkstemp() creates the file only readable by the owner
+  fchmod(fd, 0644);
+
+  FILE* fp = fdopen(fd, "wb");
+  if (!fp)
+  {
+    int const err = errno;
+    close(fd);
+    unlink(tmp_filename.c_str());
+    throw std::runtime_error(fmt::format("{}: failed to open for writing: {}", tmp_filename, strerror(err)));
+  }
+
+  bool const write_ok = (fwrite(out.data(), 1, out.size(), fp) == out.size());
+  if (fclose(fp) != 0 || !write_ok)
+  {
+    unlink(tmp_filename.c_str());
+    throw std::runtime_error(fmt::format("{}: failed to write descriptor cache", tmp_filename));
+  }
+
+  if (rename(tmp_filename.c_str(), m_filename.c_str()) < 0)
+  {
+    unlink(tmp_filename.c_str());
+    throw std::runtime_error(fmt::format("{}: failed to rename: {}", tmp_filename, strerror(errno)));
+  }
+
+  // remap so the pending entries move out of the heap
+  m_mapped.clear();
+  m_pending.clear();
+  unmap();
+  load();
+}
+
+} // namespace unsebu
+
+/* EOF */
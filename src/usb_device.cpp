@@ -0,0 +1,147 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_device.hpp"
+
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_buffer_arena.hpp"
+#include "usb_descriptor_cache.hpp"
+#include "usb_interface.hpp"
+
+namespace unsebu {
+
+USBDevice::USBDevice(libusb_device* dev, USBDescriptorCache* descriptor_cache) :
+  m_dev(libusb_ref_device(dev)),
+  m_handle(),
+  m_buffer_arena(),
+  m_descriptor(),
+  m_config_descriptor(nullptr, &libusb_free_config_descriptor),
+  m_descriptor_cache(descriptor_cache),
+  m_strings()
+{
+  libusb_device_handle* handle = nullptr;
+  int err = libusb_open(m_dev, &handle);
+  if (err != LIBUSB_SUCCESS)
+  {
+    libusb_unref_device(m_dev);
+    throw std::runtime_error(fmt::format("libusb_open() failed: {}", libusb_strerror(err)));
+  }
+
+  m_handle = std::shared_ptr<libusb_device_handle>(handle, &libusb_close);
+  init();
+}
+
+USBDevice::USBDevice(libusb_device_handle* handle, USBDescriptorCache* descriptor_cache) :
+  m_dev(libusb_ref_device(libusb_get_device(handle))),
+  m_handle(handle, &libusb_close),
+  m_buffer_arena(),
+  m_descriptor(),
+  m_config_descriptor(nullptr, &libusb_free_config_descriptor),
+  m_descriptor_cache(descriptor_cache),
+  m_strings()
+{
+  init();
+}
+
+USBDevice::~USBDevice()
+{
+  m_config_descriptor.reset();
+  m_buffer_arena.reset();
+  m_handle.reset();
+  libusb_unref_device(m_dev);
+}
+
+void
+USBDevice::init()
+{
+  m_buffer_arena = std::make_shared<USBBufferArena>(m_handle);
+
+  // both of these come from the kernel's cached copy, not the device
+  int err = libusb_get_device_descriptor(m_dev, &m_descriptor);
+  if (err != LIBUSB_SUCCESS)
+  {
+    libusb_unref_device(m_dev);
+    throw std::runtime_error(fmt::format("libusb_get_device_descriptor() failed: {}", libusb_strerror(err)));
+  }
+
+  libusb_config_descriptor* config = nullptr;
+  err = libusb_get_active_config_descriptor(m_dev, &config);
+  if (err == LIBUSB_SUCCESS)
+  {
+    m_config_descriptor.reset(config);
+  }
+  else if (err != LIBUSB_ERROR_NOT_FOUND)
+  {
+    log_warn("libusb_get_active_config_descriptor() failed: {}", libusb_strerror(err));
+  }
+}
+
+std::string const&
+USBDevice::get_string(uint8_t desc_index)
+{
+  auto it = m_strings.find(desc_index);
+  if (it != m_strings.end())
+  {
+    return it->second;
+  }
+
+  std::string result;
+  if (desc_index == 0)
+  {
+    // device doesn't provide the string
+  }
+  else if (m_descriptor_cache)
+  {
+    result = m_descriptor_cache->get_string_descriptor(m_handle.get(), desc_index);
+  }
+  else
+  {
+    unsigned char buf[256];
+    int ret = libusb_get_string_descriptor_ascii(m_handle.get(), desc_index, buf, sizeof(buf));
+    if (ret < 0)
+    {
+      log_warn("libusb_get_string_descriptor_ascii() failed: {}", libusb_strerror(ret));
+    }
+    else
+    {
+      result.assign(reinterpret_cast<char const*>(buf), static_cast<size_t>(ret));
+    }
+  }
+
+  return m_strings.emplace(desc_index, std::move(result)).first->second;
+}
+
+std::unique_ptr<USBInterface>
+USBDevice::claim_interface(int interface, bool try_detach)
+{
+  auto iface = std::make_unique<USBInterface>(m_handle, interface, try_detach);
+  iface->set_buffer_arena(m_buffer_arena);
+  return iface;
+}
+
+void
+USBDevice::reattach_interface(USBInterface& iface)
+{
+  iface.reattach(m_handle, m_buffer_arena);
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,176 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_endpoint.hpp"
+
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_metrics.hpp"
+#include "usb_trace.hpp"
+
+namespace unsebu {
+
+USBEndpointBase::USBEndpointBase(USBInterface& iface, uint8_t address, USBEndpointType type) :
+  m_iface(iface),
+  m_metrics(iface.get_metrics(address)),
+  m_transfer(libusb_alloc_transfer(0)),
+  m_receiver(nullptr),
+  m_active(false),
+  m_cancelled(false)
+{
+  if (!m_transfer)
+  {
+    throw std::runtime_error("libusb_alloc_transfer() failed");
+  }
+
+  m_transfer->endpoint = address;
+  m_transfer->type = static_cast<unsigned char>(type);
+  m_transfer->buffer = nullptr;
+  m_transfer->timeout = 0;
+  m_transfer->user_data = this;
+}
+
+USBEndpointBase::~USBEndpointBase()
+{
+  assert(!m_active);
+  libusb_free_transfer(m_transfer);
+}
+
+void
+USBEndpointBase::submit(int len, libusb_transfer_cb_fn callback, void* receiver)
+{
+  assert(!m_active);
+
+  m_transfer->dev_handle = m_iface.get_handle();
+  m_transfer->length = len;
+  m_transfer->callback = callback;
+  m_receiver = receiver;
+  m_cancelled = false;
+
+  UNSEBU_TRACE(Submit, Instant, m_transfer->endpoint, len);
+  int err = libusb_submit_transfer(m_transfer);
+  if (err != LIBUSB_SUCCESS)
+  {
+    throw std::runtime_error(fmt::format("libusb_submit_transfer(): {}", libusb_strerror(err)));
+  }
+
+  m_metrics->on_submit();
+  m_active = true;
+}
+
+void
+USBEndpointBase::resubmit()
+{
+  usb_count_completion();
+  UNSEBU_TRACE(Complete, Instant, m_transfer->endpoint, m_transfer->status);
+  m_metrics->on_complete(m_transfer);
+
+  // pick up the new handle after USBInterface::reattach()
+  m_transfer->dev_handle = m_iface.get_handle();
+
+  UNSEBU_TRACE(Resubmit, Instant, m_transfer->endpoint, m_transfer->length);
+  int err = libusb_submit_transfer(m_transfer);
+  if (err == LIBUSB_ERROR_NO_DEVICE)
+  {
+    m_iface.suspend_transfer(m_transfer);
+  }
+  else if (err != LIBUSB_SUCCESS)
+  {
+    log_error("failed to resubmit transfer on endpoint {:#x}: {}",
+              m_transfer->endpoint, libusb_strerror(err));
+    m_active = false;
+  }
+  else
+  {
+    m_metrics->on_submit();
+  }
+}
+
+void
+USBEndpointBase::finish(libusb_transfer* transfer)
+{
+  usb_count_completion();
+  UNSEBU_TRACE(Complete, Instant, transfer->endpoint, transfer->status);
+  m_metrics->on_complete(transfer);
+
+  switch (transfer->status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED:
+    case LIBUSB_TRANSFER_CANCELLED:
+      break;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      if (!m_cancelled)
+      {
+        // stays active, the interface resubmits it on reattach()
+        log_debug("endpoint {:#x}: device disconnected, suspending transfer", transfer->endpoint);
+        m_iface.suspend_transfer(transfer);
+        return;
+      }
+      break;
+
+    default:
+      log_error("endpoint {:#x}: transfer failed with status {}", transfer->endpoint,
+                static_cast<int>(transfer->status));
+      break;
+  }
+
+  m_active = false;
+}
+
+void
+USBEndpointBase::cancel()
+{
+  if (m_active && !m_cancelled)
+  {
+    if (m_iface.take_suspended(m_transfer))
+    {
+      // not in flight, nothing will come back from libusb
+      m_active = false;
+      return;
+    }
+
+    m_cancelled = true;
+    libusb_cancel_transfer(m_transfer);
+  }
+}
+
+void
+USBEndpointBase::cancel_and_wait()
+{
+  cancel();
+
+  while (m_active)
+  {
+    int err = libusb_handle_events(nullptr);
+    if (err != LIBUSB_SUCCESS && err != LIBUSB_ERROR_INTERRUPTED)
+    {
+      log_error("libusb_handle_events(): {}", libusb_strerror(err));
+      // leak the transfer rather than freeing it while libusb still owns it
+      m_transfer = nullptr;
+      m_active = false;
+    }
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -27,6 +27,10 @@
 #include <logmich/log.hpp>
 
 #include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_metrics.hpp"
+#include "usb_trace.hpp"
+#include "usb_watchdog.hpp"
 
 namespace unsebu {
 
@@ -34,7 +38,10 @@ USBGSource::USBGSource() :
   m_source_funcs(),
   m_source(),
   m_source_id(),
-  m_pollfds()
+  m_pollfds(),
+  m_max_completions(0),
+  m_max_time(0),
+  m_pending_fds()
 {
   // create the source functions
   m_source_funcs.prepare  = &USBGSource::on_source_prepare;
@@ -139,6 +146,8 @@ USBGSource::on_source_prepare(GSource* source, gint* timeout)
     *timeout = -1;
   }
 
+  UNSEBU_TRACE(SourcePrepare, Instant, 0, *timeout);
+
   // FALSE means the source isn't yet ready
   return FALSE;
 }
@@ -162,26 +171,107 @@ USBGSource::on_source_check(GSource* source)
 
     if ((*i)->revents)
     {
+      UNSEBU_TRACE(SourceCheck, Instant, 0, TRUE);
       return TRUE;
     }
   }
 
+  UNSEBU_TRACE(SourceCheck, Instant, 0, FALSE);
   return FALSE;
 }
 
 gboolean
 USBGSource::on_source_dispatch(GSource* source, GSourceFunc callback, gpointer userdata)
 {
+  UNSEBU_TRACE_SCOPE(SourceDispatch, 0);
   return callback(userdata);
 }
 
+void
+USBGSource::set_dispatch_budget(int max_completions, std::chrono::microseconds max_time)
+{
+  m_max_completions = max_completions;
+  m_max_time = max_time;
+}
+
 gboolean
 USBGSource::on_source()
 {
-  libusb_handle_events(NULL);
+  USBMetricsTimer timer(&USBMetrics::instance().get_dispatch_duration());
+
+  if (m_max_completions == 0 && m_max_time.count() == 0)
+  {
+    USBWatchdogScope watchdog;
+    libusb_handle_events(NULL);
+    USBInterface::flush_batches();
+  }
+  else
+  {
+    dispatch_budgeted();
+  }
   return TRUE;
 }
 
+void
+USBGSource::dispatch_budgeted()
+{
+  // clear a reschedule from the previous dispatch
+  g_source_set_ready_time(&m_source->source, -1);
+
+  auto const start_time = std::chrono::steady_clock::now();
+  uint64_t const start_count = usb_get_completion_count();
+
+  while (true)
+  {
+    // zero timeout, only handle what is ready right now
+    struct timeval tv = { 0, 0 };
+    int err;
+    {
+      USBWatchdogScope watchdog;
+      err = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+      USBInterface::flush_batches();
+    }
+
+    if (err != LIBUSB_SUCCESS && err != LIBUSB_ERROR_INTERRUPTED)
+    {
+      log_error("libusb_handle_events_timeout_completed() failed: {}", libusb_strerror(err));
+      return;
+    }
+
+    if (!has_pending_events())
+    {
+      return;
+    }
+
+    bool const completions_exhausted =
+      m_max_completions != 0 &&
+      usb_get_completion_count() - start_count >= static_cast<uint64_t>(m_max_completions);
+    bool const time_exhausted =
+      m_max_time.count() != 0 &&
+      std::chrono::steady_clock::now() - start_time >= m_max_time;
+
+    if (completions_exhausted || time_exhausted)
+    {
+      // more work is pending, give the other sources their turn and
+      // continue in the next main loop iteration
+      g_source_set_ready_time(&m_source->source, 0);
+      return;
+    }
+  }
+}
+
+bool
+USBGSource::has_pending_events()
+{
+  m_pending_fds.clear();
+  for(auto const& gfd : m_pollfds)
+  {
+    m_pending_fds.push_back(pollfd{gfd->fd, static_cast<short>(gfd->events), 0});
+  }
+
+  return poll(m_pending_fds.data(), m_pending_fds.size(), 0) > 0;
+}
+
 } // namespace unsebu
 
 /* EOF */
@@ -18,8 +18,16 @@
 
 #include "usb_helper.hpp"
 
+#include <fmt/format.h>
+
 namespace unsebu {
 
+namespace {
+
+uint64_t g_completion_count = 0;
+
+} // namespace
+
 int usb_claim_n_detach_interface(libusb_device_handle* handle, int interface, bool try_detach)
 {
   int err = libusb_claim_interface(handle, interface);
@@ -74,6 +82,68 @@ libusb_device* usb_find_device_by_path(uint8_t busnum, uint8_t devnum)
   return result;
 }
 
+libusb_device* usb_find_device_by_id(uint16_t vendor_id, uint16_t product_id)
+{
+  libusb_device* result = nullptr;
+
+  libusb_device** list;
+  ssize_t num_devices = libusb_get_device_list(NULL, &list);
+  for(ssize_t dev_it = 0; dev_it < num_devices; ++dev_it)
+  {
+    libusb_device* dev = list[dev_it];
+
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS &&
+        desc.idVendor == vendor_id &&
+        desc.idProduct == product_id)
+    {
+      result = dev;
+      libusb_ref_device(result);
+      break;
+    }
+  }
+  libusb_free_device_list(list, 1 /* unref_devices */);
+
+  return result;
+}
+
+std::string usb_get_port_path(libusb_device* dev)
+{
+  // USB 3.0 limits the hub depth to 7
+  uint8_t ports[7];
+  int num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+  std::string result = fmt::format("{}", libusb_get_bus_number(dev));
+  for(int i = 0; i < num_ports; ++i)
+  {
+    result += fmt::format("{}{}", (i == 0) ? '-' : '.', ports[i]);
+  }
+  return result;
+}
+
+std::string usb_get_device_label(libusb_device* dev)
+{
+  libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS)
+  {
+    return usb_get_port_path(dev);
+  }
+  else
+  {
+    return fmt::format("{} ({:04x}:{:04x})", usb_get_port_path(dev), desc.idVendor, desc.idProduct);
+  }
+}
+
+void usb_count_completion()
+{
+  g_completion_count += 1;
+}
+
+uint64_t usb_get_completion_count()
+{
+  return g_completion_count;
+}
+
 } // namespace unsebu
 
 /* EOF */
@@ -0,0 +1,519 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_hid_report.hpp"
+
+#include <assert.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_descriptor_cache.hpp"
+
+namespace unsebu {
+
+namespace {
+
+// fields are read with 64 bit loads, so this much padding has to
+// follow the last byte of a report
+size_t const load_padding = 8;
+
+// the report length is a 16 bit field in every transport
+uint64_t const max_report_bits = 8 * 65535;
+
+enum
+{
+  ITEM_TYPE_MAIN = 0,
+  ITEM_TYPE_GLOBAL = 1,
+  ITEM_TYPE_LOCAL = 2,
+
+  MAIN_INPUT = 0x8,
+  MAIN_OUTPUT = 0x9,
+  MAIN_COLLECTION = 0xa,
+  MAIN_FEATURE = 0xb,
+  MAIN_END_COLLECTION = 0xc,
+
+  GLOBAL_USAGE_PAGE = 0x0,
+  GLOBAL_LOGICAL_MINIMUM = 0x1,
+  GLOBAL_LOGICAL_MAXIMUM = 0x2,
+  GLOBAL_REPORT_SIZE = 0x7,
+  GLOBAL_REPORT_ID = 0x8,
+  GLOBAL_REPORT_COUNT = 0x9,
+  GLOBAL_PUSH = 0xa,
+  GLOBAL_POP = 0xb,
+
+  LOCAL_USAGE = 0x0,
+  LOCAL_USAGE_MINIMUM = 0x1,
+  LOCAL_USAGE_MAXIMUM = 0x2,
+
+  INPUT_CONSTANT = 0x01,
+  INPUT_VARIABLE = 0x02
+};
+
+struct GlobalState
+{
+  uint16_t usage_page = 0;
+  int32_t logical_min = 0;
+  int32_t logical_max = 0;
+  uint32_t report_size = 0;
+  uint32_t report_count = 0;
+  uint8_t report_id = 0;
+};
+
+struct LocalState
+{
+  // usages with the page in the upper 16 bits
+  std::vector<uint32_t> usages;
+  std::optional<uint32_t> usage_min;
+  std::optional<uint32_t> usage_max;
+};
+
+uint64_t load_le64(uint8_t const* ptr)
+{
+  uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return le64toh(value);
+}
+
+} // namespace
+
+USBHIDReportLayout::USBHIDReportLayout(uint8_t report_id, std::vector<USBHIDField> const& fields) :
+  m_report_id(report_id),
+  m_fields(fields),
+  m_report_size(0),
+  m_byte_offsets(),
+  m_shifts(),
+  m_masks(),
+  m_sign_shifts(),
+  m_scales(),
+  m_biases()
+{
+  uint32_t total_bits = (report_id != 0) ? 8 : 0;
+
+  for(USBHIDField const& field : m_fields)
+  {
+    assert(field.bit_size > 0 && field.bit_size <= 32);
+
+    m_byte_offsets.push_back(field.bit_offset / 8);
+    m_shifts.push_back(field.bit_offset % 8);
+    m_masks.push_back((uint64_t(1) << field.bit_size) - 1);
+
+    // fields with a negative logical minimum are two's complement
+    m_sign_shifts.push_back((field.logical_min < 0) ? (64 - field.bit_size) : 0);
+
+    float const range = static_cast<float>(field.logical_max - field.logical_min);
+    float const scale = (range != 0.0f) ? 1.0f / range : 0.0f;
+    m_scales.push_back(scale);
+    m_biases.push_back(-static_cast<float>(field.logical_min) * scale);
+
+    total_bits = std::max(total_bits, field.bit_offset + field.bit_size);
+  }
+
+  m_report_size = static_cast<int>((total_bits + 7) / 8);
+}
+
+bool
+USBHIDReportLayout::extract(uint8_t const* data, int len, int32_t* values) const
+{
+  if (len < m_report_size)
+  {
+    return false;
+  }
+
+  // read straight from the transfer buffer when there is enough room
+  // behind the report for the wide loads, otherwise from a padded copy
+  uint8_t stack_buffer[256];
+  std::vector<uint8_t> heap_buffer;
+  uint8_t const* src = data;
+  if (static_cast<size_t>(len) < static_cast<size_t>(m_report_size) + load_padding)
+  {
+    size_t const padded_size = static_cast<size_t>(m_report_size) + load_padding;
+    uint8_t* buffer = stack_buffer;
+    if (padded_size > sizeof(stack_buffer))
+    {
+      heap_buffer.resize(padded_size);
+      buffer = heap_buffer.data();
+    }
+    memcpy(buffer, data, static_cast<size_t>(m_report_size));
+    memset(buffer + m_report_size, 0, load_padding);
+    src = buffer;
+  }
+
+  size_t const num_fields = m_fields.size();
+  uint32_t const* const byte_offsets = m_byte_offsets.data();
+  uint32_t const* const shifts = m_shifts.data();
+  uint64_t const* const masks = m_masks.data();
+  uint32_t const* const sign_shifts = m_sign_shifts.data();
+
+  for(size_t i = 0; i < num_fields; ++i)
+  {
+    uint64_t const raw = (load_le64(src + byte_offsets[i]) >> shifts[i]) & masks[i];
+    values[i] = static_cast<int32_t>(static_cast<int64_t>(raw << sign_shifts[i]) >> sign_shifts[i]);
+  }
+
+  return true;
+}
+
+bool
+USBHIDReportLayout::extract_normalized(uint8_t const* data, int len, float* values) const
+{
+  int32_t stack_values[256];
+  std::vector<int32_t> heap_values;
+  int32_t* raw = stack_values;
+  if (m_fields.size() > sizeof(stack_values) / sizeof(stack_values[0]))
+  {
+    heap_values.resize(m_fields.size());
+    raw = heap_values.data();
+  }
+
+  if (!extract(data, len, raw))
+  {
+    return false;
+  }
+
+  for(size_t i = 0; i < m_fields.size(); ++i)
+  {
+    // unsigned fields with 32 bits set bit 31 without being negative
+    float const value = (m_sign_shifts[i] != 0)
+      ? static_cast<float>(raw[i])
+      : static_cast<float>(static_cast<uint32_t>(raw[i]));
+    values[i] = value * m_scales[i] + m_biases[i];
+  }
+
+  return true;
+}
+
+USBHIDReportDescriptor::USBHIDReportDescriptor(std::vector<USBHIDReportLayout> input_reports) :
+  m_input_reports(std::move(input_reports))
+{
+}
+
+USBHIDReportDescriptor
+USBHIDReportDescriptor::parse(uint8_t const* data, int len)
+{
+  GlobalState global;
+  std::vector<GlobalState> global_stack;
+  LocalState local;
+
+  // fields and the next free bit per report id
+  std::map<uint8_t, std::vector<USBHIDField>> fields;
+  std::map<uint8_t, uint32_t> bit_offsets;
+
+  int pos = 0;
+  while (pos < len)
+  {
+    uint8_t const prefix = data[pos];
+
+    if (prefix == 0xfe)
+    {
+      // long item, no defined tags, skip it
+      if (pos + 1 >= len)
+      {
+        throw std::runtime_error("truncated long item in HID report descriptor");
+      }
+      pos += 3 + data[pos + 1];
+      continue;
+    }
+
+    int const size = ((prefix & 0x3) == 3) ? 4 : (prefix & 0x3);
+    int const type = (prefix >> 2) & 0x3;
+    int const tag = prefix >> 4;
+
+    if (pos + 1 + size > len)
+    {
+      throw std::runtime_error(fmt::format("truncated item at offset {} in HID report descriptor", pos));
+    }
+
+    uint32_t value = 0;
+    for(int i = 0; i < size; ++i)
+    {
+      value |= static_cast<uint32_t>(data[pos + 1 + i]) << (8 * i);
+    }
+
+    int32_t svalue = static_cast<int32_t>(value);
+    if (size == 1) { svalue = static_cast<int8_t>(value); }
+    else if (size == 2) { svalue = static_cast<int16_t>(value); }
+
+    pos += 1 + size;
+
+    if (type == ITEM_TYPE_MAIN)
+    {
+      if (tag == MAIN_INPUT)
+      {
+        std::vector<USBHIDField>& report_fields = fields[global.report_id];
+        uint32_t& bit_offset = bit_offsets.try_emplace(global.report_id, (global.report_id != 0) ? 8 : 0).first->second;
+
+        // checked in 64 bits before anything is added, the count also
+        // bounds the loops below, zero sized items included
+        uint64_t const item_bits = uint64_t(global.report_size) * global.report_count;
+        if (global.report_count > max_report_bits ||
+            bit_offset + item_bits > max_report_bits)
+        {
+          throw std::runtime_error(fmt::format("report {} exceeds {} bytes in HID report descriptor",
+                                               global.report_id, max_report_bits / 8));
+        }
+
+        // usage ranges expand into the usage list
+        std::vector<uint32_t> usages = local.usages;
+        if (local.usage_min && local.usage_max)
+        {
+          for(uint32_t usage = *local.usage_min; usage <= *local.usage_max && usages.size() < global.report_count; ++usage)
+          {
+            usages.push_back(usage);
+          }
+        }
+
+        bool const is_constant = (value & INPUT_CONSTANT);
+        bool const is_array = !(value & INPUT_VARIABLE);
+
+        for(uint32_t i = 0; i < global.report_count; ++i)
+        {
+          // constant items are padding, fields wider than 32 bits
+          // are opaque data that doesn't fit the plan
+          if (!is_constant && global.report_size > 0 && global.report_size <= 32)
+          {
+            uint32_t usage = 0;
+            if (!is_array && !usages.empty())
+            {
+              usage = usages[std::min<size_t>(i, usages.size() - 1)];
+            }
+
+            int64_t logical_max = global.logical_max;
+            if (global.logical_min >= 0 && logical_max < 0)
+            {
+              // descriptors often encode unsigned maximums without the
+              // extra byte the sign would need
+              logical_max = static_cast<int64_t>((uint64_t(1) << global.report_size) - 1);
+            }
+
+            report_fields.push_back(USBHIDField{
+                static_cast<uint16_t>((usage >> 16) ? (usage >> 16) : global.usage_page),
+                static_cast<uint16_t>(usage & 0xffff),
+                is_array,
+                bit_offset,
+                static_cast<uint8_t>(global.report_size),
+                global.logical_min,
+                logical_max});
+          }
+          bit_offset += global.report_size;
+        }
+      }
+      else if (tag == MAIN_OUTPUT || tag == MAIN_FEATURE)
+      {
+        // only input reports are compiled
+      }
+
+      local = LocalState();
+    }
+    else if (type == ITEM_TYPE_GLOBAL)
+    {
+      switch (tag)
+      {
+        case GLOBAL_USAGE_PAGE: global.usage_page = static_cast<uint16_t>(value); break;
+        case GLOBAL_LOGICAL_MINIMUM: global.logical_min = svalue; break;
+        case GLOBAL_LOGICAL_MAXIMUM: global.logical_max = svalue; break;
+        case GLOBAL_REPORT_SIZE: global.report_size = value; break;
+        case GLOBAL_REPORT_COUNT: global.report_count = value; break;
+        case GLOBAL_REPORT_ID: global.report_id = static_cast<uint8_t>(value); break;
+        case GLOBAL_PUSH: global_stack.push_back(global); break;
+        case GLOBAL_POP:
+          if (global_stack.empty())
+          {
+            throw std::runtime_error("unbalanced Pop in HID report descriptor");
+          }
+          global = global_stack.back();
+          global_stack.pop_back();
+          break;
+        default: break;
+      }
+    }
+    else if (type == ITEM_TYPE_LOCAL)
+    {
+      // four byte usages carry their own usage page
+      uint32_t const usage = (size == 4) ? value : ((static_cast<uint32_t>(global.usage_page) << 16) | value);
+      switch (tag)
+      {
+        case LOCAL_USAGE: local.usages.push_back(usage); break;
+        case LOCAL_USAGE_MINIMUM: local.usage_min = usage; break;
+        case LOCAL_USAGE_MAXIMUM: local.usage_max = usage; break;
+        default: break;
+      }
+    }
+  }
+
+  std::vector<USBHIDReportLayout> input_reports;
+  for(auto const& it : fields)
+  {
+    input_reports.emplace_back(it.first, it.second);
+  }
+  return USBHIDReportDescriptor(std::move(input_reports));
+}
+
+USBHIDReportLayout const*
+USBHIDReportDescriptor::find_input_report(uint8_t report_id) const
+{
+  for(USBHIDReportLayout const& layout : m_input_reports)
+  {
+    if (layout.get_report_id() == report_id)
+    {
+      return &layout;
+    }
+  }
+  return nullptr;
+}
+
+namespace {
+
+struct USBHIDFetchData
+{
+  std::function<void (int, std::vector<uint8_t> const&)> callback;
+  USBDescriptorCache* descriptor_cache;
+  libusb_device* dev;
+  int interface;
+};
+
+/** Look up wDescriptorLength of the report descriptor in the HID
+    class descriptor, which comes with the configuration descriptor
+    and costs no bus I/O */
+uint16_t get_report_descriptor_length(libusb_device* dev, int interface)
+{
+  uint16_t result = 4096;
+
+  libusb_config_descriptor* config;
+  if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+  {
+    return result;
+  }
+
+  for(int i = 0; i < config->bNumInterfaces; ++i)
+  {
+    libusb_interface_descriptor const& altsetting = config->interface[i].altsetting[0];
+    if (altsetting.bInterfaceNumber == interface)
+    {
+      unsigned char const* extra = altsetting.extra;
+      for(int pos = 0; pos + 1 < altsetting.extra_length && extra[pos] > 0; pos += extra[pos])
+      {
+        if (extra[pos + 1] == LIBUSB_DT_HID && extra[pos] >= 9 && pos + 9 <= altsetting.extra_length)
+        {
+          // first class descriptor entry: bDescriptorType at 6, wDescriptorLength at 7
+          if (extra[pos + 6] == LIBUSB_DT_REPORT)
+          {
+            result = static_cast<uint16_t>(extra[pos + 7] | (extra[pos + 8] << 8));
+          }
+        }
+      }
+    }
+  }
+
+  libusb_free_config_descriptor(config);
+  return result;
+}
+
+int transfer_status_to_error(libusb_transfer_status status)
+{
+  switch (status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+    default: return LIBUSB_ERROR_IO;
+  }
+}
+
+} // namespace
+
+void usb_hid_fetch_report_descriptor(libusb_device_handle* handle, int interface,
+                                     std::function<void (int, std::vector<uint8_t> const&)> const& callback,
+                                     USBDescriptorCache* descriptor_cache)
+{
+  libusb_device* dev = libusb_get_device(handle);
+
+  if (descriptor_cache)
+  {
+    std::optional<std::vector<uint8_t>> cached =
+      descriptor_cache->lookup(dev, LIBUSB_DT_REPORT, 0, static_cast<uint16_t>(interface));
+    if (cached)
+    {
+      callback(LIBUSB_SUCCESS, *cached);
+      return;
+    }
+  }
+
+  uint16_t const length = get_report_descriptor_length(dev, interface);
+
+  libusb_transfer* transfer = libusb_alloc_transfer(0);
+  transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+
+  uint8_t* buffer = static_cast<uint8_t*>(malloc(LIBUSB_CONTROL_SETUP_SIZE + length));
+  libusb_fill_control_setup(buffer,
+                            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE,
+                            LIBUSB_REQUEST_GET_DESCRIPTOR,
+                            static_cast<uint16_t>(LIBUSB_DT_REPORT << 8),
+                            static_cast<uint16_t>(interface),
+                            length);
+  libusb_fill_control_transfer(transfer, handle, buffer,
+                               [](libusb_transfer* transfer_) {
+                                 USBHIDFetchData* fetch = static_cast<USBHIDFetchData*>(transfer_->user_data);
+
+                                 int const err = transfer_status_to_error(transfer_->status);
+                                 std::vector<uint8_t> descriptor;
+                                 if (err == LIBUSB_SUCCESS)
+                                 {
+                                   uint8_t const* desc_data = libusb_control_transfer_get_data(transfer_);
+                                   descriptor.assign(desc_data, desc_data + transfer_->actual_length);
+
+                                   if (fetch->descriptor_cache)
+                                   {
+                                     fetch->descriptor_cache->store(fetch->dev, LIBUSB_DT_REPORT, 0,
+                                                                    static_cast<uint16_t>(fetch->interface),
+                                                                    descriptor.data(), static_cast<int>(descriptor.size()));
+                                   }
+                                 }
+
+                                 fetch->callback(err, descriptor);
+
+                                 libusb_unref_device(fetch->dev);
+                                 delete fetch;
+                                 libusb_free_transfer(transfer_);
+                               },
+                               new USBHIDFetchData{callback, descriptor_cache, libusb_ref_device(dev), interface},
+                               1000); // timeout
+
+  int err = libusb_submit_transfer(transfer);
+  if (err != LIBUSB_SUCCESS)
+  {
+    USBHIDFetchData* fetch = static_cast<USBHIDFetchData*>(transfer->user_data);
+    libusb_unref_device(fetch->dev);
+    delete fetch;
+    libusb_free_transfer(transfer);
+
+    callback(err, {});
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,87 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_hotplug.hpp"
+
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+namespace unsebu {
+
+USBHotplug::USBHotplug() :
+  m_handle(),
+  m_callbacks(),
+  m_next_id(1)
+{
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  {
+    throw std::runtime_error("libusb hotplug support not available");
+  }
+
+  int err = libusb_hotplug_register_callback(
+    NULL,
+    static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+    static_cast<libusb_hotplug_flag>(0),
+    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+    [](libusb_context* /*ctx*/, libusb_device* dev, libusb_hotplug_event event, void* userdata) -> int {
+      static_cast<USBHotplug*>(userdata)->on_hotplug(dev, event);
+      return 0; // stay registered
+    },
+    this,
+    &m_handle);
+  if (err != LIBUSB_SUCCESS)
+  {
+    throw std::runtime_error(fmt::format("libusb_hotplug_register_callback() failed: {}", libusb_strerror(err)));
+  }
+}
+
+USBHotplug::~USBHotplug()
+{
+  libusb_hotplug_deregister_callback(NULL, m_handle);
+}
+
+int
+USBHotplug::add_callback(Callback const& callback)
+{
+  int const id = m_next_id++;
+  m_callbacks[id] = callback;
+  return id;
+}
+
+void
+USBHotplug::remove_callback(int id)
+{
+  m_callbacks.erase(id);
+}
+
+void
+USBHotplug::on_hotplug(libusb_device* dev, libusb_hotplug_event event)
+{
+  // iterate over a copy, as callbacks are allowed to remove themselves
+  std::map<int, Callback> const callbacks = m_callbacks;
+  for(auto const& it : callbacks)
+  {
+    if (m_callbacks.find(it.first) != m_callbacks.end())
+    {
+      it.second(dev, event);
+    }
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
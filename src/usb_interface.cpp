@@ -18,13 +18,23 @@
 
 #include "usb_interface.hpp"
 
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
 #include <stdexcept>
 
 #include <fmt/format.h>
+#include <logmich/log.hpp>
 
+#include "usb_buffer_arena.hpp"
 #include "usb_helper.hpp"
+#include "usb_metrics.hpp"
+#include "usb_pcapng_writer.hpp"
+#include "usb_recorder.hpp"
+#include "usb_report_filter.hpp"
+#include "usb_submit_queue.hpp"
+#include "usb_trace.hpp"
+#include "usb_watchdog.hpp"
 
 namespace unsebu {
 
@@ -32,18 +42,136 @@ struct USBReadData
 {
   USBInterface* iface;
   std::function<bool (uint8_t*, int)> callback;
+  USBEndpointMetrics* metrics;
 };
 
 struct USBWriteData
 {
   USBInterface* iface;
   std::function<bool (libusb_transfer*)> callback;
+  USBEndpointMetrics* metrics;
 };
 
+struct USBQueuedRead
+{
+  // nullptr once the read got cancelled, the struct stays around
+  // until the last transfer has come back from libusb or its lease
+  USBInterface* iface;
+  std::shared_ptr<USBBufferArena> arena;
+  USBEndpointMetrics* metrics;
+
+  // leased mode
+  std::function<void (USBReadLease)> callback;
+
+  // batched mode, completed transfers wait in batch until flush_batches()
+  std::function<void (USBReadRecord const*, size_t)> batch_callback;
+  std::vector<libusb_transfer*> batch;
+  std::vector<USBReadRecord> records;
+
+  std::vector<libusb_transfer*> transfers;
+
+  /** Called by cancel_read() callers once the last transfer is freed */
+  std::function<void ()> on_freed;
+};
+
+std::mutex USBInterface::s_dirty_mutex;
+std::vector<USBInterface*> USBInterface::s_dirty_interfaces;
+
+USBReadLease::USBReadLease() :
+  m_read(nullptr),
+  m_transfer(nullptr)
+{
+}
+
+USBReadLease::USBReadLease(USBQueuedRead* read, libusb_transfer* transfer) :
+  m_read(read),
+  m_transfer(transfer)
+{
+}
+
+USBReadLease::USBReadLease(USBReadLease&& other) :
+  m_read(other.m_read),
+  m_transfer(other.m_transfer)
+{
+  other.m_read = nullptr;
+  other.m_transfer = nullptr;
+}
+
+USBReadLease&
+USBReadLease::operator=(USBReadLease&& other)
+{
+  if (this != &other)
+  {
+    release();
+    m_read = other.m_read;
+    m_transfer = other.m_transfer;
+    other.m_read = nullptr;
+    other.m_transfer = nullptr;
+  }
+  return *this;
+}
+
+USBReadLease::~USBReadLease()
+{
+  release();
+}
+
+uint8_t*
+USBReadLease::data() const
+{
+  return m_transfer->buffer;
+}
+
+int
+USBReadLease::size() const
+{
+  return m_transfer->actual_length;
+}
+
+libusb_transfer_status
+USBReadLease::status() const
+{
+  return m_transfer->status;
+}
+
+void
+USBReadLease::release()
+{
+  if (m_transfer)
+  {
+    m_read->metrics->leased.fetch_sub(1, std::memory_order_relaxed);
+    USBInterface::resubmit_queued_transfer(m_read, m_transfer);
+    m_read = nullptr;
+    m_transfer = nullptr;
+  }
+}
+
+USBInterface::USBInterface(std::shared_ptr<libusb_device_handle> handle, int interface, bool try_detach) :
+  USBInterface(handle.get(), interface, try_detach)
+{
+  m_handle_ref = std::move(handle);
+}
+
 USBInterface::USBInterface(libusb_device_handle* handle, int interface, bool try_detach) :
+  m_handle_ref(),
   m_handle(handle),
   m_interface(interface),
-  m_endpoints()
+  m_try_detach(try_detach),
+  m_endpoints(),
+  m_posted_writes(),
+  m_queued_reads(),
+  m_dirty_batches(),
+  m_read_filters(),
+  m_disconnected(false),
+  m_disconnect_callback(),
+  m_suspended(),
+  m_submit_queue(),
+  m_buffer_arena(),
+  m_recorder(),
+  m_capture(),
+  m_transfer_types(),
+  m_device_label(),
+  m_metrics()
 {
   int err = libusb_claim_interface(handle, m_interface);
   if (err == LIBUSB_SUCCESS)
@@ -72,24 +200,86 @@ USBInterface::USBInterface(libusb_device_handle* handle, int interface, bool try
   {
     throw std::runtime_error(fmt::format("error claiming interface: {}: {}", interface, libusb_strerror(err)));
   }
+
+  detect_transfer_types();
 }
 
 USBInterface::~USBInterface()
 {
+  m_submit_queue.reset();
+
   // cancel all transfer that might still be running
   for(auto it = m_endpoints.begin(); it != m_endpoints.end(); ++it)
   {
     if (it->second)
     {
-      libusb_cancel_transfer(it->second);
-      libusb_free_transfer(it->second);
+      discard_transfer(it->second);
     }
   }
   m_endpoints.clear();
 
+  for(auto const& it : m_posted_writes)
+  {
+    for(libusb_transfer* transfer : it.second)
+    {
+      discard_transfer(transfer);
+    }
+  }
+  m_posted_writes.clear();
+
+  while (!m_queued_reads.empty())
+  {
+    cancel_queued_read(m_queued_reads.begin());
+  }
+  m_suspended.clear();
+
   libusb_release_interface(m_handle, m_interface);
 }
 
+void
+USBInterface::detect_transfer_types()
+{
+  libusb_config_descriptor* config;
+  int err = libusb_get_active_config_descriptor(libusb_get_device(m_handle), &config);
+  if (err != LIBUSB_SUCCESS)
+  {
+    log_warn("libusb_get_active_config_descriptor() failed, assuming interrupt endpoints: {}", libusb_strerror(err));
+    return;
+  }
+
+  for(int i = 0; i < config->bNumInterfaces; ++i)
+  {
+    libusb_interface_descriptor const& altsetting = config->interface[i].altsetting[0];
+    if (altsetting.bInterfaceNumber == m_interface)
+    {
+      for(int j = 0; j < altsetting.bNumEndpoints; ++j)
+      {
+        libusb_endpoint_descriptor const& ep = altsetting.endpoint[j];
+        m_transfer_types[ep.bEndpointAddress] =
+          static_cast<libusb_transfer_type>(ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK);
+      }
+    }
+  }
+
+  libusb_free_config_descriptor(config);
+}
+
+libusb_transfer_type
+USBInterface::get_transfer_type(int address) const
+{
+  auto const it = m_transfer_types.find(address);
+  if (it != m_transfer_types.end() && it->second == LIBUSB_TRANSFER_TYPE_BULK)
+  {
+    return LIBUSB_TRANSFER_TYPE_BULK;
+  }
+  else
+  {
+    // unknown endpoints are treated as interrupt endpoints, as
+    // they always have been
+    return LIBUSB_TRANSFER_TYPE_INTERRUPT;
+  }
+}
+
 void
 USBInterface::submit_read(int endpoint, int len,
                           std::function<bool (uint8_t*, int)> const& callback)
@@ -97,9 +287,8 @@ USBInterface::submit_read(int endpoint, int len,
   assert(m_endpoints.find(endpoint) == m_endpoints.end());
 
   libusb_transfer* transfer = libusb_alloc_transfer(0);
-  transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
 
-  uint8_t* data = static_cast<uint8_t*>(malloc(sizeof(uint8_t) * len));
+  uint8_t* data = allocate_buffer(len);
 
   libusb_fill_interrupt_transfer(transfer, m_handle,
                                  static_cast<unsigned char>(endpoint | LIBUSB_ENDPOINT_IN),
@@ -108,19 +297,22 @@ USBInterface::submit_read(int endpoint, int len,
                                    static_cast<USBReadData*>(transfer_->user_data)->iface->on_read_data(
                                      static_cast<USBReadData*>(transfer_->user_data), transfer_);
                                  },
-                                 new USBReadData{this, callback},
+                                 new USBReadData{this, callback, get_metrics(endpoint | LIBUSB_ENDPOINT_IN)},
                                  0); // timeout
+  transfer->type = get_transfer_type(transfer->endpoint);
 
+  UNSEBU_TRACE(Submit, Instant, transfer->endpoint, len);
   int err = libusb_submit_transfer(transfer);
   if (err != LIBUSB_SUCCESS)
   {
-    libusb_free_transfer(transfer);
+    free_transfer(transfer);
 
-    throw std::runtime_error(fmt::format("libusb_submit_transfer(): ", libusb_strerror(err)));
+    throw std::runtime_error(fmt::format("libusb_submit_transfer(): {}", libusb_strerror(err)));
   }
   else
   {
     // transfer is send on its way, so store it
+    static_cast<USBReadData*>(transfer->user_data)->metrics->on_submit();
     m_endpoints[endpoint | LIBUSB_ENDPOINT_IN] = transfer;
   }
 }
@@ -128,12 +320,18 @@ USBInterface::submit_read(int endpoint, int len,
 void
 USBInterface::submit_write(int endpoint, uint8_t* data_in, int len,
                            std::function<bool (libusb_transfer*)> const& callback)
+{
+  m_endpoints[endpoint | LIBUSB_ENDPOINT_OUT] = start_write(endpoint, data_in, len, callback);
+}
+
+libusb_transfer*
+USBInterface::start_write(int endpoint, uint8_t* data_in, int len,
+                          std::function<bool (libusb_transfer*)> const& callback)
 {
   libusb_transfer* transfer = libusb_alloc_transfer(0);
-  transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
 
   // copy data into a newly allocated buffer
-  uint8_t* data = static_cast<uint8_t*>(malloc(sizeof(uint8_t) * len));
+  uint8_t* data = allocate_buffer(len);
   memcpy(data, data_in, len);
 
   libusb_fill_interrupt_transfer(transfer, m_handle,
@@ -143,19 +341,22 @@ USBInterface::submit_write(int endpoint, uint8_t* data_in, int len,
                                    static_cast<USBWriteData*>(xfer->user_data)->iface->on_write_data(
                                      static_cast<USBWriteData*>(xfer->user_data), xfer);
                                  },
-                                 new USBWriteData{this, callback},
+                                 new USBWriteData{this, callback, get_metrics(endpoint | LIBUSB_ENDPOINT_OUT)},
                                  0); // timeout
+  transfer->type = get_transfer_type(transfer->endpoint);
 
+  UNSEBU_TRACE(Submit, Instant, transfer->endpoint, len);
   int err = libusb_submit_transfer(transfer);
   if (err != LIBUSB_SUCCESS)
   {
-    libusb_free_transfer(transfer);
+    free_transfer(transfer);
 
-    throw std::runtime_error(fmt::format("libusb_submit_transfer(): ", libusb_strerror(err)));
+    throw std::runtime_error(fmt::format("libusb_submit_transfer(): {}", libusb_strerror(err)));
   }
   else
   {
-    m_endpoints[endpoint | LIBUSB_ENDPOINT_OUT] = transfer;
+    static_cast<USBWriteData*>(transfer->user_data)->metrics->on_submit();
+    return transfer;
   }
 }
 
@@ -169,16 +370,329 @@ USBInterface::cancel_transfer(int endpoint)
   }
   else
   {
-    libusb_cancel_transfer(it->second);
-    libusb_free_transfer(it->second);
+    discard_transfer(it->second);
     m_endpoints.erase(it);
   }
 }
 
 void
-USBInterface::cancel_read(int endpoint)
+USBInterface::cancel_read(int endpoint, std::function<void ()> const& on_freed)
+{
+  auto const it = m_queued_reads.find(endpoint | LIBUSB_ENDPOINT_IN);
+  if (it != m_queued_reads.end())
+  {
+    it->second->on_freed = on_freed;
+    cancel_queued_read(it);
+  }
+  else
+  {
+    cancel_transfer(endpoint | LIBUSB_ENDPOINT_IN);
+    if (on_freed)
+    {
+      on_freed();
+    }
+  }
+}
+
+void
+USBInterface::submit_read_leased(int endpoint, int len, int credits,
+                                 std::function<void (USBReadLease)> const& callback)
+{
+  submit_queued_read(endpoint, len, credits,
+                     new USBQueuedRead{this, m_buffer_arena, get_metrics(endpoint | LIBUSB_ENDPOINT_IN),
+                                       callback, {}, {}, {}, {}, {}});
+}
+
+void
+USBInterface::submit_read_batched(int endpoint, int len, int depth,
+                                  std::function<void (USBReadRecord const*, size_t)> const& callback)
+{
+  submit_queued_read(endpoint, len, depth,
+                     new USBQueuedRead{this, m_buffer_arena, get_metrics(endpoint | LIBUSB_ENDPOINT_IN),
+                                       {}, callback, {}, {}, {}, {}});
+}
+
+void
+USBInterface::submit_queued_read(int endpoint, int len, int count, USBQueuedRead* read)
+{
+  int const address = endpoint | LIBUSB_ENDPOINT_IN;
+
+  assert(count > 0);
+  assert(m_endpoints.find(address) == m_endpoints.end());
+  assert(m_queued_reads.find(address) == m_queued_reads.end());
+
+  m_queued_reads[address] = read;
+
+  for(int i = 0; i < count; ++i)
+  {
+    libusb_transfer* transfer = libusb_alloc_transfer(0);
+    libusb_fill_interrupt_transfer(transfer, m_handle,
+                                   static_cast<unsigned char>(address),
+                                   allocate_buffer(len), len,
+                                   [](libusb_transfer* transfer_) {
+                                     USBQueuedRead* read_ = static_cast<USBQueuedRead*>(transfer_->user_data);
+                                     read_->metrics->on_complete(transfer_);
+                                     if (read_->iface)
+                                     {
+                                       read_->iface->on_queued_read_data(read_, transfer_);
+                                     }
+                                     else
+                                     {
+                                       free_queued_transfer(read_, transfer_);
+                                     }
+                                   },
+                                   read,
+                                   0); // timeout
+    transfer->type = get_transfer_type(address);
+    read->transfers.push_back(transfer);
+
+    UNSEBU_TRACE(Submit, Instant, address, len);
+    int err = libusb_submit_transfer(transfer);
+    if (err != LIBUSB_SUCCESS)
+    {
+      free_queued_transfer(read, transfer);
+      cancel_queued_read(m_queued_reads.find(address));
+
+      throw std::runtime_error(fmt::format("libusb_submit_transfer(): {}", libusb_strerror(err)));
+    }
+    read->metrics->on_submit();
+  }
+}
+
+void
+USBInterface::on_queued_read_data(USBQueuedRead* read, libusb_transfer* transfer)
+{
+  usb_count_completion();
+  UNSEBU_TRACE(Complete, Instant, transfer->endpoint, transfer->status);
+  if (m_recorder)
+  {
+    m_recorder->record(transfer);
+  }
+  if (m_capture)
+  {
+    m_capture->write_transfer(transfer);
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+  {
+    on_transfer_disconnected(transfer);
+  }
+  else if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+  {
+    free_queued_transfer(read, transfer);
+  }
+  else if (!pass_read_filter(transfer))
+  {
+    resubmit_queued_transfer(read, transfer);
+  }
+  else if (read->batch_callback)
+  {
+    // delivered by flush_batches() at the end of the event handling pass
+    if (read->batch.empty())
+    {
+      mark_batch_dirty(read);
+    }
+    read->batch.push_back(transfer);
+  }
+  else
+  {
+    // the credit comes back once the consumer releases the lease
+    UNSEBU_TRACE_SCOPE(Callback, transfer->endpoint);
+    USBWatchdogScope watchdog(transfer->dev_handle, transfer->endpoint);
+    USBMetricsTimer timer(&read->metrics->callback_duration);
+    read->metrics->leased.fetch_add(1, std::memory_order_relaxed);
+    read->callback(USBReadLease(read, transfer));
+  }
+}
+
+void
+USBInterface::mark_batch_dirty(USBQueuedRead* read)
+{
+  std::lock_guard<std::mutex> lock(s_dirty_mutex);
+  if (m_dirty_batches.empty())
+  {
+    s_dirty_interfaces.push_back(this);
+  }
+  m_dirty_batches.push_back(read);
+}
+
+void
+USBInterface::unmark_batch_dirty(USBQueuedRead* read)
 {
-  cancel_transfer(endpoint | LIBUSB_ENDPOINT_IN);
+  std::lock_guard<std::mutex> lock(s_dirty_mutex);
+  auto const it = std::find(m_dirty_batches.begin(), m_dirty_batches.end(), read);
+  if (it == m_dirty_batches.end())
+  {
+    return;
+  }
+
+  m_dirty_batches.erase(it);
+  if (m_dirty_batches.empty())
+  {
+    s_dirty_interfaces.erase(std::remove(s_dirty_interfaces.begin(), s_dirty_interfaces.end(), this),
+                             s_dirty_interfaces.end());
+  }
+}
+
+void
+USBInterface::flush_batches()
+{
+  // one read at a time, as a callback can cancel reads or destroy
+  // interfaces, which takes them out of the dirty lists
+  while (true)
+  {
+    USBQueuedRead* read;
+    {
+      std::lock_guard<std::mutex> lock(s_dirty_mutex);
+      if (s_dirty_interfaces.empty())
+      {
+        return;
+      }
+
+      USBInterface* iface = s_dirty_interfaces.front();
+      read = iface->m_dirty_batches.front();
+      iface->m_dirty_batches.erase(iface->m_dirty_batches.begin());
+      if (iface->m_dirty_batches.empty())
+      {
+        s_dirty_interfaces.erase(s_dirty_interfaces.begin());
+      }
+    }
+
+    deliver_batch(read);
+  }
+}
+
+void
+USBInterface::deliver_batch(USBQueuedRead* read)
+{
+  std::vector<libusb_transfer*> batch;
+  batch.swap(read->batch);
+
+  if (read->iface)
+  {
+    read->records.clear();
+    for(libusb_transfer* transfer : batch)
+    {
+      read->records.push_back(USBReadRecord{transfer->buffer, transfer->actual_length, transfer->status});
+    }
+    UNSEBU_TRACE_SCOPE(Callback, batch.front()->endpoint);
+    USBWatchdogScope watchdog(batch.front()->dev_handle, batch.front()->endpoint);
+    USBMetricsTimer timer(&read->metrics->callback_duration);
+    read->batch_callback(read->records.data(), read->records.size());
+  }
+
+  // this frees the transfers instead when the callback cancelled
+  // the read, which might delete the read along with the last one
+  for(libusb_transfer* transfer : batch)
+  {
+    resubmit_queued_transfer(read, transfer);
+  }
+}
+
+void
+USBInterface::resubmit_queued_transfer(USBQueuedRead* read, libusb_transfer* transfer)
+{
+  if (!read->iface)
+  {
+    free_queued_transfer(read, transfer);
+    return;
+  }
+
+  if (transfer->dev_handle != read->iface->m_handle)
+  {
+    // leased across a reattach(), the old handle might be gone already
+    read->iface->migrate_buffer(transfer);
+    transfer->dev_handle = read->iface->m_handle;
+  }
+
+  UNSEBU_TRACE(Resubmit, Instant, transfer->endpoint, transfer->length);
+  int err = libusb_submit_transfer(transfer);
+  if (err == LIBUSB_ERROR_NO_DEVICE)
+  {
+    read->iface->on_transfer_disconnected(transfer);
+  }
+  else if (err != LIBUSB_SUCCESS)
+  {
+    log_error("libusb_submit_transfer(): {}", libusb_strerror(err));
+    free_queued_transfer(read, transfer);
+  }
+  else
+  {
+    read->metrics->on_submit();
+  }
+}
+
+void
+USBInterface::free_queued_transfer(USBQueuedRead* read, libusb_transfer* transfer)
+{
+  if (read->arena)
+  {
+    read->arena->free(transfer->buffer);
+  }
+  else
+  {
+    free(transfer->buffer);
+  }
+  libusb_free_transfer(transfer);
+
+  read->transfers.erase(std::remove(read->transfers.begin(), read->transfers.end(), transfer),
+                        read->transfers.end());
+
+  if (!read->iface && read->transfers.empty())
+  {
+    delete_queued_read(read);
+  }
+}
+
+void
+USBInterface::delete_queued_read(USBQueuedRead* read)
+{
+  std::function<void ()> const on_freed = std::move(read->on_freed);
+  delete read;
+  if (on_freed)
+  {
+    on_freed();
+  }
+}
+
+void
+USBInterface::cancel_queued_read(std::map<int, USBQueuedRead*>::iterator it)
+{
+  USBQueuedRead* read = it->second;
+  m_queued_reads.erase(it);
+  read->iface = nullptr;
+
+  if (read->transfers.empty())
+  {
+    delete_queued_read(read);
+    return;
+  }
+
+  // completions still waiting for flush_batches() are dropped
+  unmark_batch_dirty(read);
+  std::vector<libusb_transfer*> batch;
+  batch.swap(read->batch);
+
+  // transfers in flight come back as cancelled and leased ones are
+  // freed on release, either way the last one deletes the read
+  std::vector<libusb_transfer*> const transfers = read->transfers;
+  for(libusb_transfer* transfer : transfers)
+  {
+    auto const suspended_it = std::find(m_suspended.begin(), m_suspended.end(), transfer);
+    if (std::find(batch.begin(), batch.end(), transfer) != batch.end())
+    {
+      free_queued_transfer(read, transfer);
+    }
+    else if (suspended_it != m_suspended.end())
+    {
+      m_suspended.erase(suspended_it);
+      free_queued_transfer(read, transfer);
+    }
+    else
+    {
+      libusb_cancel_transfer(transfer);
+    }
+  }
 }
 
 void
@@ -187,51 +701,416 @@ USBInterface::cancel_write(int endpoint)
   cancel_transfer(endpoint | LIBUSB_ENDPOINT_OUT);
 }
 
+bool
+USBInterface::invoke_read_callback(USBReadData* userdata, libusb_transfer* transfer)
+{
+  UNSEBU_TRACE_SCOPE(Callback, transfer->endpoint);
+  USBWatchdogScope watchdog(transfer->dev_handle, transfer->endpoint);
+  USBMetricsTimer timer(&userdata->metrics->callback_duration);
+  return userdata->callback(transfer->buffer, transfer->actual_length);
+}
+
+bool
+USBInterface::invoke_write_callback(USBWriteData* userdata, libusb_transfer* transfer)
+{
+  UNSEBU_TRACE_SCOPE(Callback, transfer->endpoint);
+  USBWatchdogScope watchdog(transfer->dev_handle, transfer->endpoint);
+  USBMetricsTimer timer(&userdata->metrics->callback_duration);
+  return userdata->callback(transfer);
+}
+
 void
 USBInterface::on_read_data(USBReadData* userdata, libusb_transfer* transfer)
 {
-  if (userdata->callback(transfer->buffer, transfer->actual_length))
+  usb_count_completion();
+  userdata->metrics->on_complete(transfer);
+  UNSEBU_TRACE(Complete, Instant, transfer->endpoint, transfer->status);
+  if (m_recorder)
+  {
+    m_recorder->record(transfer);
+  }
+  if (m_capture)
+  {
+    m_capture->write_transfer(transfer);
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+  {
+    on_transfer_disconnected(transfer);
+  }
+  else if (!pass_read_filter(transfer) || invoke_read_callback(userdata, transfer))
   {
-    // callback returned true, thus resend the transfer
+    // report got filtered or callback returned true, thus resend the transfer
+    UNSEBU_TRACE(Resubmit, Instant, transfer->endpoint, transfer->length);
     int err;
     err = libusb_submit_transfer(transfer);
-    if (err != LIBUSB_SUCCESS)
+    if (err == LIBUSB_ERROR_NO_DEVICE)
     {
-      libusb_free_transfer(transfer);
-
-      throw std::runtime_error(fmt::format("libusb_submit_transfer(): {}", libusb_strerror(err)));
+      on_transfer_disconnected(transfer);
+    }
+    else if (err != LIBUSB_SUCCESS)
+    {
+      // throwing would unwind through libusb_handle_events()
+      log_error("failed to resubmit transfer on endpoint {:#x}: {}", transfer->endpoint, libusb_strerror(err));
+      delete userdata;
+      forget_transfer(transfer);
+      free_transfer(transfer);
+    }
+    else
+    {
+      userdata->metrics->on_submit();
     }
   }
   else
   {
     // callback returned false, thus doing cleanup
     delete userdata;
-    libusb_free_transfer(transfer);
-    m_endpoints.erase(transfer->endpoint);
+    forget_transfer(transfer);
+    free_transfer(transfer);
   }
 }
 
 void
 USBInterface::on_write_data(USBWriteData* userdata, libusb_transfer* transfer)
 {
-  if (userdata->callback(transfer))
+  usb_count_completion();
+  userdata->metrics->on_complete(transfer);
+  UNSEBU_TRACE(Complete, Instant, transfer->endpoint, transfer->status);
+  if (m_recorder)
+  {
+    m_recorder->record(transfer);
+  }
+  if (m_capture)
+  {
+    m_capture->write_transfer(transfer);
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+  {
+    on_transfer_disconnected(transfer);
+  }
+  else if (invoke_write_callback(userdata, transfer))
   {
     // callback returned true, thus resend the transfer (user is free
     // to fill it with new data)
+    UNSEBU_TRACE(Resubmit, Instant, transfer->endpoint, transfer->length);
     int err = libusb_submit_transfer(transfer);
-    if (err != LIBUSB_SUCCESS)
+    if (err == LIBUSB_ERROR_NO_DEVICE)
     {
-      libusb_free_transfer(transfer);
-
-      throw std::runtime_error(fmt::format("libusb_submit_transfer(): ", libusb_strerror(err)));
+      on_transfer_disconnected(transfer);
+    }
+    else if (err != LIBUSB_SUCCESS)
+    {
+      // throwing would unwind through libusb_handle_events()
+      log_error("failed to resubmit transfer on endpoint {:#x}: {}", transfer->endpoint, libusb_strerror(err));
+      delete userdata;
+      forget_transfer(transfer);
+      free_transfer(transfer);
+    }
+    else
+    {
+      userdata->metrics->on_submit();
     }
   }
   else
   {
     // callback returned false, thus doing cleanup
     delete userdata;
-    libusb_free_transfer(transfer);
-    m_endpoints.erase(transfer->endpoint);
+    forget_transfer(transfer);
+    free_transfer(transfer);
+  }
+}
+
+void
+USBInterface::set_buffer_arena(std::shared_ptr<USBBufferArena> arena)
+{
+  m_buffer_arena = std::move(arena);
+}
+
+void
+USBInterface::set_recorder(std::shared_ptr<USBRecorder> recorder)
+{
+  m_recorder = std::move(recorder);
+}
+
+void
+USBInterface::set_capture(std::shared_ptr<USBPcapngWriter> capture)
+{
+  m_capture = std::move(capture);
+}
+
+uint8_t*
+USBInterface::allocate_buffer(int len)
+{
+  if (m_buffer_arena)
+  {
+    return m_buffer_arena->allocate(static_cast<size_t>(len));
+  }
+  else
+  {
+    return static_cast<uint8_t*>(malloc(sizeof(uint8_t) * len));
+  }
+}
+
+void
+USBInterface::migrate_buffer(libusb_transfer* transfer)
+{
+  if (m_buffer_arena)
+  {
+    transfer->buffer = m_buffer_arena->migrate(transfer->buffer, static_cast<size_t>(transfer->length));
+  }
+}
+
+void
+USBInterface::discard_transfer(libusb_transfer* transfer)
+{
+  // a suspended transfer isn't in flight, its NO_DEVICE completion
+  // was already counted
+  bool const suspended = forget_suspended(transfer);
+  if (!suspended)
+  {
+    libusb_cancel_transfer(transfer);
+  }
+
+  // the transfer is freed without its CANCELLED completion ever being
+  // delivered, so the bookkeeping of on_complete() happens here
+  USBEndpointMetrics* metrics;
+  if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+  {
+    USBReadData* userdata = static_cast<USBReadData*>(transfer->user_data);
+    metrics = userdata->metrics;
+    delete userdata;
+  }
+  else
+  {
+    USBWriteData* userdata = static_cast<USBWriteData*>(transfer->user_data);
+    metrics = userdata->metrics;
+    delete userdata;
+  }
+
+  if (!suspended)
+  {
+    metrics->on_cancel();
+  }
+  free_transfer(transfer);
+}
+
+void
+USBInterface::free_transfer(libusb_transfer* transfer)
+{
+  if (m_buffer_arena)
+  {
+    m_buffer_arena->free(transfer->buffer);
+  }
+  else
+  {
+    free(transfer->buffer);
+  }
+  libusb_free_transfer(transfer);
+}
+
+void
+USBInterface::enable_threaded_submit()
+{
+  if (!m_submit_queue)
+  {
+    m_submit_queue = std::make_unique<USBSubmitQueue>([this](int endpoint, uint8_t* data, int len) {
+      libusb_transfer* transfer = start_write(endpoint, data, len, [](libusb_transfer*) { return false; });
+      m_posted_writes[transfer->endpoint].insert(transfer);
+    });
+  }
+}
+
+void
+USBInterface::post_write(int endpoint, uint8_t const* data, int len)
+{
+  if (!m_submit_queue)
+  {
+    throw std::logic_error("post_write() called without enable_threaded_submit()");
+  }
+
+  m_submit_queue->push(endpoint, data, len);
+}
+
+void
+USBInterface::set_read_filter(int endpoint, std::unique_ptr<USBReportFilter> filter)
+{
+  if (filter)
+  {
+    m_read_filters[endpoint | LIBUSB_ENDPOINT_IN] = std::move(filter);
+  }
+  else
+  {
+    m_read_filters.erase(endpoint | LIBUSB_ENDPOINT_IN);
+  }
+}
+
+USBReportFilter*
+USBInterface::get_read_filter(int endpoint) const
+{
+  auto const it = m_read_filters.find(endpoint | LIBUSB_ENDPOINT_IN);
+  return (it != m_read_filters.end()) ? it->second.get() : nullptr;
+}
+
+bool
+USBInterface::pass_read_filter(libusb_transfer* transfer)
+{
+  if (m_read_filters.empty() || transfer->status != LIBUSB_TRANSFER_COMPLETED)
+  {
+    return true;
+  }
+
+  auto const it = m_read_filters.find(transfer->endpoint);
+  if (it == m_read_filters.end())
+  {
+    return true;
+  }
+
+  if (it->second->check(transfer->buffer, transfer->actual_length))
+  {
+    return true;
+  }
+  else
+  {
+    get_metrics(transfer->endpoint)->filtered.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+}
+
+USBEndpointMetrics*
+USBInterface::get_metrics(int address)
+{
+  USBEndpointMetrics*& metrics = m_metrics[address];
+  if (!metrics)
+  {
+    if (m_device_label.empty())
+    {
+      m_device_label = usb_get_device_label(libusb_get_device(m_handle));
+    }
+    metrics = USBMetrics::instance().get_endpoint(m_device_label, static_cast<uint8_t>(address));
+  }
+  return metrics;
+}
+
+void
+USBInterface::set_disconnect_callback(std::function<void ()> const& callback)
+{
+  m_disconnect_callback = callback;
+}
+
+void
+USBInterface::on_transfer_disconnected(libusb_transfer* transfer)
+{
+  if (transfer->dev_handle != m_handle)
+  {
+    // transfer was still in flight on the old handle when reattach()
+    // happened, move it over to the new one
+    migrate_buffer(transfer);
+    transfer->dev_handle = m_handle;
+    if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+    {
+      get_metrics(transfer->endpoint)->on_submit();
+      return;
+    }
+  }
+
+  m_suspended.push_back(transfer);
+
+  if (!m_disconnected)
+  {
+    m_disconnected = true;
+    if (m_disconnect_callback)
+    {
+      m_disconnect_callback();
+    }
+  }
+}
+
+void
+USBInterface::suspend_transfer(libusb_transfer* transfer)
+{
+  on_transfer_disconnected(transfer);
+}
+
+bool
+USBInterface::take_suspended(libusb_transfer* transfer)
+{
+  return forget_suspended(transfer);
+}
+
+void
+USBInterface::forget_transfer(libusb_transfer* transfer)
+{
+  auto const it = m_endpoints.find(transfer->endpoint);
+  if (it != m_endpoints.end() && it->second == transfer)
+  {
+    m_endpoints.erase(it);
+  }
+
+  auto const posted_it = m_posted_writes.find(transfer->endpoint);
+  if (posted_it != m_posted_writes.end())
+  {
+    posted_it->second.erase(transfer);
+  }
+}
+
+bool
+USBInterface::forget_suspended(libusb_transfer* transfer)
+{
+  auto const it = std::remove(m_suspended.begin(), m_suspended.end(), transfer);
+  bool const found = (it != m_suspended.end());
+  m_suspended.erase(it, m_suspended.end());
+  return found;
+}
+
+void
+USBInterface::claim_on(libusb_device_handle* handle) const
+{
+  int err = usb_claim_n_detach_interface(handle, m_interface, m_try_detach);
+  if (err != LIBUSB_SUCCESS)
+  {
+    throw std::runtime_error(fmt::format("error claiming interface: {}: {}", m_interface, libusb_strerror(err)));
+  }
+}
+
+void
+USBInterface::reattach(std::shared_ptr<libusb_device_handle> handle,
+                       std::shared_ptr<USBBufferArena> arena)
+{
+  m_handle_ref = std::move(handle);
+  m_handle = m_handle_ref.get();
+  m_disconnected = false;
+
+  if (arena)
+  {
+    // device memory of the old arena is mapped from the old handle,
+    // the new arena keeps it around until its buffers are migrated
+    arena->adopt(m_buffer_arena);
+    m_buffer_arena = std::move(arena);
+    for(auto& it : m_queued_reads)
+    {
+      it.second->arena = m_buffer_arena;
+    }
+  }
+
+  std::vector<libusb_transfer*> suspended;
+  suspended.swap(m_suspended);
+
+  for(libusb_transfer* transfer : suspended)
+  {
+    migrate_buffer(transfer);
+    transfer->dev_handle = m_handle;
+    int err = libusb_submit_transfer(transfer);
+    if (err != LIBUSB_SUCCESS)
+    {
+      log_warn("failed to resubmit transfer on endpoint {}: {}", transfer->endpoint, libusb_strerror(err));
+      m_suspended.push_back(transfer);
+      m_disconnected = true;
+    }
+    else
+    {
+      get_metrics(transfer->endpoint)->on_submit();
+    }
   }
 }
 
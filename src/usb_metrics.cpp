@@ -0,0 +1,320 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_metrics.hpp"
+
+#include <fmt/format.h>
+
+namespace unsebu {
+
+namespace {
+
+size_t const size_class_bytes[] = { 64, 512, 4096, 16384 };
+
+char const* error_status_name(int status)
+{
+  switch (status)
+  {
+    case LIBUSB_TRANSFER_ERROR: return "error";
+    case LIBUSB_TRANSFER_TIMED_OUT: return "timed_out";
+    case LIBUSB_TRANSFER_STALL: return "stall";
+    case LIBUSB_TRANSFER_NO_DEVICE: return "no_device";
+    case LIBUSB_TRANSFER_OVERFLOW: return "overflow";
+    default: return nullptr;
+  }
+}
+
+std::string escape_label(std::string const& value)
+{
+  std::string result;
+  for(char c : value)
+  {
+    if (c == '\\' || c == '"')
+    {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result;
+}
+
+} // namespace
+
+const uint64_t USBMetricsHistogram::bounds_us[USBMetricsHistogram::num_bounds] = {
+  10, 50, 100, 500, 1000, 5000, 10000, 50000
+};
+
+USBMetricsHistogram::USBMetricsHistogram() :
+  m_buckets(),
+  m_sum_us(0),
+  m_count(0)
+{
+  for(auto& bucket : m_buckets)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void
+USBMetricsHistogram::observe(std::chrono::microseconds duration)
+{
+  uint64_t const us = static_cast<uint64_t>(duration.count());
+
+  size_t idx = 0;
+  while (idx < num_bounds && us > bounds_us[idx])
+  {
+    idx += 1;
+  }
+
+  m_buckets[idx].fetch_add(1, std::memory_order_relaxed);
+  m_sum_us.fetch_add(us, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+USBMetricsHistogram::format(std::string& out, char const* name, std::string const& labels) const
+{
+  std::string const sep = labels.empty() ? "" : ",";
+
+  // Prometheus buckets are cumulative
+  uint64_t cumulative = 0;
+  for(size_t i = 0; i < num_bounds; ++i)
+  {
+    cumulative += m_buckets[i].load(std::memory_order_relaxed);
+    out += fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, sep,
+                       static_cast<double>(bounds_us[i]) / 1000000.0, cumulative);
+  }
+  cumulative += m_buckets[num_bounds].load(std::memory_order_relaxed);
+  out += fmt::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, cumulative);
+  std::string const braced = labels.empty() ? "" : "{" + labels + "}";
+  out += fmt::format("{}_sum{} {}\n", name, braced,
+                     static_cast<double>(m_sum_us.load(std::memory_order_relaxed)) / 1000000.0);
+  out += fmt::format("{}_count{} {}\n", name, braced, m_count.load(std::memory_order_relaxed));
+}
+
+USBEndpointMetrics::USBEndpointMetrics(std::string const& device_, uint8_t endpoint_) :
+  device(device_),
+  endpoint(endpoint_),
+  transfers(0),
+  bytes(0),
+  cancelled(0),
+  errors(),
+  filtered(0),
+  in_flight(0),
+  leased(0),
+  callback_duration(),
+  next(nullptr)
+{
+  for(auto& error : errors)
+  {
+    error.store(0, std::memory_order_relaxed);
+  }
+}
+
+void
+USBEndpointMetrics::on_cancel()
+{
+  in_flight.fetch_sub(1, std::memory_order_relaxed);
+  cancelled.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+USBEndpointMetrics::on_complete(libusb_transfer const* transfer)
+{
+  in_flight.fetch_sub(1, std::memory_order_relaxed);
+
+  switch (transfer->status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED:
+      transfers.fetch_add(1, std::memory_order_relaxed);
+      bytes.fetch_add(static_cast<uint64_t>(transfer->actual_length), std::memory_order_relaxed);
+      break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+      cancelled.fetch_add(1, std::memory_order_relaxed);
+      break;
+
+    default:
+      if (transfer->status >= 0 && transfer->status <= LIBUSB_TRANSFER_OVERFLOW)
+      {
+        errors[transfer->status].fetch_add(1, std::memory_order_relaxed);
+      }
+      break;
+  }
+}
+
+USBMetrics&
+USBMetrics::instance()
+{
+  static USBMetrics metrics;
+  return metrics;
+}
+
+USBMetrics::USBMetrics() :
+  m_endpoints(nullptr),
+  m_timing_users(0),
+  m_arena_blocks_in_use(),
+  m_heap_buffers_in_use(0),
+  m_heap_allocations(0),
+  m_dispatch_duration()
+{
+  for(auto& blocks : m_arena_blocks_in_use)
+  {
+    blocks.store(0, std::memory_order_relaxed);
+  }
+}
+
+USBEndpointMetrics*
+USBMetrics::get_endpoint(std::string const& device, uint8_t endpoint)
+{
+  for(USBEndpointMetrics* it = m_endpoints.load(std::memory_order_acquire); it != nullptr; it = it->next)
+  {
+    if (it->endpoint == endpoint && it->device == device)
+    {
+      return it;
+    }
+  }
+
+  // readers only ever see fully constructed entries, as the entry is
+  // published with a release store
+  USBEndpointMetrics* metrics = new USBEndpointMetrics(device, endpoint);
+  metrics->next = m_endpoints.load(std::memory_order_relaxed);
+  m_endpoints.store(metrics, std::memory_order_release);
+  return metrics;
+}
+
+void
+USBMetrics::on_arena_allocate(size_t size_class, bool from_arena)
+{
+  if (from_arena)
+  {
+    m_arena_blocks_in_use[size_class].fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    m_heap_buffers_in_use.fetch_add(1, std::memory_order_relaxed);
+    m_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void
+USBMetrics::on_arena_free(size_t size_class, bool from_arena)
+{
+  if (from_arena)
+  {
+    m_arena_blocks_in_use[size_class].fetch_sub(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    m_heap_buffers_in_use.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+std::string
+USBMetrics::format_prometheus() const
+{
+  std::string out;
+
+  USBEndpointMetrics* const head = m_endpoints.load(std::memory_order_acquire);
+
+  auto for_each_endpoint = [head](auto const& func) {
+    for(USBEndpointMetrics* it = head; it != nullptr; it = it->next)
+    {
+      func(*it, fmt::format("device=\"{}\",endpoint=\"{:#04x}\"", escape_label(it->device), it->endpoint));
+    }
+  };
+
+  out += "# HELP unsebu_transfers_total Successfully completed transfers.\n";
+  out += "# TYPE unsebu_transfers_total counter\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_transfers_total{{{}}} {}\n", labels, ep.transfers.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_transfer_bytes_total Bytes transferred by completed transfers.\n";
+  out += "# TYPE unsebu_transfer_bytes_total counter\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_transfer_bytes_total{{{}}} {}\n", labels, ep.bytes.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_transfer_errors_total Transfers that failed, by libusb transfer status.\n";
+  out += "# TYPE unsebu_transfer_errors_total counter\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    for(int status = 0; status <= LIBUSB_TRANSFER_OVERFLOW; ++status)
+    {
+      if (char const* name = error_status_name(status))
+      {
+        out += fmt::format("unsebu_transfer_errors_total{{{},status=\"{}\"}} {}\n",
+                           labels, name, ep.errors[status].load(std::memory_order_relaxed));
+      }
+    }
+  });
+
+  out += "# HELP unsebu_transfers_cancelled_total Transfers that were cancelled.\n";
+  out += "# TYPE unsebu_transfers_cancelled_total counter\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_transfers_cancelled_total{{{}}} {}\n", labels, ep.cancelled.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_reports_filtered_total Reports dropped by a read filter.\n";
+  out += "# TYPE unsebu_reports_filtered_total counter\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_reports_filtered_total{{{}}} {}\n", labels, ep.filtered.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_transfers_in_flight Transfers currently submitted to libusb.\n";
+  out += "# TYPE unsebu_transfers_in_flight gauge\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_transfers_in_flight{{{}}} {}\n", labels, ep.in_flight.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_transfers_leased Completed reads held by a lease and not yet released.\n";
+  out += "# TYPE unsebu_transfers_leased gauge\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    out += fmt::format("unsebu_transfers_leased{{{}}} {}\n", labels, ep.leased.load(std::memory_order_relaxed));
+  });
+
+  out += "# HELP unsebu_callback_duration_seconds Time spent in user callbacks.\n";
+  out += "# TYPE unsebu_callback_duration_seconds histogram\n";
+  for_each_endpoint([&out](USBEndpointMetrics const& ep, std::string const& labels) {
+    ep.callback_duration.format(out, "unsebu_callback_duration_seconds", labels);
+  });
+
+  out += "# HELP unsebu_dispatch_duration_seconds Time spent per USBGSource dispatch.\n";
+  out += "# TYPE unsebu_dispatch_duration_seconds histogram\n";
+  m_dispatch_duration.format(out, "unsebu_dispatch_duration_seconds", "");
+
+  out += "# HELP unsebu_arena_blocks_in_use Transfer buffers taken from the buffer arena, by block size.\n";
+  out += "# TYPE unsebu_arena_blocks_in_use gauge\n";
+  for(size_t i = 0; i < num_size_classes; ++i)
+  {
+    out += fmt::format("unsebu_arena_blocks_in_use{{size=\"{}\"}} {}\n",
+                       size_class_bytes[i], m_arena_blocks_in_use[i].load(std::memory_order_relaxed));
+  }
+
+  out += "# HELP unsebu_heap_buffers_in_use Transfer buffers the buffer arena allocated from the heap.\n";
+  out += "# TYPE unsebu_heap_buffers_in_use gauge\n";
+  out += fmt::format("unsebu_heap_buffers_in_use {}\n", m_heap_buffers_in_use.load(std::memory_order_relaxed));
+
+  out += "# HELP unsebu_heap_allocations_total Transfer buffers that didn't fit into the buffer arena.\n";
+  out += "# TYPE unsebu_heap_allocations_total counter\n";
+  out += fmt::format("unsebu_heap_allocations_total {}\n", m_heap_allocations.load(std::memory_order_relaxed));
+
+  return out;
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,225 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_metrics_exporter.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_metrics.hpp"
+
+namespace unsebu {
+
+USBMetricsExporter::USBMetricsExporter(std::string const& socket_path) :
+  m_listen_fd(-1),
+  m_stop_fd(-1),
+  m_socket_path(),
+  m_thread()
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+  {
+    throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+  }
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    throw std::runtime_error(fmt::format("socket() failed: {}", strerror(errno)));
+  }
+
+  unlink(socket_path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 8) < 0)
+  {
+    int const err = errno;
+    close(fd);
+    throw std::runtime_error(fmt::format("failed to listen on {}: {}", socket_path, strerror(err)));
+  }
+
+  m_socket_path = socket_path;
+  start(fd);
+}
+
+USBMetricsExporter::USBMetricsExporter(uint16_t port) :
+  m_listen_fd(-1),
+  m_stop_fd(-1),
+  m_socket_path(),
+  m_thread()
+{
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    throw std::runtime_error(fmt::format("socket() failed: {}", strerror(errno)));
+  }
+
+  int const reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 8) < 0)
+  {
+    int const err = errno;
+    close(fd);
+    throw std::runtime_error(fmt::format("failed to listen on 127.0.0.1:{}: {}", port, strerror(err)));
+  }
+
+  start(fd);
+}
+
+USBMetricsExporter::~USBMetricsExporter()
+{
+  uint64_t const value = 1;
+  if (write(m_stop_fd, &value, sizeof(value)) < 0)
+  {
+    log_error("failed to stop metrics exporter: {}", strerror(errno));
+  }
+  m_thread.join();
+
+  USBMetrics::instance().disable_timing();
+
+  close(m_stop_fd);
+  close(m_listen_fd);
+  if (!m_socket_path.empty())
+  {
+    unlink(m_socket_path.c_str());
+  }
+}
+
+void
+USBMetricsExporter::start(int listen_fd)
+{
+  m_listen_fd = listen_fd;
+  m_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (m_stop_fd < 0)
+  {
+    int const err = errno;
+    close(m_listen_fd);
+    throw std::runtime_error(fmt::format("eventfd() failed: {}", strerror(err)));
+  }
+
+  USBMetrics::instance().enable_timing();
+  m_thread = std::thread([this]{ run(); });
+}
+
+void
+USBMetricsExporter::run()
+{
+  while (true)
+  {
+    pollfd fds[2] = {
+      { m_listen_fd, POLLIN, 0 },
+      { m_stop_fd, POLLIN, 0 }
+    };
+
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      log_error("metrics exporter: poll() failed: {}", strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents)
+    {
+      return;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int client = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client >= 0)
+      {
+        serve(client);
+        close(client);
+      }
+      else if (errno != EINTR && errno != EAGAIN)
+      {
+        log_error("metrics exporter: accept() failed: {}", strerror(errno));
+      }
+    }
+  }
+}
+
+void
+USBMetricsExporter::serve(int client)
+{
+  // read the request header, but don't insist on one, so a plain
+  // 'socat - UNIX-CONNECT:path' gets an answer too
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+  {
+    pollfd pfd = { client, POLLIN, 0 };
+    if (poll(&pfd, 1, 100) <= 0)
+    {
+      break;
+    }
+
+    ssize_t const len = read(client, buf, sizeof(buf));
+    if (len <= 0)
+    {
+      break;
+    }
+    request.append(buf, static_cast<size_t>(len));
+  }
+
+  std::string const body = USBMetrics::instance().format_prometheus();
+  std::string const response =
+    fmt::format("HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: {}\r\n"
+                "Connection: close\r\n"
+                "\r\n", body.size()) + body;
+
+  size_t offset = 0;
+  while (offset < response.size())
+  {
+    ssize_t const len = send(client, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+    if (len < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      log_debug("metrics exporter: send() failed: {}", strerror(errno));
+      return;
+    }
+    offset += static_cast<size_t>(len);
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,297 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_mon_reader.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+namespace unsebu {
+
+namespace {
+
+// from drivers/usb/mon/mon_bin.c, there is no uapi header for these
+struct mon_bin_stats
+{
+  uint32_t queued;
+  uint32_t dropped;
+};
+
+struct mon_bin_mfetch
+{
+  uint32_t* offvec;
+  uint32_t nfetch;
+  uint32_t nflush;
+};
+
+unsigned long const mon_iocg_stats = _IOR(0x92, 3, mon_bin_stats);
+unsigned long const mon_ioct_ring_size = _IO(0x92, 4);
+unsigned long const mon_iocq_ring_size = _IO(0x92, 5);
+unsigned long const mon_iocx_mfetch = _IOWR(0x92, 7, mon_bin_mfetch);
+
+/** Packets start on 64 byte boundaries in the ring */
+size_t const packet_alignment = 64;
+
+/** Offsets fetched per MON_IOCX_MFETCH */
+size_t const fetch_count = 4096;
+
+} // namespace
+
+USBMonRing::USBMonRing(uint8_t const* data, size_t size) :
+  m_data(data),
+  m_size(size)
+{
+}
+
+size_t
+USBMonRing::get_packet_size(USBMonHeader const& header)
+{
+  return (sizeof(USBMonHeader) + header.len_cap + packet_alignment - 1) & ~(packet_alignment - 1);
+}
+
+USBMonHeader const*
+USBMonRing::get_header(size_t offset) const
+{
+  if (offset % packet_alignment != 0 || offset + sizeof(USBMonHeader) > m_size)
+  {
+    throw std::runtime_error(fmt::format("bad usbmon ring offset {}", offset));
+  }
+
+  USBMonHeader const* header = reinterpret_cast<USBMonHeader const*>(m_data + offset);
+  if (header->len_cap > m_size - offset - sizeof(USBMonHeader))
+  {
+    throw std::runtime_error(fmt::format("usbmon packet at offset {} exceeds the ring", offset));
+  }
+  return header;
+}
+
+size_t
+USBMonRing::dispatch(uint32_t const* offsets, size_t count,
+                     USBMonFilter const& filter, USBMonCallback const& callback) const
+{
+  size_t delivered = 0;
+  for(size_t i = 0; i < count; ++i)
+  {
+    USBMonHeader const* header = get_header(offsets[i]);
+
+    // '@' packets pad the end of the ring
+    if (header->type != '@' && filter.match(*header))
+    {
+      callback(*header, reinterpret_cast<uint8_t const*>(header + 1));
+      delivered += 1;
+    }
+  }
+  return delivered;
+}
+
+USBMonReader::USBMonReader(int bus, size_t ring_size) :
+  m_fd(-1),
+  m_ring(nullptr),
+  m_ring_size(0),
+  m_filter(),
+  m_offsets(fetch_count),
+  m_pending_flush(0),
+  m_fixture_ring(),
+  m_fixture_offsets(),
+  m_fixture_head(0)
+{
+  std::string const filename = fmt::format("/dev/usbmon{}", bus);
+  m_fd = open(filename.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (m_fd < 0)
+  {
+    throw std::runtime_error(fmt::format("failed to open {}: {}", filename, strerror(errno)));
+  }
+
+  if (ring_size != 0 && ioctl(m_fd, mon_ioct_ring_size, ring_size) < 0)
+  {
+    int const err = errno;
+    close(m_fd);
+    throw std::runtime_error(fmt::format("failed to set the usbmon ring size to {}: {}", ring_size, strerror(err)));
+  }
+
+  int const size = ioctl(m_fd, mon_iocq_ring_size);
+  if (size <= 0)
+  {
+    int const err = errno;
+    close(m_fd);
+    throw std::runtime_error(fmt::format("failed to get the usbmon ring size: {}", strerror(err)));
+  }
+  m_ring_size = static_cast<size_t>(size);
+
+  void* ring = mmap(nullptr, m_ring_size, PROT_READ, MAP_SHARED, m_fd, 0);
+  if (ring == MAP_FAILED)
+  {
+    int const err = errno;
+    close(m_fd);
+    throw std::runtime_error(fmt::format("failed to map the usbmon ring: {}", strerror(err)));
+  }
+  m_ring = static_cast<uint8_t*>(ring);
+}
+
+USBMonReader::USBMonReader(std::string const& fixture) :
+  m_fd(-1),
+  m_ring(nullptr),
+  m_ring_size(0),
+  m_filter(),
+  m_offsets(fetch_count),
+  m_pending_flush(0),
+  m_fixture_ring(),
+  m_fixture_offsets(),
+  m_fixture_head(0)
+{
+  std::ifstream in(fixture, std::ios::binary);
+  if (!in)
+  {
+    throw std::runtime_error(fmt::format("failed to open {}", fixture));
+  }
+  std::vector<uint8_t> const data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  auto read_u32 = [&data](size_t pos) {
+    return (static_cast<uint32_t>(data[pos + 0]) << 0) |
+      (static_cast<uint32_t>(data[pos + 1]) << 8) |
+      (static_cast<uint32_t>(data[pos + 2]) << 16) |
+      (static_cast<uint32_t>(data[pos + 3]) << 24);
+  };
+
+  if (data.size() < 8)
+  {
+    throw std::runtime_error(fmt::format("{}: not a usbmon fixture", fixture));
+  }
+
+  uint64_t const ring_size = read_u32(0);
+  uint64_t const count = read_u32(4);
+  if (data.size() != 8 + ring_size + 4 * count)
+  {
+    throw std::runtime_error(fmt::format("{}: size doesn't match a {} byte ring with {} events",
+                                         fixture, ring_size, count));
+  }
+
+  m_fixture_ring.assign(data.begin() + 8, data.begin() + 8 + static_cast<ptrdiff_t>(ring_size));
+  for(uint64_t i = 0; i < count; ++i)
+  {
+    m_fixture_offsets.push_back(read_u32(8 + ring_size + 4 * i));
+  }
+
+  m_ring = m_fixture_ring.data();
+  m_ring_size = m_fixture_ring.size();
+}
+
+USBMonReader::~USBMonReader()
+{
+  if (m_fd >= 0)
+  {
+    munmap(m_ring, m_ring_size);
+    close(m_fd);
+  }
+}
+
+int
+USBMonReader::mfetch(uint32_t nflush, uint32_t& nfetch)
+{
+  if (m_fd >= 0)
+  {
+    mon_bin_mfetch mfetch = { m_offsets.data(), nfetch, nflush };
+    int const ret = ioctl(m_fd, mon_iocx_mfetch, &mfetch);
+    nfetch = mfetch.nfetch;
+    return ret;
+  }
+
+  // same as mon_bin.c for a non-blocking file: flush from the oldest
+  // event on, then hand out the offsets without consuming them
+  size_t const remaining = m_fixture_offsets.size() - m_fixture_head;
+  m_fixture_head += std::min<size_t>(nflush, remaining);
+
+  nfetch = static_cast<uint32_t>(std::min<size_t>(nfetch, m_fixture_offsets.size() - m_fixture_head));
+  if (nfetch == 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  std::copy_n(m_fixture_offsets.begin() + static_cast<ptrdiff_t>(m_fixture_head), nfetch, m_offsets.begin());
+  return 0;
+}
+
+size_t
+USBMonReader::fetch(int timeout, USBMonCallback const& callback)
+{
+  uint32_t nfetch = static_cast<uint32_t>(m_offsets.size());
+
+  // the kernel releases the nflush events before it waits, so they
+  // are gone even when the call fails with EAGAIN or EINTR
+  int ret = mfetch(m_pending_flush, nfetch);
+  m_pending_flush = 0;
+
+  if (ret < 0 && errno == EAGAIN)
+  {
+    if (m_fd < 0)
+    {
+      // nothing ever gets added to a fixture
+      return 0;
+    }
+
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout) <= 0)
+    {
+      return 0;
+    }
+
+    nfetch = static_cast<uint32_t>(m_offsets.size());
+    ret = mfetch(0, nfetch);
+  }
+
+  if (ret < 0)
+  {
+    if (errno == EAGAIN || errno == EINTR)
+    {
+      return 0;
+    }
+    throw std::runtime_error(fmt::format("MON_IOCX_MFETCH failed: {}", strerror(errno)));
+  }
+
+  // filler packets are part of the fetched events and get flushed too
+  m_pending_flush = nfetch;
+
+  USBMonRing ring(m_ring, m_ring_size);
+  return ring.dispatch(m_offsets.data(), nfetch, m_filter, callback);
+}
+
+uint32_t
+USBMonReader::get_kernel_dropped() const
+{
+  mon_bin_stats stats = {};
+  if (ioctl(m_fd, mon_iocg_stats, &stats) < 0)
+  {
+    return 0;
+  }
+  return stats.dropped;
+}
+
+} // namespace unsebu
+
+/* EOF */
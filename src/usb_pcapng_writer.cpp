@@ -0,0 +1,473 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_pcapng_writer.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+namespace unsebu {
+
+namespace {
+
+/** O_DIRECT wants offsets and lengths aligned to the logical block
+    size, a page covers all common devices */
+size_t const direct_alignment = 4096;
+
+uint32_t const block_type_shb = 0x0a0d0d0a;
+uint32_t const block_type_idb = 0x00000001;
+uint32_t const block_type_isb = 0x00000005;
+uint32_t const block_type_epb = 0x00000006;
+
+uint16_t const opt_endofopt = 0;
+uint16_t const opt_shb_userappl = 4;
+uint16_t const opt_if_name = 2;
+uint16_t const opt_if_tsresol = 9;
+uint16_t const opt_isb_starttime = 2;
+uint16_t const opt_isb_endtime = 3;
+uint16_t const opt_isb_ifrecv = 4;
+uint16_t const opt_isb_ifdrop = 5;
+
+/** Block type, block length, interface id, timestamp, captured and
+    original length, plus the trailing block length */
+size_t const epb_overhead = 32;
+
+size_t pad4(size_t len)
+{
+  return (len + 3) & ~static_cast<size_t>(3);
+}
+
+uint64_t get_realtime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+uint8_t usbmon_xfer_type(uint8_t type)
+{
+  switch (type)
+  {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS: return 0;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT: return 1;
+    case LIBUSB_TRANSFER_TYPE_CONTROL: return 2;
+    default: return 3;
+  }
+}
+
+int32_t usbmon_status(libusb_transfer_status status)
+{
+  switch (status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED: return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED: return -ENOENT;
+    case LIBUSB_TRANSFER_STALL: return -EPIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+    case LIBUSB_TRANSFER_OVERFLOW: return -EOVERFLOW;
+    default: return -EPROTO;
+  }
+}
+
+} // namespace
+
+struct USBPcapngWriter::Buffer
+{
+  Buffer(size_t size) :
+    data(static_cast<uint8_t*>(aligned_alloc(direct_alignment, size))),
+    len(0),
+    final(false)
+  {
+    if (!data)
+    {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~Buffer()
+  {
+    free(data);
+  }
+
+  uint8_t* data;
+  size_t len;
+  bool final;
+
+private:
+  Buffer(const Buffer&);
+  Buffer& operator=(const Buffer&);
+};
+
+USBPcapngWriter::USBPcapngWriter(std::string const& filename, size_t buffer_size, int max_buffers) :
+  m_fd(-1),
+  m_direct(true),
+  m_buffer_size((std::max(buffer_size, 16 * direct_alignment) + direct_alignment - 1) & ~(direct_alignment - 1)),
+  m_max_buffers(std::max(max_buffers, 2)),
+  m_buffers(),
+  m_current(nullptr),
+  m_mutex(),
+  m_cond(),
+  m_full(),
+  m_free(),
+  m_thread(),
+  m_packets(0),
+  m_dropped(0),
+  m_start_time(get_realtime()),
+  m_error(0)
+{
+  m_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+  if (m_fd < 0 && errno == EINVAL)
+  {
+    // file system without O_DIRECT support
+    m_direct = false;
+    m_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+
+  if (m_fd < 0)
+  {
+    throw std::runtime_error(fmt::format("failed to open {}: {}", filename, strerror(errno)));
+  }
+
+  m_current = acquire_buffer();
+
+  // section header block
+  char const userappl[] = "unsebu";
+  uint32_t const shb_len = 24 + 4 + static_cast<uint32_t>(pad4(sizeof(userappl) - 1)) + 4 + 4;
+  uint32_t const byte_order_magic = 0x1a2b3c4d;
+  uint16_t const version[2] = { 1, 0 };
+  int64_t const section_length = -1;
+  uint16_t const userappl_opt[2] = { opt_shb_userappl, static_cast<uint16_t>(sizeof(userappl) - 1) };
+  uint16_t const endofopt[2] = { opt_endofopt, 0 };
+  append(&block_type_shb, 4);
+  append(&shb_len, 4);
+  append(&byte_order_magic, 4);
+  append(version, 4);
+  append(&section_length, 8);
+  append(userappl_opt, 4);
+  append(userappl, sizeof(userappl) - 1);
+  append_padding(pad4(sizeof(userappl) - 1) - (sizeof(userappl) - 1));
+  append(endofopt, 4);
+  append(&shb_len, 4);
+
+  // interface description block, timestamps are in nanoseconds
+  char const if_name[] = "usb";
+  uint32_t const idb_len = 16 + 8 + 4 + static_cast<uint32_t>(pad4(sizeof(if_name) - 1)) + 4 + 4;
+  uint16_t const linktype[2] = { usb_linktype_linux_mmapped, 0 };
+  uint32_t const snaplen = 0;
+  uint16_t const tsresol_opt[2] = { opt_if_tsresol, 1 };
+  uint8_t const tsresol[4] = { 9, 0, 0, 0 };
+  uint16_t const if_name_opt[2] = { opt_if_name, static_cast<uint16_t>(sizeof(if_name) - 1) };
+  append(&block_type_idb, 4);
+  append(&idb_len, 4);
+  append(linktype, 4);
+  append(&snaplen, 4);
+  append(tsresol_opt, 4);
+  append(tsresol, 4);
+  append(if_name_opt, 4);
+  append(if_name, sizeof(if_name) - 1);
+  append_padding(pad4(sizeof(if_name) - 1) - (sizeof(if_name) - 1));
+  append(endofopt, 4);
+  append(&idb_len, 4);
+
+  m_thread = std::thread([this]{ writer_thread(); });
+}
+
+USBPcapngWriter::~USBPcapngWriter()
+{
+  write_interface_statistics();
+  submit_current(true);
+  m_thread.join();
+
+  close(m_fd);
+
+  if (m_dropped > 0)
+  {
+    log_warn("pcapng capture dropped {} packets", m_dropped);
+  }
+}
+
+bool
+USBPcapngWriter::write_packet(USBMonHeader const& header_in, uint8_t const* data, uint64_t timestamp)
+{
+  // a packet has to fit into a single buffer, anything larger gets
+  // truncated like with a snaplen
+  size_t const max_data = m_buffer_size - direct_alignment - epb_overhead - sizeof(USBMonHeader);
+
+  USBMonHeader header = header_in;
+  header.len_cap = static_cast<uint32_t>(std::min<size_t>(header.len_cap, max_data));
+
+  size_t const captured = sizeof(USBMonHeader) + header.len_cap;
+  size_t const block_len = epb_overhead + pad4(captured);
+
+  if (!reserve(block_len))
+  {
+    m_dropped += 1;
+    return false;
+  }
+
+  uint32_t const epb[7] = {
+    block_type_epb,
+    static_cast<uint32_t>(block_len),
+    0, // interface id
+    static_cast<uint32_t>(timestamp >> 32),
+    static_cast<uint32_t>(timestamp),
+    static_cast<uint32_t>(captured),
+    static_cast<uint32_t>(sizeof(USBMonHeader) + header.length)
+  };
+  uint32_t const trailer = static_cast<uint32_t>(block_len);
+
+  append(epb, sizeof(epb));
+  append(&header, sizeof(header));
+  append(data, header.len_cap);
+  append_padding(pad4(captured) - captured);
+  append(&trailer, 4);
+
+  m_packets += 1;
+  return true;
+}
+
+bool
+USBPcapngWriter::write_transfer(libusb_transfer const* transfer)
+{
+  uint64_t const timestamp = get_realtime();
+  libusb_device* dev = libusb_get_device(transfer->dev_handle);
+
+  bool const is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+  int const len = std::max(transfer->actual_length, 0);
+
+  USBMonHeader header = {};
+  header.id = reinterpret_cast<uintptr_t>(transfer);
+  header.type = 'C';
+  header.xfer_type = usbmon_xfer_type(transfer->type);
+  header.epnum = transfer->endpoint;
+  header.devnum = libusb_get_device_address(dev);
+  header.busnum = libusb_get_bus_number(dev);
+  header.flag_setup = '-';
+  header.flag_data = (len > 0) ? 0 : (is_in ? '<' : '>');
+  header.ts_sec = static_cast<int64_t>(timestamp / 1000000000ull);
+  header.ts_usec = static_cast<int32_t>(timestamp % 1000000000ull / 1000);
+  header.status = usbmon_status(transfer->status);
+  header.length = static_cast<uint32_t>(len);
+  header.len_cap = static_cast<uint32_t>(len);
+
+  return write_packet(header, transfer->buffer, timestamp);
+}
+
+void
+USBPcapngWriter::flush()
+{
+  if (m_current->len > (m_direct ? direct_alignment : 0))
+  {
+    submit_current(false);
+  }
+}
+
+void
+USBPcapngWriter::append(void const* data, size_t len)
+{
+  memcpy(m_current->data + m_current->len, data, len);
+  m_current->len += len;
+}
+
+void
+USBPcapngWriter::append_padding(size_t len)
+{
+  memset(m_current->data + m_current->len, 0, len);
+  m_current->len += len;
+}
+
+bool
+USBPcapngWriter::reserve(size_t len)
+{
+  if (m_current->len + len <= m_buffer_size)
+  {
+    return true;
+  }
+  else
+  {
+    return submit_current(false) && m_current->len + len <= m_buffer_size;
+  }
+}
+
+bool
+USBPcapngWriter::submit_current(bool final)
+{
+  Buffer* const full = m_current;
+  Buffer* next = nullptr;
+
+  if (!final)
+  {
+    next = acquire_buffer();
+    if (!next)
+    {
+      return false;
+    }
+
+    // O_DIRECT writes whole blocks, the rest moves on to the next buffer
+    size_t const tail = m_direct ? full->len % direct_alignment : 0;
+    memcpy(next->data, full->data + full->len - tail, tail);
+    next->len = tail;
+    full->len -= tail;
+  }
+
+  full->final = final;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_full.push_back(full);
+  }
+  m_cond.notify_one();
+
+  m_current = next;
+  return true;
+}
+
+USBPcapngWriter::Buffer*
+USBPcapngWriter::acquire_buffer()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_free.empty())
+    {
+      Buffer* buffer = m_free.back();
+      m_free.pop_back();
+      buffer->len = 0;
+      buffer->final = false;
+      return buffer;
+    }
+  }
+
+  if (static_cast<int>(m_buffers.size()) >= m_max_buffers)
+  {
+    return nullptr;
+  }
+
+  m_buffers.push_back(std::make_unique<Buffer>(m_buffer_size));
+  return m_buffers.back().get();
+}
+
+void
+USBPcapngWriter::write_interface_statistics()
+{
+  uint64_t const end_time = get_realtime();
+  uint32_t const isb_len = 20 + 4 * (4 + 8) + 4 + 4;
+
+  if (!reserve(isb_len))
+  {
+    return;
+  }
+
+  uint32_t const head[5] = {
+    block_type_isb, isb_len, 0,
+    static_cast<uint32_t>(end_time >> 32), static_cast<uint32_t>(end_time)
+  };
+  append(head, sizeof(head));
+
+  struct { uint16_t code; uint64_t value; } const options[] = {
+    { opt_isb_starttime, (m_start_time >> 32) | (m_start_time << 32) },
+    { opt_isb_endtime, (end_time >> 32) | (end_time << 32) },
+    { opt_isb_ifrecv, m_packets + m_dropped },
+    { opt_isb_ifdrop, m_dropped }
+  };
+  for(auto const& option : options)
+  {
+    uint16_t const opt_head[2] = { option.code, 8 };
+    append(opt_head, 4);
+    append(&option.value, 8);
+  }
+
+  uint16_t const endofopt[2] = { opt_endofopt, 0 };
+  append(endofopt, 4);
+  append(&isb_len, 4);
+}
+
+void
+USBPcapngWriter::writer_thread()
+{
+  while (true)
+  {
+    Buffer* buffer;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this]{ return !m_full.empty(); });
+      buffer = m_full.front();
+      m_full.pop_front();
+    }
+
+    write_buffer(buffer);
+
+    if (buffer->final)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(buffer);
+  }
+}
+
+void
+USBPcapngWriter::write_buffer(Buffer* buffer)
+{
+  if (m_error.load() != 0)
+  {
+    return;
+  }
+
+  if (m_direct && buffer->len % direct_alignment != 0)
+  {
+    // only the final buffer has an unaligned length
+    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+    m_direct = false;
+  }
+
+  size_t offset = 0;
+  while (offset < buffer->len)
+  {
+    ssize_t const len = write(m_fd, buffer->data + offset, buffer->len - offset);
+    if (len < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      else if (errno == EINVAL && m_direct)
+      {
+        // O_DIRECT got accepted on open, but not on write
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+        m_direct = false;
+        continue;
+      }
+
+      m_error = errno;
+      log_error("failed to write pcapng capture: {}", strerror(errno));
+      return;
+    }
+    offset += static_cast<size_t>(len);
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,228 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_reconnect_supervisor.hpp"
+
+#include <stdexcept>
+
+#include <logmich/log.hpp>
+
+#include "usb_device.hpp"
+#include "usb_helper.hpp"
+#include "usb_hotplug.hpp"
+#include "usb_interface.hpp"
+
+namespace unsebu {
+
+USBReconnectSupervisor::USBReconnectSupervisor(USBHotplug& hotplug, std::unique_ptr<USBDevice> device,
+                                               USBDescriptorCache* descriptor_cache) :
+  m_hotplug(hotplug),
+  m_descriptor_cache(descriptor_cache),
+  m_hotplug_id(),
+  m_device(std::move(device)),
+  m_interfaces(),
+  m_id_vendor(m_device->get_descriptor().idVendor),
+  m_id_product(m_device->get_descriptor().idProduct),
+  m_serial(m_device->get_serial()),
+  m_port_path(usb_get_port_path(m_device->get_device())),
+  m_connected(true),
+  m_connection_callback(),
+  m_candidates(),
+  m_idle_id()
+{
+  m_hotplug_id = m_hotplug.add_callback([this](libusb_device* dev, libusb_hotplug_event event) {
+    on_hotplug(dev, event);
+  });
+}
+
+USBReconnectSupervisor::~USBReconnectSupervisor()
+{
+  m_hotplug.remove_callback(m_hotplug_id);
+
+  if (m_idle_id)
+  {
+    g_source_remove(m_idle_id);
+  }
+
+  for(libusb_device* dev : m_candidates)
+  {
+    libusb_unref_device(dev);
+  }
+
+  m_interfaces.clear();
+  m_device.reset();
+}
+
+USBInterface&
+USBReconnectSupervisor::claim_interface(int interface, bool try_detach)
+{
+  if (!m_connected)
+  {
+    throw std::runtime_error("can't claim interface while the device is disconnected");
+  }
+
+  std::unique_ptr<USBInterface> iface = m_device->claim_interface(interface, try_detach);
+  iface->set_disconnect_callback([this]{ on_disconnect(); });
+  m_interfaces.push_back(std::move(iface));
+  return *m_interfaces.back();
+}
+
+void
+USBReconnectSupervisor::set_connection_callback(std::function<void (bool)> const& callback)
+{
+  m_connection_callback = callback;
+}
+
+void
+USBReconnectSupervisor::on_disconnect()
+{
+  if (m_connected)
+  {
+    log_info("{:04x}:{:04x} at {}: device disconnected, waiting for it to return",
+             m_id_vendor, m_id_product, m_port_path);
+
+    m_connected = false;
+    if (m_connection_callback)
+    {
+      m_connection_callback(false);
+    }
+  }
+}
+
+void
+USBReconnectSupervisor::on_hotplug(libusb_device* dev, libusb_hotplug_event event)
+{
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+  {
+    // the LEFT event might beat the failing transfers
+    if (m_connected && dev == m_device->get_device())
+    {
+      on_disconnect();
+    }
+  }
+  else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+  {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS ||
+        desc.idVendor != m_id_vendor ||
+        desc.idProduct != m_id_product)
+    {
+      return;
+    }
+
+    // without a serial number the port is the only identity we have,
+    // with one the serial is checked once the device is open
+    if (m_serial.empty() && usb_get_port_path(dev) != m_port_path)
+    {
+      return;
+    }
+
+    // opening the device from within the hotplug callback isn't
+    // allowed, so defer the work to the main loop
+    m_candidates.push_back(libusb_ref_device(dev));
+    if (!m_idle_id)
+    {
+      m_idle_id = g_idle_add([](gpointer userdata) -> gboolean {
+        return static_cast<USBReconnectSupervisor*>(userdata)->on_idle();
+      }, this);
+    }
+  }
+}
+
+bool
+USBReconnectSupervisor::on_idle()
+{
+  m_idle_id = 0;
+
+  std::vector<libusb_device*> candidates;
+  candidates.swap(m_candidates);
+
+  for(libusb_device* dev : candidates)
+  {
+    if (!m_connected)
+    {
+      reconnect(dev);
+    }
+    libusb_unref_device(dev);
+  }
+
+  return false;
+}
+
+void
+USBReconnectSupervisor::reconnect(libusb_device* dev)
+{
+  std::unique_ptr<USBDevice> device;
+  try
+  {
+    device = std::make_unique<USBDevice>(dev, m_descriptor_cache);
+  }
+  catch(std::exception const& err)
+  {
+    log_warn("{:04x}:{:04x}: failed to reopen device: {}", m_id_vendor, m_id_product, err.what());
+    return;
+  }
+
+  if (!m_serial.empty() && device->get_serial() != m_serial)
+  {
+    // same model, but a different unit
+    return;
+  }
+
+  // claim everything before moving anything over, so that a failure
+  // leaves all interfaces on the old handle instead of splitting them
+  // between the two
+  size_t claimed = 0;
+  try
+  {
+    for(; claimed < m_interfaces.size(); ++claimed)
+    {
+      m_interfaces[claimed]->claim_on(device->get_handle());
+    }
+  }
+  catch(std::exception const& err)
+  {
+    log_warn("{:04x}:{:04x}: failed to reclaim interfaces: {}", m_id_vendor, m_id_product, err.what());
+    for(size_t i = 0; i < claimed; ++i)
+    {
+      libusb_release_interface(device->get_handle(), m_interfaces[i]->get_interface());
+    }
+    return;
+  }
+
+  for(auto& iface : m_interfaces)
+  {
+    device->reattach_interface(*iface);
+  }
+
+  // the old handle gets closed here unless device memory of its arena
+  // is still in use, in which case the new arena lets go of it once the
+  // last of those buffers got migrated or freed
+  m_device = std::move(device);
+  m_port_path = usb_get_port_path(m_device->get_device());
+  m_connected = true;
+
+  log_info("{:04x}:{:04x} at {}: device reconnected", m_id_vendor, m_id_product, m_port_path);
+
+  if (m_connection_callback)
+  {
+    m_connection_callback(true);
+  }
+}
+
+} // namespace unsebu
+
+/* EOF */
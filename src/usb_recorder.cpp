@@ -0,0 +1,139 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_recorder.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_helper.hpp"
+
+namespace unsebu {
+
+namespace {
+
+// flush well before the buffer needs to grow
+size_t const buffer_capacity = 256 * 1024;
+size_t const flush_threshold = 192 * 1024;
+
+template<typename T>
+void put_le(std::vector<uint8_t>& buffer, T value)
+{
+  for(size_t i = 0; i < sizeof(T); ++i)
+  {
+    buffer.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+  }
+}
+
+} // namespace
+
+USBRecorder::USBRecorder(std::string const& filename, libusb_device_handle* handle, int interface) :
+  m_fd(-1),
+  m_buffer(),
+  m_last_time(std::chrono::steady_clock::now()),
+  m_count(0)
+{
+  m_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (m_fd < 0)
+  {
+    throw std::runtime_error(fmt::format("failed to open {}: {}", filename, strerror(errno)));
+  }
+
+  m_buffer.reserve(buffer_capacity);
+
+  std::string const label = usb_get_device_label(libusb_get_device(handle));
+  int64_t const start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  m_buffer.insert(m_buffer.end(), std::begin(usb_recording_magic), std::end(usb_recording_magic));
+  put_le<uint32_t>(m_buffer, usb_recording_version);
+  put_le<uint32_t>(m_buffer, static_cast<uint32_t>(interface));
+  put_le<int64_t>(m_buffer, start_time);
+  put_le<uint16_t>(m_buffer, static_cast<uint16_t>(label.size()));
+  m_buffer.insert(m_buffer.end(), label.begin(), label.end());
+}
+
+USBRecorder::~USBRecorder()
+{
+  flush();
+  close(m_fd);
+}
+
+void
+USBRecorder::record(libusb_transfer const* transfer)
+{
+  auto const now = std::chrono::steady_clock::now();
+  uint64_t const delta = static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last_time).count());
+  m_last_time = now;
+
+  int const len = transfer->status == LIBUSB_TRANSFER_COMPLETED ? transfer->actual_length : 0;
+
+  put_varint(delta);
+  m_buffer.push_back(transfer->endpoint);
+  m_buffer.push_back(static_cast<uint8_t>(transfer->status));
+  put_varint(static_cast<uint64_t>(len));
+  m_buffer.insert(m_buffer.end(), transfer->buffer, transfer->buffer + len);
+
+  m_count += 1;
+
+  if (m_buffer.size() >= flush_threshold)
+  {
+    flush();
+  }
+}
+
+void
+USBRecorder::flush()
+{
+  size_t offset = 0;
+  while (offset < m_buffer.size())
+  {
+    ssize_t const len = write(m_fd, m_buffer.data() + offset, m_buffer.size() - offset);
+    if (len < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      log_error("failed to write recording, {} bytes lost: {}", m_buffer.size() - offset, strerror(errno));
+      break;
+    }
+    offset += static_cast<size_t>(len);
+  }
+  m_buffer.clear();
+}
+
+void
+USBRecorder::put_varint(uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    m_buffer.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  m_buffer.push_back(static_cast<uint8_t>(value));
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,246 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_replayer.hpp"
+
+#include <string.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+#include <fmt/format.h>
+
+#include "usb_interface.hpp"
+#include "usb_recorder.hpp"
+#include "usb_report_filter.hpp"
+#include "usb_trace.hpp"
+
+namespace unsebu {
+
+namespace {
+
+/** sleep_until() overshoots by tens of microseconds, so sleep until
+    shortly before the deadline and spin for the rest */
+constexpr std::chrono::microseconds spin_time(200);
+
+class Reader
+{
+public:
+  Reader(std::vector<uint8_t> const& data) :
+    m_data(data),
+    m_pos(0)
+  {}
+
+  bool at_end() const { return m_pos == m_data.size(); }
+  size_t get_pos() const { return m_pos; }
+
+  uint8_t const* bytes(size_t len)
+  {
+    if (m_data.size() - m_pos < len)
+    {
+      throw std::runtime_error(fmt::format("recording truncated at offset {}", m_pos));
+    }
+    uint8_t const* result = m_data.data() + m_pos;
+    m_pos += len;
+    return result;
+  }
+
+  template<typename T>
+  T le()
+  {
+    uint8_t const* p = bytes(sizeof(T));
+    uint64_t value = 0;
+    for(size_t i = 0; i < sizeof(T); ++i)
+    {
+      value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return static_cast<T>(value);
+  }
+
+  uint64_t varint()
+  {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+      uint8_t const byte = *bytes(1);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+      {
+        return value;
+      }
+    }
+    throw std::runtime_error(fmt::format("bad varint in recording at offset {}", m_pos));
+  }
+
+private:
+  std::vector<uint8_t> const& m_data;
+  size_t m_pos;
+};
+
+} // namespace
+
+USBReplayer::USBReplayer(std::string const& filename) :
+  m_data(),
+  m_records(),
+  m_device_label(),
+  m_interface(0),
+  m_callbacks(),
+  m_read_filters(),
+  m_scratch()
+{
+  std::ifstream in(filename, std::ios::binary);
+  if (!in)
+  {
+    throw std::runtime_error(fmt::format("failed to open {}", filename));
+  }
+  m_data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+  parse();
+}
+
+USBReplayer::~USBReplayer()
+{
+}
+
+void
+USBReplayer::parse()
+{
+  Reader reader(m_data);
+
+  if (memcmp(reader.bytes(sizeof(usb_recording_magic)), usb_recording_magic, sizeof(usb_recording_magic)) != 0)
+  {
+    throw std::runtime_error("not an unsebu recording");
+  }
+
+  uint32_t const version = reader.le<uint32_t>();
+  if (version != usb_recording_version)
+  {
+    throw std::runtime_error(fmt::format("unsupported recording version {}", version));
+  }
+
+  m_interface = static_cast<int>(reader.le<uint32_t>());
+  reader.le<int64_t>(); // start time, only informational
+  uint16_t const label_len = reader.le<uint16_t>();
+  uint8_t const* label = reader.bytes(label_len);
+  m_device_label.assign(label, label + label_len);
+
+  std::chrono::nanoseconds time(0);
+  while (!reader.at_end())
+  {
+    time += std::chrono::nanoseconds(reader.varint());
+    uint8_t const endpoint = *reader.bytes(1);
+    uint8_t const status = *reader.bytes(1);
+    uint64_t const len = reader.varint();
+    if (len > static_cast<uint64_t>(INT32_MAX))
+    {
+      throw std::runtime_error(fmt::format("bad record length at offset {}", reader.get_pos()));
+    }
+    uint8_t const* data = reader.bytes(static_cast<size_t>(len));
+
+    m_records.push_back(USBRecord{time, endpoint, static_cast<libusb_transfer_status>(status),
+                                  data, static_cast<int>(len)});
+  }
+}
+
+void
+USBReplayer::submit_read(int endpoint, std::function<bool (uint8_t*, int)> const& callback)
+{
+  m_callbacks[endpoint | LIBUSB_ENDPOINT_IN] = [callback](USBReadRecord const& record) {
+    return callback(record.data, record.len);
+  };
+}
+
+void
+USBReplayer::submit_read_records(int endpoint, std::function<bool (USBReadRecord const&)> const& callback)
+{
+  m_callbacks[endpoint | LIBUSB_ENDPOINT_IN] = callback;
+}
+
+void
+USBReplayer::set_read_filter(int endpoint, std::unique_ptr<USBReportFilter> filter)
+{
+  if (filter)
+  {
+    m_read_filters[endpoint | LIBUSB_ENDPOINT_IN] = std::move(filter);
+  }
+  else
+  {
+    m_read_filters.erase(endpoint | LIBUSB_ENDPOINT_IN);
+  }
+}
+
+uint64_t
+USBReplayer::run(Timing timing)
+{
+  uint64_t count = 0;
+  auto const start = std::chrono::steady_clock::now();
+
+  for(auto const& record : m_records)
+  {
+    if (m_callbacks.empty())
+    {
+      break;
+    }
+
+    auto const callback = m_callbacks.find(record.endpoint);
+    if (callback == m_callbacks.end() ||
+        record.status == LIBUSB_TRANSFER_NO_DEVICE)
+    {
+      continue;
+    }
+
+    // same rules as USBInterface::pass_read_filter()
+    if (record.status == LIBUSB_TRANSFER_COMPLETED)
+    {
+      auto const filter = m_read_filters.find(record.endpoint);
+      if (filter != m_read_filters.end() && !filter->second->check(record.data, record.len))
+      {
+        continue;
+      }
+    }
+
+    if (timing == Timing::Original)
+    {
+      auto const deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(record.time);
+      if (deadline - std::chrono::steady_clock::now() > spin_time)
+      {
+        std::this_thread::sleep_until(deadline - spin_time);
+      }
+      while (std::chrono::steady_clock::now() < deadline) {}
+    }
+
+    m_scratch.assign(record.data, record.data + record.len);
+
+    bool keep_reading;
+    {
+      UNSEBU_TRACE_SCOPE(Callback, record.endpoint);
+      keep_reading = callback->second(USBReadRecord{m_scratch.data(), record.len, record.status});
+    }
+    count += 1;
+
+    if (!keep_reading)
+    {
+      m_callbacks.erase(callback);
+    }
+  }
+
+  return count;
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,137 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_report_filter.hpp"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+namespace unsebu {
+
+namespace {
+
+size_t padded_size(size_t len)
+{
+  return (len + 15) & ~static_cast<size_t>(15);
+}
+
+} // namespace
+
+USBReportFilter::USBReportFilter(std::vector<uint8_t> const& ignore_mask,
+                                 std::chrono::milliseconds heartbeat) :
+  m_ignore_mask(ignore_mask),
+  m_heartbeat(heartbeat),
+  m_last(),
+  m_compare_mask(),
+  m_last_len(0),
+  m_has_last(false),
+  m_last_passed(),
+  m_passed(0),
+  m_suppressed(0)
+{
+}
+
+bool
+USBReportFilter::check(uint8_t const* data, int len)
+{
+  size_t const ulen = static_cast<size_t>(len);
+  auto const now = std::chrono::steady_clock::now();
+
+  if (m_has_last && equals_last(data, ulen) &&
+      (m_heartbeat.count() == 0 || now - m_last_passed < m_heartbeat))
+  {
+    m_suppressed += 1;
+    return false;
+  }
+
+  store(data, ulen);
+  m_last_passed = now;
+  m_passed += 1;
+  return true;
+}
+
+bool
+USBReportFilter::equals_last(uint8_t const* data, size_t len) const
+{
+  if (len != m_last_len)
+  {
+    return false;
+  }
+
+  // compare in wide blocks straight from the transfer buffer and
+  // finish the tail byte by byte
+  size_t i = 0;
+#if defined(__SSE2__)
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i const a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+    __m128i const b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(m_last.data() + i));
+    __m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(m_compare_mask.data() + i));
+    __m128i const diff = _mm_and_si128(_mm_xor_si128(a, b), mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff)
+    {
+      return false;
+    }
+  }
+#else
+  for(; i + 8 <= len; i += 8)
+  {
+    uint64_t a, b, mask;
+    memcpy(&a, data + i, 8);
+    memcpy(&b, m_last.data() + i, 8);
+    memcpy(&mask, m_compare_mask.data() + i, 8);
+    if ((a ^ b) & mask)
+    {
+      return false;
+    }
+  }
+#endif
+
+  for(; i < len; ++i)
+  {
+    if ((data[i] ^ m_last[i]) & m_compare_mask[i])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+USBReportFilter::store(uint8_t const* data, size_t len)
+{
+  if (len != m_last_len || !m_has_last)
+  {
+    m_last.assign(padded_size(len), 0);
+    m_compare_mask.assign(padded_size(len), 0xff);
+    for(size_t i = 0; i < len && i < m_ignore_mask.size(); ++i)
+    {
+      m_compare_mask[i] = static_cast<uint8_t>(~m_ignore_mask[i]);
+    }
+    m_last_len = len;
+    m_has_last = true;
+  }
+
+  memcpy(m_last.data(), data, len);
+}
+
+} // namespace unsebu
+
+/* EOF */
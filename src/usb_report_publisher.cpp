@@ -0,0 +1,235 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_report_publisher.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#include <glib-unix.h>
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_interface.hpp"
+#include "usb_report_ring.hpp"
+
+namespace unsebu {
+
+USBReportPublisher::USBReportPublisher(uint32_t slot_count, uint32_t slot_size) :
+  m_memfd(-1),
+  m_size(usb_report_ring_size(slot_count, slot_size)),
+  m_header(nullptr),
+  m_seq(0),
+  m_listen_fd(-1),
+  m_source_id(0),
+  m_socket_path()
+{
+  if (slot_count == 0 || slot_size == 0 || slot_size > UINT16_MAX)
+  {
+    throw std::runtime_error(fmt::format("invalid report ring size: {} slots of {} bytes", slot_count, slot_size));
+  }
+
+  m_memfd = memfd_create("unsebu-report-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (m_memfd < 0)
+  {
+    throw std::runtime_error(fmt::format("memfd_create() failed: {}", strerror(errno)));
+  }
+
+  if (ftruncate(m_memfd, static_cast<off_t>(m_size)) < 0)
+  {
+    int const err = errno;
+    close(m_memfd);
+    throw std::runtime_error(fmt::format("ftruncate() failed: {}", strerror(err)));
+  }
+
+  void* mem = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+  if (mem == MAP_FAILED)
+  {
+    int const err = errno;
+    close(m_memfd);
+    throw std::runtime_error(fmt::format("mmap() failed: {}", strerror(err)));
+  }
+
+  // subscribers must not be able to resize the ring under our feet,
+  // and with a new enough kernel not to map it writable either
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+  seals |= F_SEAL_FUTURE_WRITE;
+#endif
+  if (fcntl(m_memfd, F_ADD_SEALS, seals) < 0)
+  {
+    log_warn("failed to seal report ring: {}", strerror(errno));
+  }
+
+  m_header = new (mem) USBReportRingHeader;
+  m_header->magic = USBReportRingHeader::magic_value;
+  m_header->version = USBReportRingHeader::version_value;
+  m_header->slot_count = slot_count;
+  m_header->slot_size = slot_size;
+  m_header->slot_stride = static_cast<uint32_t>(usb_report_ring_stride(slot_size));
+  m_header->reserved = 0;
+  m_header->write_seq.store(0, std::memory_order_relaxed);
+
+  for(uint32_t i = 0; i < slot_count; ++i)
+  {
+    new (usb_report_ring_slot(m_header, i)) USBReportRingSlot{{0}, 0, 0, 0, 0};
+  }
+}
+
+USBReportPublisher::~USBReportPublisher()
+{
+  if (m_source_id)
+  {
+    g_source_remove(m_source_id);
+  }
+
+  if (m_listen_fd >= 0)
+  {
+    close(m_listen_fd);
+    unlink(m_socket_path.c_str());
+  }
+
+  munmap(m_header, m_size);
+  close(m_memfd);
+}
+
+void
+USBReportPublisher::listen(std::string const& socket_path)
+{
+  assert(m_listen_fd < 0);
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+  {
+    throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+  }
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+  {
+    throw std::runtime_error(fmt::format("socket() failed: {}", strerror(errno)));
+  }
+
+  // a stale socket from a previous run would make bind() fail
+  unlink(socket_path.c_str());
+
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      ::listen(fd, 8) < 0)
+  {
+    int const err = errno;
+    close(fd);
+    throw std::runtime_error(fmt::format("failed to listen on {}: {}", socket_path, strerror(err)));
+  }
+
+  m_listen_fd = fd;
+  m_socket_path = socket_path;
+  m_source_id = g_unix_fd_add(m_listen_fd, G_IO_IN,
+                              [](gint /*fd*/, GIOCondition /*condition*/, gpointer userdata) -> gboolean {
+                                return static_cast<USBReportPublisher*>(userdata)->on_accept();
+                              },
+                              this);
+}
+
+bool
+USBReportPublisher::on_accept()
+{
+  int client = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (client < 0)
+  {
+    if (errno != EAGAIN && errno != EINTR)
+    {
+      log_error("accept() failed: {}", strerror(errno));
+    }
+    return TRUE;
+  }
+
+  // the memfd travels as SCM_RIGHTS ancillary data, the single byte
+  // payload is only there because a message can't be empty
+  char payload = 'R';
+  iovec iov = { &payload, 1 };
+
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &m_memfd, sizeof(int));
+
+  if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0)
+  {
+    log_error("failed to send report ring to subscriber: {}", strerror(errno));
+  }
+  close(client);
+
+  return TRUE;
+}
+
+void
+USBReportPublisher::attach(USBInterface& iface, int endpoint, int len)
+{
+  iface.submit_read(endpoint, len,
+                    [this, endpoint](uint8_t* data, int data_len) {
+                      publish(static_cast<uint8_t>(endpoint | LIBUSB_ENDPOINT_IN), data, data_len);
+                      return true;
+                    });
+}
+
+void
+USBReportPublisher::publish(uint8_t endpoint, uint8_t const* data, int len)
+{
+  uint64_t const seq = m_seq + 1;
+  USBReportRingSlot* slot = usb_report_ring_slot(m_header, seq);
+  uint16_t const slot_len = static_cast<uint16_t>(std::min<uint32_t>(static_cast<uint32_t>(len), m_header->slot_size));
+
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  // an odd seq marks the slot as being written, readers that copied
+  // it in the meantime see the change and drop their copy
+  slot->seq.store(2 * seq - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->timestamp = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+  slot->endpoint = endpoint;
+  slot->len = slot_len;
+  memcpy(usb_report_ring_payload(slot), data, slot_len);
+
+  slot->seq.store(2 * seq, std::memory_order_release);
+  m_header->write_seq.store(seq, std::memory_order_release);
+  m_seq = seq;
+}
+
+} // namespace unsebu
+
+/* EOF */
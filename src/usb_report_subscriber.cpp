@@ -0,0 +1,206 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_report_subscriber.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+#include "usb_report_ring.hpp"
+
+namespace unsebu {
+
+USBReportSubscriber
+USBReportSubscriber::connect(std::string const& socket_path)
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+  {
+    throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+  }
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    throw std::runtime_error(fmt::format("socket() failed: {}", strerror(errno)));
+  }
+
+  if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+  {
+    int const err = errno;
+    close(sock);
+    throw std::runtime_error(fmt::format("failed to connect to {}: {}", socket_path, strerror(err)));
+  }
+
+  char payload;
+  iovec iov = { &payload, 1 };
+
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t const ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  int const err = errno;
+  close(sock);
+
+  if (ret < 0)
+  {
+    throw std::runtime_error(fmt::format("failed to receive report ring from {}: {}", socket_path, strerror(err)));
+  }
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+  {
+    throw std::runtime_error(fmt::format("no report ring received from {}", socket_path));
+  }
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return USBReportSubscriber(fd);
+}
+
+USBReportSubscriber::USBReportSubscriber(int fd) :
+  m_fd(fd),
+  m_size(0),
+  m_header(nullptr),
+  m_next_seq(0),
+  m_lost(0)
+{
+  struct stat st;
+  if (fstat(m_fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(USBReportRingHeader))
+  {
+    close(m_fd);
+    throw std::runtime_error("report ring is too small");
+  }
+  m_size = static_cast<size_t>(st.st_size);
+
+  void* mem = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+  if (mem == MAP_FAILED)
+  {
+    int const err = errno;
+    close(m_fd);
+    throw std::runtime_error(fmt::format("mmap() failed: {}", strerror(err)));
+  }
+  m_header = static_cast<USBReportRingHeader*>(mem);
+
+  if (m_header->magic != USBReportRingHeader::magic_value ||
+      m_header->version != USBReportRingHeader::version_value ||
+      m_header->slot_count == 0 ||
+      m_header->slot_stride != usb_report_ring_stride(m_header->slot_size) ||
+      m_size < usb_report_ring_size(m_header->slot_count, m_header->slot_size))
+  {
+    munmap(mem, m_size);
+    close(m_fd);
+    throw std::runtime_error("not a report ring or unsupported version");
+  }
+
+  m_next_seq = m_header->write_seq.load(std::memory_order_acquire) + 1;
+}
+
+USBReportSubscriber::USBReportSubscriber(USBReportSubscriber&& other) :
+  m_fd(other.m_fd),
+  m_size(other.m_size),
+  m_header(other.m_header),
+  m_next_seq(other.m_next_seq),
+  m_lost(other.m_lost)
+{
+  other.m_fd = -1;
+  other.m_header = nullptr;
+}
+
+USBReportSubscriber::~USBReportSubscriber()
+{
+  if (m_header)
+  {
+    munmap(m_header, m_size);
+  }
+
+  if (m_fd >= 0)
+  {
+    close(m_fd);
+  }
+}
+
+uint32_t
+USBReportSubscriber::get_slot_size() const
+{
+  return m_header->slot_size;
+}
+
+USBReportSubscriber::Result
+USBReportSubscriber::read(USBReport& report, uint8_t* buffer)
+{
+  uint64_t const seq = m_next_seq;
+  USBReportRingSlot* slot = usb_report_ring_slot(m_header, seq);
+
+  uint64_t const before = slot->seq.load(std::memory_order_acquire);
+  if (before < 2 * seq)
+  {
+    // an older report or ours still being written
+    return Result::Empty;
+  }
+
+  if (before == 2 * seq)
+  {
+    uint64_t const timestamp = slot->timestamp;
+    uint8_t const endpoint = slot->endpoint;
+    uint16_t const len = std::min<uint16_t>(slot->len, static_cast<uint16_t>(m_header->slot_size));
+    memcpy(buffer, usb_report_ring_payload(slot), len);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) == before)
+    {
+      report.seq = seq;
+      report.timestamp = timestamp;
+      report.endpoint = endpoint;
+      report.data = buffer;
+      report.len = len;
+
+      m_next_seq += 1;
+      return Result::Report;
+    }
+  }
+
+  // the publisher lapped us, continue with the oldest report that
+  // won't be overwritten by the one currently in progress
+  uint64_t const write_seq = m_header->write_seq.load(std::memory_order_acquire);
+  uint64_t const slot_count = m_header->slot_count;
+  uint64_t const oldest = (write_seq + 2 > slot_count) ? write_seq + 2 - slot_count : 1;
+  uint64_t const next_seq = std::max(oldest, m_next_seq + 1);
+
+  m_lost += next_seq - m_next_seq;
+  m_next_seq = next_seq;
+
+  return Result::Overrun;
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,178 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_submit_queue.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include <glib-unix.h>
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+namespace unsebu {
+
+USBSubmitQueue::USBSubmitQueue(SubmitFunc const& submit) :
+  m_submit(submit),
+  m_head(&m_stub),
+  m_tail(&m_stub),
+  m_stub(),
+  m_eventfd(-1),
+  m_source_id(),
+  m_wakeup_pending(false)
+{
+  m_stub.next.store(nullptr, std::memory_order_relaxed);
+
+  m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_eventfd < 0)
+  {
+    throw std::runtime_error(fmt::format("eventfd() failed: {}", strerror(errno)));
+  }
+
+  m_source_id = g_unix_fd_add(m_eventfd, G_IO_IN,
+                              [](gint /*fd*/, GIOCondition /*condition*/, gpointer userdata) -> gboolean {
+                                return static_cast<USBSubmitQueue*>(userdata)->on_wakeup();
+                              },
+                              this);
+}
+
+USBSubmitQueue::~USBSubmitQueue()
+{
+  g_source_remove(m_source_id);
+  close(m_eventfd);
+
+  Node* node;
+  while (pop(node) == PopResult::Item)
+  {
+    delete node;
+  }
+}
+
+void
+USBSubmitQueue::push(int endpoint, uint8_t const* data, int len)
+{
+  Node* node = new Node{{nullptr}, endpoint, std::vector<uint8_t>(data, data + len)};
+
+  Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+
+  if (!m_wakeup_pending.exchange(true, std::memory_order_acq_rel))
+  {
+    wakeup();
+  }
+}
+
+USBSubmitQueue::PopResult
+USBSubmitQueue::pop(Node*& node)
+{
+  Node* tail = m_tail;
+  Node* next = tail->next.load(std::memory_order_acquire);
+
+  if (tail == &m_stub)
+  {
+    if (next == nullptr)
+    {
+      return (m_head.load(std::memory_order_acquire) == &m_stub) ? PopResult::Empty : PopResult::Retry;
+    }
+
+    // skip over the stub
+    m_tail = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+
+  if (next)
+  {
+    m_tail = next;
+    node = tail;
+    return PopResult::Item;
+  }
+
+  if (tail != m_head.load(std::memory_order_acquire))
+  {
+    // a producer is between its exchange and linking the node
+    return PopResult::Retry;
+  }
+
+  // tail is the last node, put the stub behind it so it can be popped
+  m_stub.next.store(nullptr, std::memory_order_relaxed);
+  Node* prev = m_head.exchange(&m_stub, std::memory_order_acq_rel);
+  prev->next.store(&m_stub, std::memory_order_release);
+
+  next = tail->next.load(std::memory_order_acquire);
+  if (next)
+  {
+    m_tail = next;
+    node = tail;
+    return PopResult::Item;
+  }
+
+  return PopResult::Retry;
+}
+
+void
+USBSubmitQueue::wakeup()
+{
+  uint64_t const value = 1;
+  if (write(m_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+  {
+    log_error("failed to write to eventfd: {}", strerror(errno));
+  }
+}
+
+bool
+USBSubmitQueue::on_wakeup()
+{
+  uint64_t value;
+  if (read(m_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+  {
+    log_error("failed to read from eventfd: {}", strerror(errno));
+  }
+
+  // clear the flag before draining, so a push racing with the drain
+  // either gets drained now or triggers another wakeup
+  m_wakeup_pending.store(false, std::memory_order_release);
+
+  Node* node;
+  PopResult result;
+  while ((result = pop(node)) == PopResult::Item)
+  {
+    try
+    {
+      m_submit(node->endpoint, node->data.data(), static_cast<int>(node->data.size()));
+    }
+    catch(std::exception const& err)
+    {
+      log_error("failed to submit queued write to endpoint {}: {}", node->endpoint, err.what());
+    }
+    delete node;
+  }
+
+  if (result == PopResult::Retry)
+  {
+    // the producer will finish linking the node shortly, come back for it
+    wakeup();
+  }
+
+  return TRUE;
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -18,17 +18,22 @@
 
 #include "usb_subsystem.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
+#include <thread>
 
 #include <fmt/format.h>
 
 #include "usb_gsource.hpp"
 #include "usb_helper.hpp"
+#include "usb_hotplug.hpp"
 
 namespace unsebu {
 
 USBSubsystem::USBSubsystem() :
-  m_usb_gsource()
+  m_usb_gsource(),
+  m_usb_hotplug()
 {
   int ret = libusb_init(NULL);
   if (ret != LIBUSB_SUCCESS) {
@@ -37,14 +42,113 @@ USBSubsystem::USBSubsystem() :
 
   m_usb_gsource = std::make_unique<USBGSource>();
   m_usb_gsource->attach(NULL);
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  {
+    m_usb_hotplug = std::make_unique<USBHotplug>();
+  }
 }
 
 USBSubsystem::~USBSubsystem()
 {
+  m_usb_hotplug.reset();
   m_usb_gsource.reset();
   libusb_exit(NULL);
 }
 
+namespace {
+
+USBOpenResult open_device(USBOpenRequest const& request)
+{
+  libusb_device_handle* handle = nullptr;
+  int err = libusb_open(request.device, &handle);
+  if (err != LIBUSB_SUCCESS)
+  {
+    return USBOpenResult{nullptr, err, -1};
+  }
+
+  for(auto it = request.interfaces.begin(); it != request.interfaces.end(); ++it)
+  {
+    err = usb_claim_n_detach_interface(handle, *it, request.try_detach);
+    if (err != LIBUSB_SUCCESS)
+    {
+      // undo the interfaces claimed so far
+      for(auto claimed = request.interfaces.begin(); claimed != it; ++claimed)
+      {
+        libusb_release_interface(handle, *claimed);
+      }
+      libusb_close(handle);
+
+      return USBOpenResult{nullptr, err, *it};
+    }
+  }
+
+  return USBOpenResult{handle, LIBUSB_SUCCESS, -1};
+}
+
+} // namespace
+
+std::vector<USBOpenResult>
+USBSubsystem::open_devices(std::vector<USBOpenRequest> const& requests, int max_workers)
+{
+  std::vector<USBOpenResult> results(requests.size());
+  std::atomic<size_t> next_request(0);
+
+  auto worker = [&requests, &results, &next_request]{
+    for(size_t idx = next_request++; idx < requests.size(); idx = next_request++)
+    {
+      results[idx] = open_device(requests[idx]);
+    }
+  };
+
+  size_t const num_workers = std::min(requests.size(), static_cast<size_t>(std::max(max_workers, 1)));
+  if (num_workers <= 1)
+  {
+    worker();
+  }
+  else
+  {
+    std::vector<std::thread> threads;
+    try
+    {
+      for(size_t i = 0; i < num_workers; ++i)
+      {
+        threads.emplace_back(worker);
+      }
+    }
+    catch(...)
+    {
+      // let the running workers finish the request they are on, the
+      // caller never sees the handles they opened
+      next_request = requests.size();
+      for(auto& thread : threads)
+      {
+        thread.join();
+      }
+
+      for(size_t idx = 0; idx < results.size(); ++idx)
+      {
+        if (results[idx].handle)
+        {
+          for(int interface : requests[idx].interfaces)
+          {
+            libusb_release_interface(results[idx].handle, interface);
+          }
+          libusb_close(results[idx].handle);
+        }
+      }
+      throw;
+    }
+
+    for(auto& thread : threads)
+    {
+      thread.join();
+    }
+  }
+
+  return results;
+}
+
 } // namespace unsebu
 
 /* EOF */
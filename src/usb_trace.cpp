@@ -0,0 +1,198 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_trace.hpp"
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+namespace unsebu {
+
+namespace {
+
+struct TraceRing
+{
+  TraceRing(size_t size, long tid_) :
+    records(size),
+    mask(size - 1),
+    head(0),
+    tid(tid_)
+  {}
+
+  std::vector<USBTraceRecord> records;
+  size_t mask;
+
+  // only written by the owning thread, read by dump_chrome_json()
+  std::atomic<uint64_t> head;
+  long tid;
+};
+
+std::mutex g_rings_mutex;
+std::vector<std::unique_ptr<TraceRing>> g_rings;
+size_t g_ring_size = 1 << 16;
+
+thread_local TraceRing* t_ring = nullptr;
+
+TraceRing* register_ring()
+{
+  std::lock_guard<std::mutex> lock(g_rings_mutex);
+  // rings outlive their thread, so records of threads that are gone
+  // still show up in the dump
+  g_rings.push_back(std::make_unique<TraceRing>(g_ring_size, syscall(SYS_gettid)));
+  return g_rings.back().get();
+}
+
+char const* trace_point_name(USBTracePoint point)
+{
+  switch (point)
+  {
+    case USBTracePoint::SourcePrepare: return "source_prepare";
+    case USBTracePoint::SourceCheck: return "source_check";
+    case USBTracePoint::SourceDispatch: return "source_dispatch";
+    case USBTracePoint::Submit: return "submit";
+    case USBTracePoint::Complete: return "complete";
+    case USBTracePoint::Callback: return "callback";
+    case USBTracePoint::Resubmit: return "resubmit";
+  }
+  return "unknown";
+}
+
+char const* trace_phase_name(USBTracePhase phase)
+{
+  switch (phase)
+  {
+    case USBTracePhase::Begin: return "B";
+    case USBTracePhase::End: return "E";
+    case USBTracePhase::Instant: return "i";
+  }
+  return "i";
+}
+
+} // namespace
+
+std::atomic<bool> USBTrace::s_enabled(false);
+
+void
+USBTrace::enable(size_t ring_size)
+{
+  size_t size = 1;
+  while (size < ring_size)
+  {
+    size <<= 1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    // only applies to threads that haven't recorded anything yet
+    g_ring_size = size;
+  }
+
+  s_enabled.store(true, std::memory_order_relaxed);
+}
+
+void
+USBTrace::disable()
+{
+  s_enabled.store(false, std::memory_order_relaxed);
+}
+
+void
+USBTrace::record(USBTracePoint point, USBTracePhase phase, uint8_t endpoint, int32_t value)
+{
+  TraceRing* ring = t_ring;
+  if (!ring)
+  {
+    ring = t_ring = register_ring();
+  }
+
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  uint64_t const pos = ring->head.load(std::memory_order_relaxed);
+  ring->records[pos & ring->mask] = USBTraceRecord{
+    static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec),
+    point, phase, endpoint, 0, value
+  };
+  ring->head.store(pos + 1, std::memory_order_release);
+}
+
+bool
+USBTrace::dump_chrome_json(std::string const& filename)
+{
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (!fp)
+  {
+    log_error("failed to open {}", filename);
+    return false;
+  }
+
+  long const pid = static_cast<long>(getpid());
+  bool first = true;
+
+  fmt::print(fp, "{{\"traceEvents\":[\n");
+
+  std::lock_guard<std::mutex> lock(g_rings_mutex);
+  for(auto const& ring : g_rings)
+  {
+    uint64_t const size = ring->records.size();
+
+    // the owning thread keeps writing while we copy, records that
+    // might have been overwritten in the meantime get dropped
+    uint64_t const head_before = ring->head.load(std::memory_order_acquire);
+    std::vector<USBTraceRecord> records = ring->records;
+    uint64_t const head_after = ring->head.load(std::memory_order_acquire);
+
+    uint64_t const begin = std::max(head_before > size ? head_before - size : 0,
+                                    head_after + 1 > size ? head_after + 1 - size : 0);
+
+    for(uint64_t i = begin; i < head_before; ++i)
+    {
+      USBTraceRecord const& rec = records[i & ring->mask];
+      fmt::print(fp, "{}{{\"name\":\"{}\",\"cat\":\"usb\",\"ph\":\"{}\",\"ts\":{}.{:03},"
+                 "\"pid\":{},\"tid\":{},{}\"args\":{{\"endpoint\":{},\"value\":{}}}}}",
+                 first ? "" : ",\n",
+                 trace_point_name(rec.point), trace_phase_name(rec.phase),
+                 rec.timestamp / 1000, rec.timestamp % 1000,
+                 pid, ring->tid,
+                 rec.phase == USBTracePhase::Instant ? "\"s\":\"t\"," : "",
+                 rec.endpoint, rec.value);
+      first = false;
+    }
+  }
+
+  fmt::print(fp, "\n]}}\n");
+
+  bool const ok = !ferror(fp);
+  if (fclose(fp) != 0 || !ok)
+  {
+    log_error("failed to write {}", filename);
+    return false;
+  }
+  return true;
+}
+
+} // namespace unsebu
+
+/* EOF */
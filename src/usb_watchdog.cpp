@@ -0,0 +1,118 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "usb_watchdog.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <logmich/log.hpp>
+
+#include "usb_helper.hpp"
+
+namespace unsebu {
+
+std::atomic<USBWatchdog*> USBWatchdog::s_current(nullptr);
+
+USBWatchdog::USBWatchdog(std::chrono::microseconds threshold, size_t top_n) :
+  m_threshold(threshold),
+  m_top_n(top_n),
+  m_callbacks(0),
+  m_slow_callbacks(0),
+  m_event_passes(0),
+  m_slow_event_passes(0),
+  m_mutex(),
+  m_slowest()
+{
+  USBWatchdog* expected = nullptr;
+  if (!s_current.compare_exchange_strong(expected, this, std::memory_order_acq_rel))
+  {
+    throw std::runtime_error("USBWatchdog: a watchdog is already installed");
+  }
+}
+
+USBWatchdog::~USBWatchdog()
+{
+  s_current.store(nullptr, std::memory_order_release);
+}
+
+void
+USBWatchdog::report_callback(libusb_device_handle* handle, uint8_t endpoint, std::chrono::microseconds duration)
+{
+  m_callbacks.fetch_add(1, std::memory_order_relaxed);
+
+  if (duration >= m_threshold)
+  {
+    m_slow_callbacks.fetch_add(1, std::memory_order_relaxed);
+
+    std::string device = usb_get_device_label(libusb_get_device(handle));
+    log_warn("slow callback on endpoint {:#04x} of {}: {} us, threshold {} us",
+             endpoint, device, duration.count(), m_threshold.count());
+
+    add_offender(USBWatchdogEntry{USBWatchdogEntry::Kind::Callback, duration, endpoint,
+                                  std::move(device), std::chrono::system_clock::now()});
+  }
+}
+
+void
+USBWatchdog::report_event_pass(std::chrono::microseconds duration)
+{
+  m_event_passes.fetch_add(1, std::memory_order_relaxed);
+
+  if (duration >= m_threshold)
+  {
+    m_slow_event_passes.fetch_add(1, std::memory_order_relaxed);
+
+    log_warn("slow libusb event handling pass: {} us, threshold {} us",
+             duration.count(), m_threshold.count());
+
+    add_offender(USBWatchdogEntry{USBWatchdogEntry::Kind::EventPass, duration, 0,
+                                  {}, std::chrono::system_clock::now()});
+  }
+}
+
+void
+USBWatchdog::add_offender(USBWatchdogEntry entry)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (m_slowest.size() >= m_top_n)
+  {
+    if (m_slowest.empty() || entry.duration <= m_slowest.back().duration)
+    {
+      return;
+    }
+    m_slowest.pop_back();
+  }
+
+  auto it = std::upper_bound(m_slowest.begin(), m_slowest.end(), entry,
+                             [](USBWatchdogEntry const& lhs, USBWatchdogEntry const& rhs) {
+                               return lhs.duration > rhs.duration;
+                             });
+  m_slowest.insert(it, std::move(entry));
+}
+
+std::vector<USBWatchdogEntry>
+USBWatchdog::get_slowest() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_slowest;
+}
+
+} // namespace unsebu
+
+/* EOF */
@@ -0,0 +1,59 @@
+# unsebu - libusb helper for C++
+# Copyright (C) 2020-2022 Ingo Ruhnke <grumbel@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Replays FIXTURE with 'USBMON --fixture' and compares the capture
+# against GOLDEN:
+#
+#   cmake -DUSBMON=... -DFIXTURE=... -DGOLDEN=... -DOUTPUT=... -P usbmon-replay.cmake
+#
+# The capture ends with an interface statistics block holding the wall
+# clock start and end time, GOLDEN is the capture without it.
+
+set(ISB_LENGTH 76)
+
+foreach(VAR USBMON FIXTURE GOLDEN OUTPUT)
+  if(NOT DEFINED ${VAR})
+    message(FATAL_ERROR "${VAR} not set")
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND ${USBMON} --fixture ${FIXTURE} ${OUTPUT}
+  RESULT_VARIABLE RESULT)
+if(NOT RESULT EQUAL 0)
+  message(FATAL_ERROR "${USBMON} --fixture ${FIXTURE} failed: ${RESULT}")
+endif()
+
+file(READ ${OUTPUT} OUTPUT_HEX HEX)
+file(READ ${GOLDEN} GOLDEN_HEX HEX)
+
+string(LENGTH "${OUTPUT_HEX}" OUTPUT_HEX_LENGTH)
+math(EXPR CAPTURE_HEX_LENGTH "${OUTPUT_HEX_LENGTH} - 2 * ${ISB_LENGTH}")
+if(CAPTURE_HEX_LENGTH LESS 0)
+  message(FATAL_ERROR "${OUTPUT} is truncated")
+endif()
+
+string(SUBSTRING "${OUTPUT_HEX}" 0 ${CAPTURE_HEX_LENGTH} CAPTURE_HEX)
+string(SUBSTRING "${OUTPUT_HEX}" ${CAPTURE_HEX_LENGTH} 8 ISB_TYPE_HEX)
+if(NOT ISB_TYPE_HEX STREQUAL "05000000")
+  message(FATAL_ERROR "${OUTPUT} doesn't end with an interface statistics block")
+endif()
+
+if(NOT CAPTURE_HEX STREQUAL GOLDEN_HEX)
+  message(FATAL_ERROR "${OUTPUT} differs from ${GOLDEN}")
+endif()
+
+# EOF #
@@ -16,370 +16,897 @@
 **  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <usb.h>
-#include <fmt/format.h>
-#include <iostream>
-#include <math.h>
-#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <libusb.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
 
-std::ostream& operator<<(std::ostream& out, struct usb_device* dev)
+#include "usb_device.hpp"
+#include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_subsystem.hpp"
+
+using namespace unsebu;
+
+namespace {
+
+/** Bulk endpoints get larger transfers by default, a single packet
+    per transfer would leave most of the bandwidth unused */
+int const default_bulk_size = 16 * 1024;
+
+/** Size of each of the two blocks piped input is read into */
+size_t const stream_block_size = 1024 * 1024;
+
+struct Options
 {
-  if (dev)
-    {
-      char iProduct_buf[1024] = "(null)";
+  uint16_t idVendor = 0;
+  uint16_t idProduct = 0;
+  int interface = 0;
+  int endpoint = 1;
 
-      // Little dirty to open usb device here
-      struct usb_dev_handle* handle = usb_open(dev);
-      if (handle)
+  /** Transfers kept in flight */
+  int depth = 8;
+
+  /** Bytes per transfer, 0 picks a default for the endpoint type */
+  int size = 0;
+
+  /** Seconds between statistics lines, 0 disables them */
+  int stats_interval = 1;
+
+  /** Input for write, stdin when empty */
+  std::string filename;
+};
+
+/** Transfer counters, printed to stderr while running and once more
+    at the end */
+class Statistics
+{
+public:
+  Statistics() :
+    m_start(std::chrono::steady_clock::now()),
+    m_last(m_start),
+    m_transfers(0),
+    m_bytes(0),
+    m_errors(0),
+    m_last_transfers(0),
+    m_last_bytes(0)
+  {}
+
+  void add(int len)
+  {
+    m_transfers += 1;
+    m_bytes += static_cast<uint64_t>(len);
+  }
+
+  void add_error() { m_errors += 1; }
+
+  uint64_t get_bytes() const { return m_bytes; }
+
+  /** Rates since the previous call */
+  void print_interval()
+  {
+    auto const now = std::chrono::steady_clock::now();
+    double const seconds = std::chrono::duration<double>(now - m_last).count();
+    if (seconds > 0.0)
+      {
+        std::cerr << fmt::format("{:10.0f} transfers/s  {:8.3f} MB/s  {} errors",
+                                 static_cast<double>(m_transfers - m_last_transfers) / seconds,
+                                 static_cast<double>(m_bytes - m_last_bytes) / seconds / 1e6,
+                                 m_errors)
+                  << std::endl;
+      }
+
+    m_last = now;
+    m_last_transfers = m_transfers;
+    m_last_bytes = m_bytes;
+  }
+
+  /** Totals and average rates since the start */
+  void print_total() const
+  {
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    std::cerr << fmt::format("{} transfers, {} bytes in {:.3f}s, {:.0f} transfers/s, {:.3f} MB/s, {} errors",
+                             m_transfers, m_bytes, seconds,
+                             seconds > 0.0 ? static_cast<double>(m_transfers) / seconds : 0.0,
+                             seconds > 0.0 ? static_cast<double>(m_bytes) / seconds / 1e6 : 0.0,
+                             m_errors)
+              << std::endl;
+  }
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+  std::chrono::steady_clock::time_point m_last;
+  uint64_t m_transfers;
+  uint64_t m_bytes;
+  uint64_t m_errors;
+  uint64_t m_last_transfers;
+  uint64_t m_last_bytes;
+};
+
+/** Input of a streaming write. Regular files are mapped and handed
+    out straight from the mapping, anything else is read by a thread
+    into two alternating blocks, so the next block is being filled
+    while the transfers drain the current one. */
+class StreamSource
+{
+public:
+  /** on_data is called from the reader thread when a block becomes
+      available or the input ends */
+  StreamSource(int fd, std::function<void ()> const& on_data) :
+    m_fd(fd),
+    m_on_data(on_data),
+    m_map(nullptr),
+    m_map_size(0),
+    m_map_pos(0),
+    m_mutex(),
+    m_cond(),
+    m_blocks(),
+    m_current(0),
+    m_eof(false),
+    m_error(0),
+    m_quit(false),
+    m_stop_fd(-1),
+    m_thread(),
+    m_total(0)
+  {
+    struct stat st;
+    if (fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode))
+      {
+        m_map_size = static_cast<size_t>(st.st_size);
+        if (m_map_size == 0)
+          {
+            m_eof = true;
+            return;
+          }
+
+        void* map = mmap(nullptr, m_map_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (map != MAP_FAILED)
+          {
+            madvise(map, m_map_size, MADV_SEQUENTIAL);
+            m_map = static_cast<uint8_t const*>(map);
+            m_eof = true;
+            return;
+          }
+        // fall back to reading
+      }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0)
+      {
+        throw std::runtime_error(fmt::format("eventfd() failed: {}", strerror(errno)));
+      }
+
+    for(Block& block : m_blocks)
+      {
+        block.data.resize(stream_block_size);
+      }
+    m_thread = std::thread([this]{ reader_thread(); });
+  }
+
+  ~StreamSource()
+  {
+    if (m_thread.joinable())
+      {
         {
-          if (dev->descriptor.iProduct)
-            usb_get_string_simple(handle, dev->descriptor.iProduct, iProduct_buf, sizeof(iProduct_buf));
-          usb_close(handle);
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_quit = true;
+        }
+        m_cond.notify_one();
+        uint64_t const one = 1;
+        if (write(m_stop_fd, &one, sizeof(one)) < 0)
+          {
+            // nothing left to do, the thread also checks m_quit
+          }
+        m_thread.join();
+      }
+
+    if (m_stop_fd >= 0)
+      {
+        close(m_stop_fd);
+      }
+
+    if (m_map)
+      {
+        munmap(const_cast<uint8_t*>(m_map), m_map_size);
+      }
+  }
+
+  /** Copy the next len bytes into data. Returns len, less only at the
+      end of the input, or 0 when not enough data is buffered yet. */
+  size_t read(uint8_t* data, size_t len)
+  {
+    if (m_map)
+      {
+        size_t const count = std::min(len, m_map_size - m_map_pos);
+        memcpy(data, m_map + m_map_pos, count);
+        m_map_pos += count;
+        m_total += count;
+        return count;
+      }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    size_t available = 0;
+    for(int i = 0; i < 2; ++i)
+      {
+        Block const& block = m_blocks[(m_current + i) % 2];
+        if (!block.full)
+          {
+            break;
+          }
+        available += block.len - block.pos;
+      }
+
+    if (available < len && !m_eof)
+      {
+        return 0;
+      }
+
+    size_t count = 0;
+    bool freed = false;
+    while (count < len && m_blocks[m_current].full)
+      {
+        Block& block = m_blocks[m_current];
+        size_t const n = std::min(len - count, block.len - block.pos);
+        memcpy(data + count, block.data.data() + block.pos, n);
+        block.pos += n;
+        count += n;
+
+        if (block.pos == block.len)
+          {
+            block.full = false;
+            block.pos = 0;
+            block.len = 0;
+            m_current ^= 1;
+            freed = true;
+          }
+      }
+    m_total += count;
+
+    lock.unlock();
+    if (freed)
+      {
+        m_cond.notify_one();
+      }
+    return count;
+  }
+
+  /** True once all of the input has been handed out */
+  bool at_end() const
+  {
+    if (m_map)
+      {
+        return m_map_pos == m_map_size;
+      }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_eof && !m_blocks[m_current].full;
+  }
+
+  /** errno of a failed read(), 0 if there was none */
+  int get_error() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+  }
+
+  /** Bytes handed out by read() */
+  uint64_t get_total() const { return m_total; }
+
+private:
+  struct Block
+  {
+    std::vector<uint8_t> data;
+    size_t len = 0;
+    size_t pos = 0;
+    bool full = false;
+  };
+
+  void reader_thread()
+  {
+    int next = 0;
+    while (true)
+      {
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_cond.wait(lock, [this, next]{ return m_quit || !m_blocks[next].full; });
+          if (m_quit)
+            {
+              return;
+            }
         }
 
-      return out << fmt::format("idVendor: 0x{:04hx}  idProduct: 0x{:04hx}  iProduct: {}")
-        % uint16_t(dev->descriptor.idVendor) % uint16_t(dev->descriptor.idProduct)
-        % iProduct_buf;
-    }
-  else
-    {
-      return out << "(usb_device: null)";
-    }
-}
+        // the consumer doesn't touch a block that isn't full, so it
+        // can be filled without holding the lock
+        Block& block = m_blocks[next];
+        size_t len = 0;
+        int error = 0;
+        bool eof = false;
+        while (len < block.data.size())
+          {
+            struct pollfd fds[2] = { { m_fd, POLLIN, 0 }, { m_stop_fd, POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0)
+              {
+                if (errno == EINTR)
+                  {
+                    continue;
+                  }
+                error = errno;
+                break;
+              }
+
+            if (fds[1].revents)
+              {
+                return;
+              }
+
+            ssize_t const ret = ::read(m_fd, block.data.data() + len, block.data.size() - len);
+            if (ret < 0)
+              {
+                if (errno == EINTR || errno == EAGAIN)
+                  {
+                    continue;
+                  }
+                error = errno;
+                break;
+              }
+            else if (ret == 0)
+              {
+                eof = true;
+                break;
+              }
+            len += static_cast<size_t>(ret);
+          }
 
-struct usb_device*
-find_usb_device(uint16_t idVendor, uint16_t idProduct)
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          block.len = len;
+          block.pos = 0;
+          block.full = (len > 0);
+          m_eof = eof || error != 0;
+          m_error = error;
+        }
+        m_on_data();
+
+        if (eof || error != 0)
+          {
+            return;
+          }
+        next ^= 1;
+      }
+  }
+
+private:
+  int m_fd;
+  std::function<void ()> m_on_data;
+
+  uint8_t const* m_map;
+  size_t m_map_size;
+  size_t m_map_pos;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cond;
+  Block m_blocks[2];
+  int m_current;
+  bool m_eof;
+  int m_error;
+  bool m_quit;
+  int m_stop_fd;
+  std::thread m_thread;
+
+  uint64_t m_total;
+
+private:
+  StreamSource(const StreamSource&);
+  StreamSource& operator=(const StreamSource&);
+};
+
+/** State shared between the main loop callbacks */
+struct Session
+{
+  GMainLoop* loop;
+  USBInterface* iface;
+  int endpoint;
+  Statistics stats;
+  bool write_mode;
+  bool stopping;
+
+  // streaming write
+  StreamSource* source;
+  int size;
+  int in_flight;
+  /** Transfers waiting for the source to catch up */
+  int parked;
+  /** Bytes of OUT transfers that completed short */
+  uint64_t short_bytes;
+  std::atomic<bool> resume_pending;
+};
+
+/** Look up the descriptor of endpoint address on the interface,
+    returns nullptr if the interface doesn't have it */
+libusb_endpoint_descriptor const*
+find_endpoint(libusb_config_descriptor const* config, int interface, int address)
 {
-  struct usb_bus* busses = usb_get_busses();
+  if (!config)
+    {
+      return nullptr;
+    }
 
-  for (struct usb_bus* bus = busses; bus; bus = bus->next)
+  for(int i = 0; i < config->bNumInterfaces; ++i)
     {
-      for (struct usb_device* dev = bus->devices; dev; dev = dev->next)
+      libusb_interface_descriptor const& altsetting = config->interface[i].altsetting[0];
+      if (altsetting.bInterfaceNumber == interface)
         {
-          if (dev->descriptor.idVendor  == idVendor &&
-              dev->descriptor.idProduct == idProduct)
+          for(int j = 0; j < altsetting.bNumEndpoints; ++j)
             {
-              return dev;
+              if (altsetting.endpoint[j].bEndpointAddress == address)
+                {
+                  return &altsetting.endpoint[j];
+                }
             }
         }
     }
-  return 0;
+  return nullptr;
 }
 
 void
-write_usb_device(struct usb_device* dev, int interface, int endpoint)
+stop_session(Session& session)
 {
-  struct usb_dev_handle* handle = usb_open(dev);
-  if (!handle)
+  if (session.stopping)
     {
-      std::cout << "Error opening usb device" << std::endl;
+      return;
     }
-  else
+  session.stopping = true;
+
+  if (session.write_mode)
     {
-      if (usb_claim_interface(handle, interface) != 0)
+      // writes in flight finish, their callbacks don't refill them
+      if (session.in_flight == 0)
         {
-          std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-          if (usb_detach_kernel_driver_np(handle, interface) < 0)
-            {
-              std::cout << "Failure to kick kernel driver: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
-            }
-
-          if (usb_claim_interface(handle, interface) != 0)
-            {
-              std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
-            }
+          g_main_loop_quit(session.loop);
         }
+    }
+  else
+    {
+      // the cancelled transfers have to come back before the
+      // interface and the handle go away
+      session.iface->cancel_read(session.endpoint, [&session]{
+          g_main_loop_quit(session.loop);
+        });
+    }
+}
 
-      bool quit = false;
+bool on_written(Session& session, libusb_transfer* transfer);
 
-      while(!quit)
+/** Submit parked transfers for as long as the source has data */
+void
+resume_writes(Session& session)
+{
+  std::vector<uint8_t> chunk(static_cast<size_t>(session.size));
+  while (session.parked > 0 && !session.stopping)
+    {
+      size_t const len = session.source->read(chunk.data(), chunk.size());
+      if (len == 0)
         {
-          uint8_t data[32];
+          break;
+        }
 
-          if (1)
-            {
-              int ret = fread(data, sizeof(char), sizeof(data), stdin);
+      // only the last chunk of the input is short, so the transfer
+      // buffer always has room for the refills in on_written()
+      session.iface->submit_write(session.endpoint, chunk.data(), static_cast<int>(len),
+                                  [&session](libusb_transfer* transfer) {
+                                    return on_written(session, transfer);
+                                  });
+      session.parked -= 1;
+      session.in_flight += 1;
+    }
 
-              std::cout << ret << std::endl;
-              usb_interrupt_write(handle, endpoint, (char*)data, ret, 0);
+  if (session.in_flight == 0 && (session.stopping || session.source->at_end()))
+    {
+      g_main_loop_quit(session.loop);
+    }
+}
 
-            }
-          else
-            {
-              int ret = sizeof(data);
-              for(int i = 0; i < ret ; ++i)
-                {
-                  data[i] = int(127 * sin(float(i) / ret * M_PI*2)) + 127;
-                  std::cout << ret << std::endl;
-                }
-              std::cout << ret << std::endl;
-              usb_interrupt_write(handle, endpoint, (char*)data, ret, 0);
+bool
+on_written(Session& session, libusb_transfer* transfer)
+{
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+      std::cerr << "USBError: transfer status " << transfer->status << std::endl;
+      session.stats.add_error();
+      stop_session(session);
+    }
+  else
+    {
+      session.stats.add(transfer->actual_length);
+      session.short_bytes += static_cast<uint64_t>(transfer->length - transfer->actual_length);
+    }
 
-            }
+  if (!session.stopping)
+    {
+      size_t const len = session.source->read(transfer->buffer, static_cast<size_t>(session.size));
+      if (len > 0)
+        {
+          transfer->length = static_cast<int>(len);
+          return true;
         }
     }
+
+  session.in_flight -= 1;
+  session.parked += 1;
+  if (session.in_flight == 0 && (session.stopping || session.source->at_end()))
+    {
+      g_main_loop_quit(session.loop);
+    }
+  return false;
 }
 
 void
-read_usb_device(struct usb_device* dev, int interface, int endpoint)
+read_usb_device(Session& session, Options const& opts, int size, bool hexdump)
 {
-  struct usb_dev_handle* handle = usb_open(dev);
-  if (!handle)
+  if (!hexdump)
     {
-      std::cout << "Error opening usb device" << std::endl;
+      // raw output goes out in large blocks, not per packet
+      setvbuf(stdout, nullptr, _IOFBF, 1024 * 1024);
     }
-  else
-    {
-      if (usb_claim_interface(handle, interface) != 0)
+
+  session.iface->submit_read_batched(
+    opts.endpoint, size, opts.depth,
+    [&session, hexdump](USBReadRecord const* records, size_t count) {
+      for(size_t i = 0; i < count; ++i)
         {
-          std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-          if (usb_detach_kernel_driver_np(handle, interface) < 0)
+          USBReadRecord const& record = records[i];
+          if (record.status != LIBUSB_TRANSFER_COMPLETED)
             {
-              std::cout << "Failure to kick kernel driver: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
+              session.stats.add_error();
+              continue;
             }
 
-          if (usb_claim_interface(handle, interface) != 0)
+          session.stats.add(record.len);
+
+          if (hexdump)
+            {
+              fmt::print("len: {} data:", record.len);
+              for(int j = 0; j < record.len; ++j)
+                {
+                  fmt::print(" 0x{:02x}", record.data[j]);
+                }
+              fmt::print("\n");
+            }
+          else if (fwrite(record.data, 1, static_cast<size_t>(record.len), stdout) != static_cast<size_t>(record.len))
             {
-              std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
+              std::cerr << "Error writing to stdout: " << strerror(errno) << std::endl;
+              stop_session(session);
+              return;
             }
         }
 
-      bool quit = false;
-
-      while(!quit)
+      if (hexdump)
         {
-          uint8_t data[8192];
-          int ret = usb_interrupt_read(handle, endpoint, (char*)data, sizeof(data), 0);
-          if (ret < 0)
-            {
-              std::cerr << "USBError: " << ret << "\n" << usb_strerror() << std::endl;
-              std::cerr << "Shutting down" << std::endl;
-              quit = true;
-            }
-
-          fwrite(data, sizeof(char), ret, stdout);
+          fflush(stdout);
         }
-    }
+    });
 }
 
-void
-cat_usb_device(struct usb_device* dev, int interface, int endpoint)
+int
+run_usb_device(std::string const& command, Options const& opts)
 {
-  struct usb_dev_handle* handle = usb_open(dev);
-  if (!handle)
+  libusb_device* dev = usb_find_device_by_id(opts.idVendor, opts.idProduct);
+  if (!dev)
     {
-      std::cout << "Error opening usb device" << std::endl;
+      std::cerr << fmt::format("Error: Device (idVendor: 0x{:04x}, idProduct: 0x{:04x}) not found",
+                               opts.idVendor, opts.idProduct) << std::endl;
+      return EXIT_FAILURE;
     }
-  else
+
+  USBDevice device(dev);
+  libusb_unref_device(dev);
+
+  bool const write_mode = (command == "write");
+  int const address = opts.endpoint | (write_mode ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN);
+
+  libusb_endpoint_descriptor const* ep = find_endpoint(device.get_config_descriptor(), opts.interface, address);
+  if (!ep)
     {
-      std::cout << "Claming interface " << interface << std::endl;
-      if (usb_claim_interface(handle, interface) != 0)
-        {
-          std::cout << "Claming interface " << interface << " success" << std::endl;
+      std::cerr << fmt::format("Error: Interface {} has no endpoint 0x{:02x}", opts.interface, address) << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  int const type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+  if (type != LIBUSB_TRANSFER_TYPE_BULK && type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+    {
+      std::cerr << fmt::format("Error: Endpoint 0x{:02x} is neither a bulk nor an interrupt endpoint", address) << std::endl;
+      return EXIT_FAILURE;
+    }
 
-          std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-          if (usb_detach_kernel_driver_np(handle, interface) < 0)
+  int size = opts.size;
+  if (size == 0)
+    {
+      size = (type == LIBUSB_TRANSFER_TYPE_BULK) ? default_bulk_size : ep->wMaxPacketSize & 0x7ff;
+    }
+
+  std::cerr << fmt::format("{}: {} endpoint 0x{:02x}, interface {}, {} bytes per transfer, {} in flight",
+                           usb_get_device_label(device.get_device()),
+                           (type == LIBUSB_TRANSFER_TYPE_BULK) ? "bulk" : "interrupt",
+                           address, opts.interface, size, opts.depth)
+            << std::endl;
+
+  std::unique_ptr<USBInterface> iface = device.claim_interface(opts.interface, true);
+
+  GMainLoop* loop = g_main_loop_new(nullptr, FALSE);
+  Session session{loop, iface.get(), opts.endpoint, Statistics(), write_mode, false,
+                  nullptr, size, 0, opts.depth, 0, {false}};
+
+  int input_fd = STDIN_FILENO;
+  std::unique_ptr<StreamSource> source;
+  if (write_mode)
+    {
+      if (!opts.filename.empty())
+        {
+          input_fd = open(opts.filename.c_str(), O_RDONLY | O_CLOEXEC);
+          if (input_fd < 0)
             {
-              std::cout << "Failure to kick kernel driver: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
+              g_main_loop_unref(loop);
+              throw std::runtime_error(fmt::format("{}: {}", opts.filename, strerror(errno)));
             }
+        }
 
-          if (usb_claim_interface(handle, interface) != 0)
+      source = std::make_unique<StreamSource>(input_fd, [&session]{
+          // called from the reader thread, hand over to the main loop
+          if (!session.resume_pending.exchange(true))
             {
-              std::cout << "Error claiming the interface: " << usb_strerror() << std::endl;
-              exit(EXIT_FAILURE);
+              g_idle_add([](gpointer data) -> gboolean {
+                  Session& session_ = *static_cast<Session*>(data);
+                  session_.resume_pending = false;
+                  resume_writes(session_);
+                  return FALSE;
+                }, &session);
             }
+        });
+      session.source = source.get();
+    }
+
+  iface->set_disconnect_callback([&session]{
+      std::cerr << "Device disconnected" << std::endl;
+      if (session.write_mode)
+        {
+          session.in_flight = 0;
+          g_main_loop_quit(session.loop);
+        }
+      else
+        {
+          stop_session(session);
         }
+    });
 
+  if (write_mode)
+    {
+      resume_writes(session);
+    }
+  else
+    {
+      read_usb_device(session, opts, size, command == "cat");
+    }
 
-      bool quit = false;
+  guint const sigint_id = g_unix_signal_add(SIGINT, [](gpointer data) -> gboolean {
+      stop_session(*static_cast<Session*>(data));
+      return TRUE;
+    }, &session);
 
-      while(!quit)
-        {
-          uint8_t data[32];
-          int ret = usb_interrupt_read(handle, endpoint, (char*)data, sizeof(data), 0);
-          if (ret < 0)
-            {
-              std::cout << "USBError: " << ret << "\n" << usb_strerror() << std::endl;
-              std::cout << "Shutting down" << std::endl;
-              quit = true;
-            }
-          else
-            {
-              std::cout << "len: " << ret
-                        << " data: ";
+  guint stats_id = 0;
+  if (opts.stats_interval > 0)
+    {
+      stats_id = g_timeout_add_seconds(static_cast<guint>(opts.stats_interval), [](gpointer data) -> gboolean {
+          static_cast<Session*>(data)->stats.print_interval();
+          return TRUE;
+        }, &session);
+    }
 
-              for(int j = 0; j < ret; ++j)
-                {
-                  std::cout << fmt::format("0x{:02x} ", int(data[j]));
-                }
-              //std::cout << "\r" << std::flush;
-              std::cout << std::endl;
-            }
+  // a quit before g_main_loop_run() would get lost
+  if (!write_mode || session.in_flight > 0 || !source->at_end())
+    {
+      g_main_loop_run(loop);
+    }
 
-          if (0)
-            {
-          for(int i = 0; i < ret; ++i)
-            data[i] = 255;
-          int ret2 = usb_interrupt_write(handle, 4, (char*)data, ret, 0);
-          printf("Ret2: %d\n", ret2);
-            }
+  if (stats_id)
+    {
+      g_source_remove(stats_id);
+    }
+  g_source_remove(sigint_id);
 
-          if (0)
-            {
-              char arr[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 16, 32, 64, 128, 255 };
-              for (int len = 3; len <= 8; ++len)
-                {
-                  // Sending random data:
-                  for (int front = 0; front < 256; ++front)
-                    {
-                      for (size_t i = 0; i < sizeof(arr); ++i)
-                        {
-                          char ledcmd[] = { front, len, arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i], arr[i] };
-                          printf("%d %d %d\n", len, front, arr[i]);
-                          usb_interrupt_write(handle, 5, ledcmd, len, 0);
-
-                          uint8_t data[32];
-                          int ret = usb_interrupt_read(handle, endpoint, (char*)data, sizeof(data), 10);
-                          if (ret == -110)
-                            {
-
-                            }
-                          else if (ret < 0)
-                            {
-                              std::cout << "USBError: " << ret << "\n" << usb_strerror() << std::endl;
-                              std::cout << "Shutting down" << std::endl;
-                              quit = true;
-                            }
-                          else
-                            {
-                              std::cout << "len: " << ret
-                                        << " data: ";
-
-                              for(int j = 0; j < ret; ++j)
-                                {
-                                  std::cout << fmt::format("0x{:%02x} ", int(data[j]));
-                                }
-                              //std::cout << "\r" << std::flush;
-                              std::cout << std::endl;
-                            }
-
-                        }
-                    }
-                }
-            }
+  fflush(stdout);
+  session.stats.print_total();
 
-          if (0)
-            {
-              int len = rand() % 10;
-              char rumblecmd[len];
-              for (int i = 0; i < len; ++i)
-                {
-                  rumblecmd[i] = rand() % 255;
-                }
+  int result = EXIT_SUCCESS;
+  if (write_mode)
+    {
+      // stop the reader thread before dropping its pending wakeup
+      int const error = source->get_error();
+      uint64_t const input_bytes = source->get_total();
+      bool const complete = source->at_end();
+      source.reset();
+      while (g_idle_remove_by_data(&session)) {}
+
+      if (input_fd != STDIN_FILENO)
+        {
+          close(input_fd);
+        }
 
-              std::cout << "Writing random data" << std::endl;
-              if (usb_interrupt_write(handle, 0, rumblecmd, len, 0) < 0)
-                {
-                  std::cout << "Write Error: " << usb_strerror() << std::endl;
-                }
-            }
+      uint64_t const written = session.stats.get_bytes();
+      std::cerr << fmt::format("{} bytes read, {} bytes written", input_bytes, written) << std::endl;
+      if (session.short_bytes > 0)
+        {
+          std::cerr << fmt::format("{} bytes were not accepted by the device", session.short_bytes) << std::endl;
+        }
+
+      if (error != 0)
+        {
+          std::cerr << "Error reading input: " << strerror(error) << std::endl;
+          result = EXIT_FAILURE;
+        }
+      else if (!complete || written != input_bytes)
+        {
+          std::cerr << "Error: Input was not written completely" << std::endl;
+          result = EXIT_FAILURE;
         }
-      usb_release_interface(handle, interface);
-      usb_close(handle);
     }
+  g_main_loop_unref(loop);
+
+  return result;
 }
 
 void
 list_usb_devices()
 {
-  struct usb_bus* busses = usb_get_busses();
+  libusb_device** list;
+  ssize_t const num_devices = libusb_get_device_list(nullptr, &list);
 
-  int bus_idx = 0;
-  for (struct usb_bus* bus = busses; bus; bus = bus->next)
+  for(ssize_t i = 0; i < num_devices; ++i)
     {
-      for (struct usb_device* dev = bus->devices; dev; dev = dev->next)
-        {
-          std::cout << boost::format("Bus %s Device %s ") % bus->dirname % dev->filename
-                    << " " << dev << std::endl;
-        }
-      bus_idx += 1;
+      std::cout << fmt::format("Bus {:03d} Device {:03d}: {}",
+                               libusb_get_bus_number(list[i]),
+                               libusb_get_device_address(list[i]),
+                               usb_get_device_label(list[i]))
+                << std::endl;
     }
+
+  libusb_free_device_list(list, 1);
 }
 
-int main(int argc, char** argv)
+void
+print_usage(char const* program)
 {
-  srand(time(NULL));
+  std::cout << "Usage: " << program << " list\n"
+            << "       " << program << " cat|read|write [OPTION]... IDVENDOR IDPRODUCT [INTERFACE] [ENDPOINT]\n"
+            << "\n"
+            << "Options:\n"
+            << "  --depth N      Transfers kept in flight (default: 8)\n"
+            << "  --size BYTES   Bytes per transfer (default: 16384 for bulk,\n"
+            << "                 the packet size for interrupt endpoints)\n"
+            << "  --stats SECS   Print statistics to stderr every SECS seconds,\n"
+            << "                 0 disables them (default: 1)\n"
+            << "  --file FILE    Data for write, instead of stdin"
+            << std::endl;
+}
+
+} // namespace
 
+int main(int argc, char** argv)
+{
   if (argc == 2 && strcmp("list", argv[1]) == 0)
     {
-      usb_init();
-      usb_find_busses();
-      usb_find_devices();
-
+      USBSubsystem usb_subsystem;
       list_usb_devices();
+      return EXIT_SUCCESS;
     }
-  else if ((argc == 4 || argc == 5 || argc == 6) &&
+  else if (argc >= 4 &&
            (strcmp("cat", argv[1]) == 0 ||
             strcmp("read", argv[1]) == 0 ||
             strcmp("write", argv[1]) == 0))
     {
-      uint16_t idVendor;
-      uint16_t idProduct;
-      int interface = 0;
-      int endpoint  = 1;
+      Options opts;
+      std::vector<char const*> args;
 
-      if (sscanf(argv[2], "0x%hx", &idVendor) == 1 &&
-          sscanf(argv[3], "0x%hx", &idProduct) == 1)
+      for(int i = 2; i < argc; ++i)
         {
-          if (argc >= 5)
-            interface = atoi(argv[4]);
-
-          if (argc == 6)
-            endpoint  = atoi(argv[5]);
-
-          usb_init();
-          usb_find_busses();
-          usb_find_devices();
-
-          struct usb_device* dev = find_usb_device(idVendor, idProduct);
-          if (!dev)
-            {
-              std::cout << "Error: Device (" << boost::format("idVendor: 0x%04hx, idProduct: 0x%04hx")
-                % idVendor % idProduct << ") not found" << std::endl;
-            }
-          else
+          if (strncmp(argv[i], "--", 2) == 0)
             {
-              if (strcmp("cat", argv[1]) == 0)
+              if (i + 1 >= argc)
                 {
-                  std::cout << "Reading data from: " << dev << " Interface: " << interface << " Endpoint: " << endpoint << std::endl;
-                  cat_usb_device(dev, interface, endpoint);
+                  std::cerr << "Error: " << argv[i] << " requires an argument" << std::endl;
+                  return EXIT_FAILURE;
                 }
-              else if (strcmp("read", argv[1]) == 0)
+
+              if (strcmp(argv[i], "--depth") == 0)
+                {
+                  opts.depth = atoi(argv[++i]);
+                }
+              else if (strcmp(argv[i], "--size") == 0)
+                {
+                  opts.size = atoi(argv[++i]);
+                }
+              else if (strcmp(argv[i], "--stats") == 0)
+                {
+                  opts.stats_interval = atoi(argv[++i]);
+                }
+              else if (strcmp(argv[i], "--file") == 0)
                 {
-                  read_usb_device(dev, interface, endpoint);
+                  opts.filename = argv[++i];
                 }
-              else if (strcmp("write", argv[1]) == 0)
+              else
                 {
-                  write_usb_device(dev, interface, endpoint);
+                  std::cerr << "Error: Unknown option " << argv[i] << std::endl;
+                  return EXIT_FAILURE;
                 }
             }
+          else
+            {
+              args.push_back(argv[i]);
+            }
         }
-      else
+
+      if (args.size() < 2 || args.size() > 4 ||
+          sscanf(args[0], "0x%hx", &opts.idVendor) != 1 ||
+          sscanf(args[1], "0x%hx", &opts.idProduct) != 1)
         {
-          std::cout << "Error: Expected IDVENDOR IDPRODUCT" << std::endl;
+          std::cerr << "Error: Expected IDVENDOR IDPRODUCT" << std::endl;
+          return EXIT_FAILURE;
+        }
+
+      if (args.size() >= 3)
+        opts.interface = atoi(args[2]);
+
+      if (args.size() == 4)
+        opts.endpoint = atoi(args[3]);
+
+      if (opts.depth < 1 || opts.size < 0 || opts.stats_interval < 0)
+        {
+          std::cerr << "Error: Invalid option value" << std::endl;
+          return EXIT_FAILURE;
+        }
+
+      // write errors on stdout are handled where they happen
+      signal(SIGPIPE, SIG_IGN);
+
+      try
+        {
+          USBSubsystem usb_subsystem;
+          return run_usb_device(argv[1], opts);
+        }
+      catch(std::exception const& err)
+        {
+          std::cerr << "Error: " << err.what() << std::endl;
+          return EXIT_FAILURE;
         }
     }
   else
     {
-      std::cout << "Usage: " << argv[0] << " list\n"
-                << "       " << argv[0] << " cat IDVENDOR IDPRODUCT [INTERFACE] [ENDPOINT]"
-                << std::endl;
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
     }
 }
 
@@ -1,40 +1,253 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <libusb.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <fmt/format.h>
-#include <signal.h>
-#include <usb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
-#include <pthread.h>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
-#include <iostream>
+
+#include <fmt/format.h>
+
+#include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_subsystem.hpp"
 
 class USBDevice;
-class EndpointListenerThread;
 
-void print_raw_data(std::ostream& out, uint8_t* data, int len);
+std::string raw_data_to_string(uint8_t const* data, int len);
+void print_raw_data(std::ostream& out, uint8_t const* data, int len);
 bool global_interrupt = false;
-
-struct usb_device*
-find_usb_device(uint16_t idVendor, uint16_t idProduct)
+
+/** Transfers kept in flight per listened endpoint */
+int const listen_depth = 4;
+
+/** Size of each listener transfer */
+int const listen_read_size = 8192;
+
+/** Collects output and writes it to fd from its own thread, so USB
+    completions never wait for the terminal or the disk. Once the
+    writer falls max_pending bytes behind, output gets dropped and
+    counted instead. */
+class OutputWriter
 {
-  struct usb_bus* busses = usb_get_busses();
+private:
+  int fd;
+  size_t max_pending;
+  std::string pending;
+  size_t writing;
+  uint64_t dropped;
+  bool failed;
+  bool quit;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::thread thread;
+
+public:
+  OutputWriter(int fd_ = STDOUT_FILENO, size_t max_pending_ = 16 * 1024 * 1024)
+    : fd(fd_),
+      max_pending(max_pending_),
+      pending(),
+      writing(0),
+      dropped(0),
+      failed(false),
+      quit(false),
+      mutex(),
+      cond(),
+      thread()
+  {
+    thread = std::thread(&OutputWriter::run, this);
+  }
+
+  ~OutputWriter()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cond.notify_one();
+    thread.join();
+  }
+
+  void write(std::string const& text)
+  {
+    write(text.data(), text.size());
+  }
 
-  for (struct usb_bus* bus = busses; bus; bus = bus->next)
+  void write(char const* data, size_t len)
+  {
     {
-      for (struct usb_device* dev = bus->devices; dev; dev = dev->next)
+      std::lock_guard<std::mutex> lock(mutex);
+      if (pending.size() + len > max_pending)
         {
-          if (dev->descriptor.idVendor  == idVendor &&
-              dev->descriptor.idProduct == idProduct)
-            {
-              return dev;
-            }
+          dropped += len;
+          return;
         }
+      pending.append(data, len);
     }
-  return 0;
-}
-
+    cond.notify_one();
+  }
+
+  /** Bytes handed to write() that haven't reached fd yet */
+  size_t get_pending()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.size() + writing;
+  }
+
+  /** True once a write to fd failed, later output is discarded */
+  bool has_failed()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+  }
+
+private:
+  void run()
+  {
+    std::string buffer;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+      {
+        cond.wait(lock, [this]{ return quit || !pending.empty(); });
+        if (pending.empty())
+          {
+            break;
+          }
+
+        // the dropped output came after everything that is pending
+        buffer.swap(pending);
+        if (dropped > 0)
+          {
+            buffer += fmt::format("*** {} bytes of output dropped\n", dropped);
+            dropped = 0;
+          }
+        writing = buffer.size();
+        bool const discard = failed;
+        lock.unlock();
+
+        bool const ok = discard || write_all(buffer);
+        buffer.clear();
+
+        lock.lock();
+        writing = 0;
+        if (!ok)
+          {
+            failed = true;
+          }
+      }
+  }
+
+  bool write_all(std::string const& text)
+  {
+    size_t pos = 0;
+    while (pos < text.size())
+      {
+        ssize_t ret = ::write(fd, text.data() + pos, text.size() - pos);
+        if (ret < 0)
+          {
+            if (errno == EINTR)
+              continue;
+            return false;
+          }
+        pos += static_cast<size_t>(ret);
+      }
+    return true;
+  }
+};
+
+/** Runs the glib main loop, and with it the USB event handling, on its
+    own thread while the console blocks on stdin. USBInterface objects
+    are only created, used and destroyed on this thread, via call(). */
+class EventThread
+{
+private:
+  struct Call
+  {
+    std::function<void ()> const* func = nullptr;
+    std::exception_ptr error;
+    bool done = false;
+    std::mutex mutex;
+    std::condition_variable cond;
+  };
+
+  GMainLoop* loop;
+  std::thread thread;
+
+public:
+  EventThread()
+    : loop(g_main_loop_new(NULL, FALSE)),
+      thread()
+  {
+    thread = std::thread([this]{ g_main_loop_run(loop); });
+  }
+
+  ~EventThread()
+  {
+    // goes through the loop, so the quit can't get lost before it runs
+    call([this]{ g_main_loop_quit(loop); });
+    thread.join();
+    g_main_loop_unref(loop);
+  }
+
+  /** Run func on the event thread and wait for it to return,
+      exceptions are rethrown in the caller */
+  void call(std::function<void ()> const& func)
+  {
+    Call c;
+    c.func = &func;
+    g_idle_add(&EventThread::on_call, &c);
+
+    std::unique_lock<std::mutex> lock(c.mutex);
+    c.cond.wait(lock, [&c]{ return c.done; });
+    if (c.error)
+      {
+        std::rethrow_exception(c.error);
+      }
+  }
+
+private:
+  static gboolean on_call(gpointer userdata)
+  {
+    Call* c = static_cast<Call*>(userdata);
+
+    std::exception_ptr error;
+    try
+      {
+        (*c->func)();
+      }
+    catch(...)
+      {
+        error = std::current_exception();
+      }
+
+    // c lives on the stack of the waiting caller
+    std::lock_guard<std::mutex> lock(c->mutex);
+    c->error = error;
+    c->done = true;
+    c->cond.notify_one();
+    return FALSE;
+  }
+};
+
 class USBDevice
 {
 private:
@@ -43,31 +256,87 @@ public:
   static USBDevice* current() { return current_; }
 
 private:
-  struct usb_device*     dev;
-  struct usb_dev_handle* handle;
+  libusb_device* dev;
+  std::shared_ptr<libusb_device_handle> handle;
+
+  EventThread& event_thread;
+  OutputWriter& output;
+
+  // only touched on the event thread
+  std::map<int, std::unique_ptr<unsebu::USBInterface>> interfaces;
+  std::set<int> listening;
+  std::function<void (int, unsebu::USBReadRecord const&)> response_callback;
+  /** Cancelled listener reads that libusb hasn't handed back yet */
+  size_t cancelled_reads;
 
-  std::vector<EndpointListenerThread*> threads;
 public:
-  USBDevice(struct usb_device* dev_)
-    : dev(dev_)
+  /** The first device opened becomes current() */
+  USBDevice(libusb_device* dev_, EventThread& event_thread_, OutputWriter& output_)
+    : dev(dev_),
+      handle(),
+      event_thread(event_thread_),
+      output(output_),
+      interfaces(),
+      listening(),
+      response_callback(),
+      cancelled_reads(0)
   {
-    USBDevice:: current_ = this;
+    libusb_device_handle* h;
+    int ret = libusb_open(dev, &h);
+    if (ret != LIBUSB_SUCCESS)
+      {
+        throw std::runtime_error(fmt::format("Error opening usb device: {}", libusb_strerror(static_cast<libusb_error>(ret))));
+      }
+    handle.reset(h, &libusb_close);
+    libusb_ref_device(dev);
 
-    handle = usb_open(dev);
-    if (!handle)
+    if (!USBDevice::current_)
       {
-        throw std::runtime_error("Error opening usb device");
+        USBDevice::current_ = this;
       }
   }
 
   ~USBDevice()
   {
-    usb_close(handle);
+    // the listener reads have to come back from libusb before the
+    // interfaces and the handle go away
+    event_thread.call([this]{
+        for(int endpoint : listening)
+          {
+            int interface;
+            int type;
+            find_endpoint(endpoint | LIBUSB_ENDPOINT_IN, interface, type);
+            auto it = interfaces.find(interface);
+            if (it != interfaces.end())
+              cancel_listen(*it->second, endpoint);
+          }
+        listening.clear();
+      });
+
+    bool drained = false;
+    while (!drained)
+      {
+        event_thread.call([this, &drained]{ drained = (cancelled_reads == 0); });
+        if (!drained)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+    event_thread.call([this]{ interfaces.clear(); });
+    libusb_unref_device(dev);
+    if (USBDevice::current_ == this)
+      {
+        USBDevice::current_ = 0;
+      }
   }
 
+  libusb_device* get_device() const { return dev; }
+  libusb_device_handle* get_handle() const { return handle.get(); }
+  EventThread& get_event_thread() const { return event_thread; }
+  OutputWriter& get_output() const { return output; }
+
   void clear_halt(int ep)
   {
-    if (usb_clear_halt(handle, ep) != 0)
+    if (libusb_clear_halt(handle.get(), static_cast<unsigned char>(ep)) != 0)
       {
         std::cout << "Failure to reset_ep: " << ep << std::endl;
       }
@@ -75,7 +344,7 @@ public:
 
   void reset()
   {
-    if (usb_reset(handle) != 0)
+    if (libusb_reset_device(handle.get()) != 0)
       {
         std::cout << "Failure to reset" << std::endl;
       }
@@ -83,7 +352,7 @@ public:
 
   void detach_kernel_driver(int iface)
   {
-    if (usb_detach_kernel_driver_np(handle, iface) < 0)
+    if (libusb_detach_kernel_driver(handle.get(), iface) != 0)
       {
         std::ostringstream str;
         str << "Couldn't detcach interface " << iface;
@@ -93,28 +362,34 @@ public:
 
   void claim_interface(int iface)
   {
-    if (usb_claim_interface(handle, iface) != 0)
-      {
-        std::ostringstream str;
-        str << "Couldn't claim interface " << iface;
-        throw std::runtime_error(str.str());
-      }
+    event_thread.call([this, iface]{ get_interface(iface); });
   }
 
-
   void release_interface(int iface)
   {
-    if (usb_release_interface(handle, iface) != 0)
-      {
-        std::ostringstream str;
-        str << "Couldn't release interface " << iface;
-        throw std::runtime_error(str.str());
-      }
+    event_thread.call([this, iface]{
+        auto it = interfaces.find(iface);
+        if (it == interfaces.end())
+          {
+            std::ostringstream str;
+            str << "Couldn't release interface " << iface << ", it isn't claimed";
+            throw std::runtime_error(str.str());
+          }
+
+        // the transfers of the listeners are freed once they are back,
+        // the handle outlives them
+        for(int endpoint : get_endpoints(iface))
+          {
+            if (listening.erase(endpoint) != 0)
+              cancel_listen(*it->second, endpoint);
+          }
+        interfaces.erase(it);
+      });
   }
 
   void set_configuration(int configuration)
   {
-    if (usb_set_configuration(handle, configuration) != 0)
+    if (libusb_set_configuration(handle.get(), configuration) != 0)
       {
         std::ostringstream str;
         str << "Couldn't set configuration " << configuration;
@@ -122,24 +397,27 @@ public:
       }
   }
 
-  void set_altinterface(int interface)
+  void set_altinterface(int interface, int altsetting)
   {
-    if (usb_set_altinterface(handle, interface) != 0)
+    if (libusb_set_interface_alt_setting(handle.get(), interface, altsetting) != 0)
       {
         std::ostringstream str;
-        str << "Couldn't set alternative interface " << interface;
+        str << "Couldn't set alternative setting " << altsetting << " of interface " << interface;
         throw std::runtime_error(str.str());
       }
   }
 
-  int read(int endpoint, uint8_t* data, int len)
-  {
-    return usb_interrupt_read(handle, endpoint, (char*)data, len, 0);
-  }
-
   int write(int endpoint, uint8_t* data, int len)
   {
-    return usb_interrupt_write(handle, endpoint, (char*)data, len, 0);
+    int interface;
+    int type;
+    find_endpoint(endpoint | LIBUSB_ENDPOINT_OUT, interface, type);
+
+    int transferred = 0;
+    int ret = (type == LIBUSB_TRANSFER_TYPE_BULK) ?
+      libusb_bulk_transfer(handle.get(), static_cast<unsigned char>(endpoint), data, len, &transferred, 0) :
+      libusb_interrupt_transfer(handle.get(), static_cast<unsigned char>(endpoint), data, len, &transferred, 0);
+    return (ret == LIBUSB_SUCCESS) ? transferred : ret;
   }
 
   /* uint8_t  requesttype
@@ -152,107 +430,222 @@ public:
                int value, int index,
                uint8_t* data, int size)
   {
-    return usb_control_msg(handle,
-                           requesttype,  request,
-                           value,  index,
-                           (char*)data, size,
-                           0 /* timeout */);
+    return libusb_control_transfer(handle.get(),
+                                   static_cast<uint8_t>(requesttype), static_cast<uint8_t>(request),
+                                   static_cast<uint16_t>(value), static_cast<uint16_t>(index),
+                                   data, static_cast<uint16_t>(size),
+                                   0 /* timeout */);
   }
 
   void print_info()
   {
-    for(int i = 0; i < dev->descriptor.bNumConfigurations; ++i)
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS)
+      {
+        return;
+      }
+
+    for(int i = 0; i < desc.bNumConfigurations; ++i)
       {
+        libusb_config_descriptor* config;
+        if (libusb_get_config_descriptor(dev, static_cast<uint8_t>(i), &config) != LIBUSB_SUCCESS)
+          {
+            continue;
+          }
+
         std::cout << "Configuration: " << i << std::endl;
-        for(int j = 0; j < dev->config[i].bNumInterfaces; ++j)
+        for(int j = 0; j < config->bNumInterfaces; ++j)
           {
             std::cout << "  Interface " << j << ":" << std::endl;
-            for(int k = 0; k < dev->config[i].interface[j].num_altsetting; ++k)
+            for(int k = 0; k < config->interface[j].num_altsetting; ++k)
               {
-                for(int l = 0; l < dev->config[i].interface[j].altsetting[k].bNumEndpoints; ++l)
+                libusb_interface_descriptor const& altsetting = config->interface[j].altsetting[k];
+                for(int l = 0; l < altsetting.bNumEndpoints; ++l)
                   {
                     std::cout << "    Endpoint: "
-                              << int(dev->config[i].interface[j].altsetting[k].endpoint[l].bEndpointAddress & USB_ENDPOINT_ADDRESS_MASK)
-                              << ((dev->config[i].interface[j].altsetting[k].endpoint[l].bEndpointAddress & USB_ENDPOINT_DIR_MASK) ? " (IN)" : " (OUT)")
+                              << int(altsetting.endpoint[l].bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK)
+                              << ((altsetting.endpoint[l].bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ? " (IN)" : " (OUT)")
+                              << ((altsetting.endpoint[l].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_BULK ? " bulk" : "")
                               << std::endl;
                   }
               }
           }
+
+        libusb_free_config_descriptor(config);
       }
   }
 
-  void launch_listener_thread(int endpoint);
-};
+  /** Keep listen_depth reads in flight on the endpoint, the interface
+      owning it gets claimed if it isn't already */
+  void listen(int endpoint)
+  {
+    int interface;
+    int type;
+    find_endpoint(endpoint | LIBUSB_ENDPOINT_IN, interface, type);
 
-USBDevice* USBDevice::current_ = 0;
-
-class EndpointListenerThread
-{
-private:
-  pthread_t thread;
-  int  endpoint;
-  bool running;
-public:
-  EndpointListenerThread(int endpoint_)
-    : endpoint(endpoint_),
-      running(false)
+    event_thread.call([this, endpoint, interface]{
+        if (!listening.insert(endpoint).second)
+          {
+            throw std::runtime_error(fmt::format("Already listening on endpoint {}", endpoint));
+          }
+
+        try
+          {
+            unsebu::USBInterface& iface = get_interface(interface);
+            iface.submit_read_batched(endpoint, listen_read_size, listen_depth,
+                                      [this, &iface, endpoint](unsebu::USBReadRecord const* records, size_t count) {
+                                        on_listen_data(iface, endpoint, records, count);
+                                      });
+          }
+        catch(...)
+          {
+            listening.erase(endpoint);
+            throw;
+          }
+      });
+
+    std::cout << "Reading from endpoint " << endpoint << " on interface " << interface << std::endl;
+  }
+
+  /** Hand the data of the listened endpoints to callback instead of
+      printing it, nullptr goes back to printing. Event thread only. */
+  void set_response_callback(std::function<void (int, unsebu::USBReadRecord const&)> const& callback)
+  {
+    response_callback = callback;
+  }
+
+  bool is_listening(int endpoint)
   {
+    bool result = false;
+    event_thread.call([this, endpoint, &result]{ result = (listening.count(endpoint) != 0); });
+    return result;
   }
 
-  ~EndpointListenerThread()
+  void unlisten(int endpoint)
   {
+    int interface;
+    int type;
+    find_endpoint(endpoint | LIBUSB_ENDPOINT_IN, interface, type);
 
+    event_thread.call([this, endpoint, interface]{
+        auto it = interfaces.find(interface);
+        if (listening.erase(endpoint) == 0 || it == interfaces.end())
+          {
+            throw std::runtime_error(fmt::format("Not listening on endpoint {}", endpoint));
+          }
+        cancel_listen(*it->second, endpoint);
+      });
   }
 
-  void start()
+private:
+  /** Event thread only, the destructor waits for the read to be freed */
+  void cancel_listen(unsebu::USBInterface& iface, int endpoint)
   {
-    running = true;
-    pthread_create(&thread, NULL, &EndpointListenerThread::callback, this);
+    cancelled_reads += 1;
+    iface.cancel_read(endpoint, [this]{ cancelled_reads -= 1; });
   }
 
-  static void* callback(void* userdata)
+  unsebu::USBInterface& get_interface(int iface)
   {
-    EndpointListenerThread* thread = static_cast<EndpointListenerThread*>(userdata);
-    thread->run();
-    pthread_exit(NULL);
+    auto it = interfaces.find(iface);
+    if (it != interfaces.end())
+      {
+        return *it->second;
+      }
+
+    std::unique_ptr<unsebu::USBInterface> usb_interface(new unsebu::USBInterface(handle, iface));
+    usb_interface->set_disconnect_callback([this]{
+        output.write("Device disconnected\n");
+      });
+    return *(interfaces[iface] = std::move(usb_interface));
   }
 
-  void run()
+  /** Called on the event thread once per event handling pass, a whole
+      batch goes to the output in one piece */
+  void on_listen_data(unsebu::USBInterface& iface, int endpoint,
+                      unsebu::USBReadRecord const* records, size_t count)
   {
-    bool this_quit = false;
-    std::cout << "Reading from endpoint " << endpoint << std::endl;;
-    while(!this_quit)
+    std::string text;
+    for(size_t i = 0; i < count; ++i)
       {
-        uint8_t data[8192];
-        int ret = USBDevice::current()->read(endpoint, data, sizeof(data));
-        if (ret < 0)
+        if (records[i].status == LIBUSB_TRANSFER_COMPLETED && response_callback)
+          {
+            response_callback(endpoint, records[i]);
+          }
+        else if (records[i].status == LIBUSB_TRANSFER_COMPLETED)
           {
-            std::cerr << "USBError: " << ret << "\n" << usb_strerror() << std::endl;
-            std::cerr << "Shutting down" << std::endl;
-            this_quit = true;
+            text += fmt::format(">>> Ep{}: {}\n", endpoint, raw_data_to_string(records[i].data, records[i].len));
           }
         else
           {
-            std::cout << ">>> Ep" << endpoint << ": ";
-            print_raw_data(std::cout, data, ret);
-            std::cout << std::endl;
+            text += fmt::format("USBError on Ep{}: transfer status {}\nShutting down\n", endpoint, records[i].status);
+            listening.erase(endpoint);
+            iface.cancel_read(endpoint);
+            break;
           }
       }
+    if (!text.empty())
+      {
+        output.write(text);
+      }
   }
-};
-
-void
-USBDevice::launch_listener_thread(int endpoint)
-{
-  try {
-    EndpointListenerThread* thread = new EndpointListenerThread(endpoint);
-    threads.push_back(thread);
-    thread->start();
-  } catch(std::exception& err) {
-    std::cout << "Error: " << err.what() << std::endl;
+
+public:
+  /** Look up the endpoint address in the active configuration, unknown
+      endpoints are assumed to be interrupt endpoints of interface 0 */
+  void find_endpoint(int address, int& interface, int& type) const
+  {
+    interface = 0;
+    type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+
+    libusb_config_descriptor* config;
+    if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+      {
+        return;
+      }
+
+    for(int i = 0; i < config->bNumInterfaces; ++i)
+      {
+        for(int k = 0; k < config->interface[i].num_altsetting; ++k)
+          {
+            libusb_interface_descriptor const& altsetting = config->interface[i].altsetting[k];
+            for(int l = 0; l < altsetting.bNumEndpoints; ++l)
+              {
+                if (altsetting.endpoint[l].bEndpointAddress == address)
+                  {
+                    interface = altsetting.bInterfaceNumber;
+                    type = altsetting.endpoint[l].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+                    libusb_free_config_descriptor(config);
+                    return;
+                  }
+              }
+          }
+      }
+
+    libusb_free_config_descriptor(config);
   }
-}
-
+
+private:
+  /** The listened endpoints belonging to the interface */
+  std::vector<int> get_endpoints(int iface) const
+  {
+    std::vector<int> result;
+    for(int endpoint : listening)
+      {
+        int interface;
+        int type;
+        find_endpoint(endpoint | LIBUSB_ENDPOINT_IN, interface, type);
+        if (interface == iface)
+          {
+            result.push_back(endpoint);
+          }
+      }
+    return result;
+  }
+};
+
+USBDevice* USBDevice::current_ = 0;
+
 bool has_prefix(const std::string& lhs, const std::string rhs)
 {
   if (lhs.length() < rhs.length())
@@ -293,19 +686,25 @@ tokenize(const std::string& str, const std::string& delimiters = " ")
   return tokens;
 }
 
-void print_raw_data(std::ostream& out, uint8_t* data, int len)
+std::string raw_data_to_string(uint8_t const* data, int len)
 {
-  std::cout << "[" << len
-            << "] { ";
+  fmt::memory_buffer out;
+  fmt::format_to(std::back_inserter(out), "[{}] {{ ", len);
 
   for(int i = 0; i < len; ++i)
     {
-      std::cout << boost::format("0x%02x") % int(data[i]);
+      fmt::format_to(std::back_inserter(out), "0x{:02x}", data[i]);
       if (i != len-1)
-        std::cout << ", ";
+        fmt::format_to(std::back_inserter(out), ", ");
     }
 
-  std::cout << " }";
+  fmt::format_to(std::back_inserter(out), " }}");
+  return fmt::to_string(out);
+}
+
+void print_raw_data(std::ostream& out, uint8_t const* data, int len)
+{
+  out << raw_data_to_string(data, len);
 }
 
 void console_listen_cmd(const std::vector<std::string>& args)
@@ -319,7 +718,31 @@ void console_listen_cmd(const std::vector<std::string>& args)
       for(size_t i = 1; i < args.size(); ++i)
         {
           int endpoint = atoi(args[i].c_str());
-          USBDevice::current()->launch_listener_thread(endpoint);
+          try {
+            USBDevice::current()->listen(endpoint);
+          } catch (std::exception& err) {
+            std::cout << "Error: " << err.what() << std::endl;
+          }
+        }
+    }
+}
+
+void console_unlisten_cmd(const std::vector<std::string>& args)
+{
+  if (args.size() < 2)
+    {
+      std::cout << "Usage: unlisten [ENDPOINT]..." << std::endl;
+    }
+  else
+    {
+      for(size_t i = 1; i < args.size(); ++i)
+        {
+          int endpoint = atoi(args[i].c_str());
+          try {
+            USBDevice::current()->unlisten(endpoint);
+          } catch (std::exception& err) {
+            std::cout << "Error: " << err.what() << std::endl;
+          }
         }
     }
 }
@@ -393,7 +816,7 @@ void console_detach_cmd(const std::vector<std::string>& args)
     }
 }
 
-void console_info_cmd(const std::vector<std::string>& args)
+void console_info_cmd(const std::vector<std::string>& /*args*/)
 {
   USBDevice::current()->print_info();
 }
@@ -442,6 +865,15 @@ public:
     idx = start;
   }
 
+  int size() const {
+    return ((start <= end) ? end - start : start - end) + 1;
+  }
+
+  /** The i-th value, counting from start */
+  int at(int i) const {
+    return (start <= end) ? start + i : start - i;
+  }
+
   std::string to_string() const
   {
     std::ostringstream str;
@@ -506,6 +938,25 @@ public:
       return sequences[idx].get();
   }
 
+  /** Number of values, a range counts with all its values */
+  uint64_t size() const {
+    uint64_t result = 0;
+    for(std::vector<Sequence>::const_iterator i = sequences.begin(); i != sequences.end(); ++i)
+      result += i->size();
+    return result;
+  }
+
+  /** The i-th value, with i < size() */
+  int at(uint64_t i) const {
+    for(std::vector<Sequence>::const_iterator it = sequences.begin(); it != sequences.end(); ++it)
+      {
+        if (i < uint64_t(it->size()))
+          return it->at(int(i));
+        i -= it->size();
+      }
+    return sequences.back().at(sequences.back().size() - 1);
+  }
+
   void next() {
     if (!eol())
       {
@@ -544,78 +995,905 @@ public:
   }
 };
 
-bool eol(std::vector<SequenceGenerator>& sequences)
+/** The cartesian product of the generators, addressed by position so
+    that probes can be resumed and split up, the first generator varies
+    fastest */
+class ProbeSpace
 {
-  if (sequences.empty())
-    return true;
-  else
-    return sequences.back().eol();
-}
-
-void next(std::vector<SequenceGenerator>& sequences, int idx)
-{
-  if (idx < int(sequences.size()))
-    {
-      if (!sequences[idx].eol())
-        {
-          sequences[idx].next();
-          if (sequences[idx].eol())
-            {
-              if (idx+1 < int(sequences.size()))
-                {
-                  sequences[idx].reset();
-                  next(sequences, idx+1);
-                }
-            }
-        }
-    }
-}
+private:
+  std::vector<SequenceGenerator> generators;
 
-void next(std::vector<SequenceGenerator>& sequences)
-{
-  if (!sequences.empty())
-    {
-      next(sequences, 0);
-    }
-}
+public:
+  ProbeSpace(const std::vector<SequenceGenerator>& generators_)
+    : generators(generators_)
+  {
+    for(std::vector<SequenceGenerator>::const_iterator i = generators.begin(); i != generators.end(); ++i)
+      {
+        if (i->size() == 0)
+          throw std::runtime_error("Empty sequence in probe");
+      }
+  }
 
-void console_probe_cmd(const std::vector<std::string>& args)
+  uint64_t size() const
+  {
+    uint64_t result = 1;
+    for(std::vector<SequenceGenerator>::const_iterator i = generators.begin(); i != generators.end(); ++i)
+      {
+        if (result > UINT64_MAX / i->size())
+          throw std::runtime_error("Probe has more than 2^64 combinations");
+        result *= i->size();
+      }
+    return result;
+  }
+
+  void get(uint64_t position, std::vector<int>& values) const
+  {
+    values.resize(generators.size());
+    for(size_t i = 0; i < generators.size(); ++i)
+      {
+        values[i] = generators[i].at(position % generators[i].size());
+        position /= generators[i].size();
+      }
+  }
+
+  std::string to_string() const
+  {
+    std::string result;
+    for(std::vector<SequenceGenerator>::const_iterator i = generators.begin(); i != generators.end(); ++i)
+      {
+        if (!result.empty())
+          result += " ";
+        result += i->to_string();
+      }
+    return result;
+  }
+};
+
+/** A probe log is a ProbeLogHeader followed by the spec string of the
+    probe and then ProbeRecords, each followed by length bytes of data,
+    all in host byte order */
+struct ProbeLogHeader
 {
-  if (args.size() < 3)
+  char magic[8];
+  uint32_t version;
+  uint32_t spec_len;
+};
+
+enum ProbeRecordType
+{
+  /** A lane started, position is its first position and timestamp the
+      wall clock time in nanoseconds */
+  PROBE_RECORD_START = 1,
+
+  /** A request completed, control reads are followed by the returned
+      data. The request itself isn't stored, it follows from the
+      position. */
+  PROBE_RECORD_REQUEST = 2,
+
+  /** Data arrived on a listened endpoint, position is the request of
+      the lane that completed last before it */
+  PROBE_RECORD_RESPONSE = 3
+};
+
+struct ProbeRecord
+{
+  uint8_t type;
+  uint8_t lane;
+  uint8_t endpoint;
+  uint8_t status;
+  uint32_t length;
+  uint64_t position;
+
+  /** Nanoseconds since the start of the run */
+  uint64_t timestamp;
+};
+
+char const probe_log_magic[8] = { 'U', 'S', 'B', 'P', 'R', 'O', 'B', 'E' };
+uint32_t const probe_log_version = 1;
+
+/** Position of responses arriving before the first request completed */
+uint64_t const probe_no_position = UINT64_MAX;
+
+/** Timeout of each probe request in milliseconds */
+unsigned int const probe_timeout = 1000;
+
+/** Submitting stops while this much of the log is waiting for the disk */
+size_t const probe_log_max_pending = 4 * 1024 * 1024;
+
+/** A lane can't continue past a request that ended like this, so it
+    doesn't count as done when resuming */
+bool probe_stops_lane(int endpoint, int status)
+{
+  return (status == LIBUSB_TRANSFER_NO_DEVICE ||
+          (status == LIBUSB_TRANSFER_STALL && endpoint != 0));
+}
+
+/** Read back the probe log for resuming, returns for each lane the
+    last position of the unbroken run start + lane, start + lane +
+    stride, ... that is done. Anything logged past a gap gets probed
+    again. A torn record at the end, left by a crash, is cut off. */
+std::map<int, uint64_t>
+read_probe_log(const std::string& filename, const std::string& spec, uint64_t start, uint64_t stride)
+{
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp)
     {
-      std::cout << "Usage: send [EP] [DATA]..." << std::endl;
+      throw std::runtime_error(fmt::format("Couldn't open {}: {}", filename, strerror(errno)));
+    }
+
+  ProbeLogHeader header;
+  std::string file_spec;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, probe_log_magic, sizeof(header.magic)) != 0 ||
+      header.version != probe_log_version)
+    {
+      fclose(fp);
+      throw std::runtime_error(fmt::format("{} isn't a probe log", filename));
+    }
+
+  file_spec.resize(header.spec_len);
+  if (fread(&file_spec[0], 1, file_spec.size(), fp) != file_spec.size() || file_spec != spec)
+    {
+      fclose(fp);
+      throw std::runtime_error(fmt::format("{} was written by a different probe: {}", filename, file_spec));
+    }
+
+  long end = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  long const size = ftell(fp);
+  fseek(fp, end, SEEK_SET);
+
+  // per lane the next position the run needs and the positions logged
+  // ahead of it, which only pile up while requests complete out of order
+  std::map<int, uint64_t> next;
+  std::map<int, std::set<uint64_t>> ahead;
+  ProbeRecord record;
+  while (end + long(sizeof(record)) <= size &&
+         fread(&record, sizeof(record), 1, fp) == 1 &&
+         end + long(sizeof(record) + record.length) <= size)
+    {
+      end += long(sizeof(record) + record.length);
+      fseek(fp, end, SEEK_SET);
+
+      if (record.type == PROBE_RECORD_REQUEST && !probe_stops_lane(record.endpoint, record.status))
+        {
+          uint64_t& lane_next = next.try_emplace(record.lane, start + record.lane).first->second;
+          std::set<uint64_t>& lane_ahead = ahead[record.lane];
+          if (record.position == lane_next)
+            {
+              lane_next += stride;
+              while (!lane_ahead.empty() && *lane_ahead.begin() == lane_next)
+                {
+                  lane_ahead.erase(lane_ahead.begin());
+                  lane_next += stride;
+                }
+            }
+          else if (record.position > lane_next)
+            {
+              lane_ahead.insert(record.position);
+            }
+        }
+    }
+  fclose(fp);
+
+  if (end != size && truncate(filename.c_str(), end) != 0)
+    {
+      throw std::runtime_error(fmt::format("Couldn't truncate {}: {}", filename, strerror(errno)));
+    }
+
+  std::map<int, uint64_t> positions;
+  for(std::map<int, uint64_t>::const_iterator it = next.begin(); it != next.end(); ++it)
+    {
+      if (it->second != start + it->first)
+        positions[it->first] = it->second - stride;
+    }
+  return positions;
+}
+
+struct ProbeOptions
+{
+  bool control = false;
+  int endpoint = 0;
+  int depth = 16;
+  int length = 64;
+  int devices = 1;
+  int shard = 0;
+  int shards = 1;
+  uint64_t start = 0;
+  uint64_t count = 0;
+  std::vector<int> listen;
+  std::string log;
+  bool resume = false;
+};
+
+/** Runs a probe with options.depth requests in flight per device. The
+    positions are split into lanes, one per device and shard, lane n
+    takes every lanes-th position starting at start + n. A resumed
+    lane continues after the unbroken run of positions it has logged.
+    All methods except wait() run their work on the event thread. */
+class ProbeExecutor
+{
+private:
+  struct Lane;
+
+  struct Slot
+  {
+    ProbeExecutor* executor;
+    Lane* lane;
+    libusb_transfer* transfer;
+    std::vector<uint8_t> buffer;
+    uint64_t position;
+    bool in_flight;
+  };
+
+  struct Lane
+  {
+    USBDevice* device;
+    int index;
+    uint64_t next;
+    uint64_t last_completed;
+    bool stopped;
+    bool failed;
+    std::vector<std::unique_ptr<Slot>> slots;
+  };
+
+  EventThread& event_thread;
+  const ProbeSpace& space;
+  const ProbeOptions& options;
+  OutputWriter& output;
+  OutputWriter* log;
+
+  int endpoint_type;
+  size_t control_data_len;
+  uint64_t end;
+  uint64_t stride;
+  std::vector<std::unique_ptr<Lane>> lanes;
+  std::vector<int> values;
+  std::chrono::steady_clock::time_point start_time;
+  guint resume_source;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool finished;
+
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> responses;
+  std::atomic<uint64_t> errors;
+
+public:
+  /** resume holds the last position done by each lane */
+  ProbeExecutor(EventThread& event_thread_, const ProbeSpace& space_, const ProbeOptions& options_,
+                const std::vector<USBDevice*>& devices, const std::map<int, uint64_t>& resume,
+                OutputWriter& output_, OutputWriter* log_)
+    : event_thread(event_thread_),
+      space(space_),
+      options(options_),
+      output(output_),
+      log(log_),
+      endpoint_type(LIBUSB_TRANSFER_TYPE_INTERRUPT),
+      control_data_len(0),
+      end(),
+      stride(uint64_t(options.shards) * devices.size()),
+      lanes(),
+      values(),
+      start_time(),
+      resume_source(0),
+      mutex(),
+      cond(),
+      finished(false),
+      requests(0),
+      responses(0),
+      errors(0)
+  {
+    uint64_t const size = space.size();
+    end = (options.count == 0 || options.count > size - std::min(size, options.start)) ?
+      size : options.start + options.count;
+
+    int interface;
+    if (!options.control)
+      devices.front()->find_endpoint(options.endpoint | LIBUSB_ENDPOINT_OUT, interface, endpoint_type);
+
+    space.get(0, values);
+    control_data_len = options.control ? values.size() - 4 : 0;
+    size_t const buffer_size = options.control ?
+      LIBUSB_CONTROL_SETUP_SIZE + std::max<size_t>(options.length, control_data_len) :
+      values.size();
+
+    for(size_t i = 0; i < devices.size(); ++i)
+      {
+        std::unique_ptr<Lane> lane(new Lane);
+        lane->device = devices[i];
+        lane->index = options.shard * int(devices.size()) + int(i);
+        lane->next = options.start + lane->index;
+        lane->last_completed = probe_no_position;
+        lane->stopped = false;
+        lane->failed = false;
+
+        std::map<int, uint64_t>::const_iterator it = resume.find(lane->index);
+        if (it != resume.end())
+          lane->next = it->second + stride;
+
+        for(int j = 0; j < options.depth; ++j)
+          {
+            std::unique_ptr<Slot> slot(new Slot);
+            slot->executor = this;
+            slot->lane = lane.get();
+            slot->transfer = libusb_alloc_transfer(0);
+            slot->buffer.resize(buffer_size);
+            slot->position = 0;
+            slot->in_flight = false;
+            lane->slots.push_back(std::move(slot));
+          }
+
+        lanes.push_back(std::move(lane));
+      }
+  }
+
+  ~ProbeExecutor()
+  {
+    for(auto& lane : lanes)
+      for(auto& slot : lane->slots)
+        libusb_free_transfer(slot->transfer);
+  }
+
+  void start()
+  {
+    event_thread.call([this]{
+        start_time = std::chrono::steady_clock::now();
+        uint64_t const wall_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+
+        for(auto& lane : lanes)
+          {
+            Lane* l = lane.get();
+            l->device->set_response_callback([this, l](int endpoint, unsebu::USBReadRecord const& record) {
+                on_response(*l, endpoint, record);
+              });
+
+            if (log)
+              write_record(PROBE_RECORD_START, *l, 0, 0, l->next, wall_time, nullptr, 0);
+          }
+
+        for(auto& lane : lanes)
+          fill(*lane);
+        check_finished();
+      });
+  }
+
+  /** Cancel the requests in flight, wait() returns once they are gone */
+  void stop()
+  {
+    event_thread.call([this]{
+        if (resume_source)
+          {
+            g_source_remove(resume_source);
+            resume_source = 0;
+          }
+
+        for(auto& lane : lanes)
+          {
+            lane->stopped = true;
+            for(auto& slot : lane->slots)
+              if (slot->in_flight)
+                libusb_cancel_transfer(slot->transfer);
+          }
+        check_finished();
+      });
+  }
+
+  /** Detach from the devices, listener output gets printed again */
+  void finish()
+  {
+    event_thread.call([this]{
+        for(auto& lane : lanes)
+          lane->device->set_response_callback(nullptr);
+      });
+  }
+
+  /** Wait up to timeout for the probe to finish, true if it did */
+  bool wait(std::chrono::milliseconds timeout)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    return cond.wait_for(lock, timeout, [this]{ return finished; });
+  }
+
+  /** Positions a lane didn't get to, only valid once finished */
+  uint64_t get_remaining() const
+  {
+    uint64_t result = 0;
+    for(auto const& lane : lanes)
+      if (lane->next < end)
+        result += (end - lane->next + stride - 1) / stride;
+    return result;
+  }
+
+  uint64_t get_requests() const { return requests; }
+  uint64_t get_responses() const { return responses; }
+  uint64_t get_errors() const { return errors; }
+
+private:
+  uint64_t now() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+  }
+
+  void fill(Lane& lane)
+  {
+    for(auto& slot : lane.slots)
+      {
+        if (lane.stopped || lane.next >= end)
+          return;
+
+        if (slot->in_flight)
+          continue;
+
+        if (log && log->get_pending() > probe_log_max_pending)
+          {
+            // let the log catch up instead of blocking the event thread
+            if (!resume_source)
+              resume_source = g_timeout_add(10, &ProbeExecutor::on_resume, this);
+            return;
+          }
+
+        slot->position = lane.next;
+        prepare(*slot);
+
+        int ret = libusb_submit_transfer(slot->transfer);
+        if (ret != LIBUSB_SUCCESS)
+          {
+            output.write(fmt::format("Lane {} stopped at position {}, submitting failed: {}\n",
+                                     lane.index, lane.next, libusb_strerror(static_cast<libusb_error>(ret))));
+            lane.stopped = true;
+            return;
+          }
+
+        slot->in_flight = true;
+        lane.next += stride;
+      }
+  }
+
+  void prepare(Slot& slot)
+  {
+    space.get(slot.position, values);
+    libusb_device_handle* handle = slot.lane->device->get_handle();
+
+    if (options.control)
+      {
+        size_t const data_len = control_data_len;
+        uint16_t const length = (values[0] & LIBUSB_ENDPOINT_IN) ? uint16_t(options.length) : uint16_t(data_len);
+        libusb_fill_control_setup(slot.buffer.data(),
+                                  uint8_t(values[0]), uint8_t(values[1]),
+                                  uint16_t(values[2]), uint16_t(values[3]), length);
+        for(size_t i = 0; i < data_len; ++i)
+          slot.buffer[LIBUSB_CONTROL_SETUP_SIZE + i] = uint8_t(values[4 + i]);
+
+        libusb_fill_control_transfer(slot.transfer, handle, slot.buffer.data(),
+                                     &ProbeExecutor::on_transfer, &slot, probe_timeout);
+      }
+    else
+      {
+        for(size_t i = 0; i < values.size(); ++i)
+          slot.buffer[i] = uint8_t(values[i]);
+
+        libusb_fill_bulk_transfer(slot.transfer, handle, static_cast<unsigned char>(options.endpoint),
+                                  slot.buffer.data(), int(values.size()),
+                                  &ProbeExecutor::on_transfer, &slot, probe_timeout);
+        slot.transfer->type = static_cast<unsigned char>(endpoint_type);
+      }
+  }
+
+  static void on_transfer(libusb_transfer* transfer)
+  {
+    Slot* slot = static_cast<Slot*>(transfer->user_data);
+    slot->executor->on_complete(*slot);
+  }
+
+  static gboolean on_resume(gpointer userdata)
+  {
+    ProbeExecutor* executor = static_cast<ProbeExecutor*>(userdata);
+    executor->resume_source = 0;
+    for(auto& lane : executor->lanes)
+      executor->fill(*lane);
+    executor->check_finished();
+    return FALSE;
+  }
+
+  void on_complete(Slot& slot)
+  {
+    Lane& lane = *slot.lane;
+    libusb_transfer* transfer = slot.transfer;
+    slot.in_flight = false;
+
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+      {
+        lane.next = std::min(lane.next, slot.position);
+      }
+    // requests after the one that failed the lane only fail the same way
+    else if (!lane.failed)
+      {
+        requests += 1;
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+          errors += 1;
+
+        lane.last_completed = slot.position;
+        record_request(slot);
+
+        int const endpoint = options.control ? 0 : options.endpoint;
+        if (probe_stops_lane(endpoint, transfer->status))
+          {
+            output.write(fmt::format("Lane {} stopped at position {}, transfer status {}\n",
+                                     lane.index, slot.position, transfer->status));
+            lane.stopped = true;
+            lane.failed = true;
+            lane.next = slot.position;
+          }
+      }
+
+    fill(lane);
+    check_finished();
+  }
+
+  void record_request(Slot& slot)
+  {
+    libusb_transfer* transfer = slot.transfer;
+    bool const has_data = (options.control && (slot.buffer[0] & LIBUSB_ENDPOINT_IN));
+    uint8_t const* data = has_data ? libusb_control_transfer_get_data(transfer) : nullptr;
+    int const len = has_data ? transfer->actual_length : 0;
+
+    if (log)
+      {
+        write_record(PROBE_RECORD_REQUEST, *slot.lane, options.control ? 0 : options.endpoint,
+                     transfer->status, slot.position, now(), data, len);
+      }
+    else if (options.control)
+      {
+        uint8_t const* setup = slot.buffer.data();
+        std::string const request = fmt::format("Ctrl: {:02x} {:02x} {:04x} {:04x}",
+                                                setup[0], setup[1],
+                                                setup[2] | (setup[3] << 8), setup[4] | (setup[5] << 8));
+        if (has_data)
+          output.write(fmt::format("{} -> status {} {}\n", request, transfer->status, raw_data_to_string(data, len)));
+        else
+          output.write(fmt::format("{}: {} -> status {}\n", request,
+                                   raw_data_to_string(setup + LIBUSB_CONTROL_SETUP_SIZE, int(control_data_len)),
+                                   transfer->status));
+      }
+    else
+      {
+        output.write(fmt::format("Data Ep: {}: {} -> status {}\n",
+                                 options.endpoint, raw_data_to_string(slot.buffer.data(), transfer->length),
+                                 transfer->status));
+      }
+  }
+
+  void on_response(Lane& lane, int endpoint, unsebu::USBReadRecord const& record)
+  {
+    responses += 1;
+
+    if (log)
+      {
+        write_record(PROBE_RECORD_RESPONSE, lane, endpoint | LIBUSB_ENDPOINT_IN, record.status,
+                     lane.last_completed, now(), record.data, record.len);
+      }
+    else
+      {
+        output.write(fmt::format(">>> Ep{}: {} (after {})\n",
+                                 endpoint, raw_data_to_string(record.data, record.len),
+                                 lane.last_completed));
+      }
+  }
+
+  void write_record(int type, Lane& lane, int endpoint, int status,
+                    uint64_t position, uint64_t timestamp, uint8_t const* data, int len)
+  {
+    ProbeRecord record;
+    record.type = uint8_t(type);
+    record.lane = uint8_t(lane.index);
+    record.endpoint = uint8_t(endpoint);
+    record.status = uint8_t(status);
+    record.length = uint32_t(len);
+    record.position = position;
+    record.timestamp = timestamp;
+
+    std::string buffer(reinterpret_cast<char const*>(&record), sizeof(record));
+    buffer.append(reinterpret_cast<char const*>(data), len);
+    log->write(buffer);
+  }
+
+  void check_finished()
+  {
+    for(auto const& lane : lanes)
+      {
+        if (!lane->stopped && lane->next < end)
+          return;
+        for(auto const& slot : lane->slots)
+          if (slot->in_flight)
+            return;
+      }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    cond.notify_all();
+  }
+
+private:
+  ProbeExecutor(const ProbeExecutor&);
+  ProbeExecutor& operator=(const ProbeExecutor&);
+};
+
+/** Open up to count more devices with the same idVendor and idProduct */
+std::vector<std::unique_ptr<USBDevice>>
+open_identical_devices(USBDevice& device, int count)
+{
+  std::vector<std::unique_ptr<USBDevice>> result;
+  if (count <= 0)
+    return result;
+
+  libusb_device_descriptor desc;
+  libusb_get_device_descriptor(device.get_device(), &desc);
+
+  libusb_device** list;
+  ssize_t num_devices = libusb_get_device_list(NULL, &list);
+  try
+    {
+      for(ssize_t i = 0; i < num_devices && int(result.size()) < count; ++i)
+        {
+          libusb_device_descriptor other;
+          if (list[i] != device.get_device() &&
+              libusb_get_device_descriptor(list[i], &other) == LIBUSB_SUCCESS &&
+              other.idVendor == desc.idVendor &&
+              other.idProduct == desc.idProduct)
+            {
+              result.emplace_back(new USBDevice(list[i], device.get_event_thread(), device.get_output()));
+            }
+        }
     }
+  catch(...)
+    {
+      libusb_free_device_list(list, 1);
+      throw;
+    }
+  libusb_free_device_list(list, 1);
+
+  if (int(result.size()) < count)
+    {
+      throw std::runtime_error(fmt::format("Only {} identical devices found", result.size() + 1));
+    }
+
+  return result;
+}
+
+void print_probe_usage(const std::string& cmd)
+{
+  if (cmd == "ctrlprobe")
+    std::cout << "Usage: ctrlprobe [OPTION]... REQUESTTYPE REQUEST VALUE INDEX [DATA]..." << std::endl;
   else
+    std::cout << "Usage: probe [OPTION]... ENDPOINT [DATA]..." << std::endl;
+}
+
+void console_probe_cmd(const std::vector<std::string>& args)
+{
+  ProbeOptions options;
+  options.control = (args[0] == "ctrlprobe");
+
+  std::vector<std::string> rest;
+  for(size_t i = 1; i < args.size(); ++i)
+    {
+      if (!has_prefix(args[i], "--"))
+        {
+          rest.push_back(args[i]);
+        }
+      else if (args[i] == "--resume")
+        {
+          options.resume = true;
+        }
+      else if (i + 1 >= args.size())
+        {
+          std::cout << "Error: " << args[i] << " requires an argument" << std::endl;
+          return;
+        }
+      else if (args[i] == "--depth")
+        {
+          options.depth = atoi(args[++i].c_str());
+        }
+      else if (args[i] == "--length")
+        {
+          options.length = atoi(args[++i].c_str());
+        }
+      else if (args[i] == "--devices")
+        {
+          options.devices = atoi(args[++i].c_str());
+        }
+      else if (args[i] == "--shard")
+        {
+          if (sscanf(args[++i].c_str(), "%d/%d", &options.shard, &options.shards) != 2)
+            {
+              std::cout << "Error: --shard expects K/N" << std::endl;
+              return;
+            }
+        }
+      else if (args[i] == "--start")
+        {
+          options.start = strtoull(args[++i].c_str(), NULL, 10);
+        }
+      else if (args[i] == "--count")
+        {
+          options.count = strtoull(args[++i].c_str(), NULL, 10);
+        }
+      else if (args[i] == "--listen")
+        {
+          options.listen.push_back(atoi(args[++i].c_str()));
+        }
+      else if (args[i] == "--log")
+        {
+          options.log = args[++i];
+        }
+      else
+        {
+          std::cout << "Error: Unknown option " << args[i] << std::endl;
+          return;
+        }
+    }
+
+  if (rest.size() < (options.control ? 4u : 2u))
+    {
+      print_probe_usage(args[0]);
+      return;
+    }
+
+  if (options.depth < 1 || options.devices < 1 || options.shards < 1 ||
+      options.shard < 0 || options.shard >= options.shards ||
+      options.shards * options.devices > 256 ||
+      options.length < 0 || options.length > 4096 ||
+      (options.resume && options.log.empty()))
+    {
+      std::cout << "Error: Invalid probe options" << std::endl;
+      return;
+    }
+
+  try
     {
-      std::vector<uint8_t> data;
       std::vector<SequenceGenerator> sequences;
+      if (!options.control)
+        {
+          options.endpoint = atoi(rest[0].c_str());
+          rest.erase(rest.begin());
+        }
+      for(size_t i = 0; i < rest.size(); ++i)
+        {
+          sequences.push_back(SequenceGenerator(rest[i]));
+        }
 
-      int endpoint = atoi(args[1].c_str());
-      for(int i = 2; i < int(args.size()); ++i)
+      ProbeSpace space(sequences);
+      std::string spec = fmt::format("{} {} {} start {} count {} lanes {} shard {}/{}",
+                                     options.control ? "ctrl" : "ep",
+                                     options.control ? options.length : options.endpoint,
+                                     space.to_string(), options.start, options.count,
+                                     options.devices * options.shards, options.shard, options.shards);
+      std::cout << spec << ", " << space.size() << " combinations" << std::endl;
+
+      USBDevice* device = USBDevice::current();
+      std::vector<std::unique_ptr<USBDevice>> extra = open_identical_devices(*device, options.devices - 1);
+      std::vector<USBDevice*> devices(1, device);
+      for(size_t i = 0; i < extra.size(); ++i)
+        devices.push_back(extra[i].get());
+
+      for(size_t i = 0; i < devices.size(); ++i)
         {
-          SequenceGenerator gen(args[i]);
-          sequences.push_back(gen);
-          std::cout << gen.to_string() << std::endl;
+          if (!options.control)
+            {
+              int interface;
+              int type;
+              devices[i]->find_endpoint(options.endpoint | LIBUSB_ENDPOINT_OUT, interface, type);
+              devices[i]->claim_interface(interface);
+            }
+
+          for(size_t j = 0; j < options.listen.size(); ++j)
+            {
+              if (!devices[i]->is_listening(options.listen[j]))
+                devices[i]->listen(options.listen[j]);
+            }
         }
 
-      data.resize(sequences.size());
-      while(!eol(sequences) && !global_interrupt)
+      std::map<int, uint64_t> resume;
+      int fd = -1;
+      if (!options.log.empty())
         {
-          for(int i = 0; i < int(sequences.size()); ++i)
-            data[i] = sequences[i].get();
+          if (options.resume)
+            {
+              resume = read_probe_log(options.log, spec, options.start,
+                                      uint64_t(options.devices) * options.shards);
+              fd = open(options.log.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            }
+          else
+            {
+              fd = open(options.log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+              if (fd >= 0)
+                {
+                  ProbeLogHeader header;
+                  memcpy(header.magic, probe_log_magic, sizeof(header.magic));
+                  header.version = probe_log_version;
+                  header.spec_len = uint32_t(spec.size());
+
+                  std::string buffer(reinterpret_cast<char const*>(&header), sizeof(header));
+                  buffer += spec;
+                  if (write(fd, buffer.data(), buffer.size()) != ssize_t(buffer.size()))
+                    {
+                      close(fd);
+                      fd = -1;
+                    }
+                }
+            }
+
+          if (fd < 0)
+            {
+              throw std::runtime_error(fmt::format("Couldn't write {}: {}", options.log, strerror(errno)));
+            }
+        }
+
+      // the log never drops, the executor throttles instead
+      std::unique_ptr<OutputWriter> log(fd >= 0 ? new OutputWriter(fd, SIZE_MAX) : nullptr);
 
-          std::cout << "Data Ep: " << endpoint << ": ";
-          print_raw_data(std::cout, &*data.begin(), data.size());
-          int ret = USBDevice::current()->write(endpoint, &*data.begin(), data.size());
-          std::cout << " -> " << ret;
-          std::cout << std::endl;
+      {
+        ProbeExecutor executor(device->get_event_thread(), space, options, devices, resume,
+                               device->get_output(), log.get());
+        executor.start();
+
+        uint64_t last_requests = 0;
+        std::chrono::steady_clock::time_point last_status = std::chrono::steady_clock::now();
+        bool stopping = false;
+        while (!executor.wait(std::chrono::milliseconds(100)))
+          {
+            if (global_interrupt && !stopping)
+              {
+                executor.stop();
+                stopping = true;
+              }
+
+            if (log && log->has_failed() && !stopping)
+              {
+                std::cout << "Error: Writing " << options.log << " failed" << std::endl;
+                executor.stop();
+                stopping = true;
+              }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (log && now - last_status >= std::chrono::seconds(1))
+              {
+                uint64_t const requests = executor.get_requests();
+                std::cout << fmt::format("{} requests/s, {} requests, {} responses, {} errors",
+                                         requests - last_requests, requests,
+                                         executor.get_responses(), executor.get_errors())
+                          << std::endl;
+                last_requests = requests;
+                last_status = now;
+              }
+          }
+        executor.finish();
 
-          next(sequences);
+        std::cout << fmt::format("{} requests, {} responses, {} errors, {} positions left",
+                                 executor.get_requests(), executor.get_responses(),
+                                 executor.get_errors(), executor.get_remaining())
+                  << std::endl;
+        if (log && executor.get_remaining() > 0)
+          {
+            std::cout << "Add --resume to continue where the probe stopped" << std::endl;
+          }
+      }
 
-          //usleep(100 * 1000);
-          usleep(10 * 1000);
+      if (log)
+        {
+          bool const failed = log->has_failed();
+          log.reset();
+          close(fd);
+          if (failed)
+            std::cout << "Error: Writing " << options.log << " failed, the log is incomplete" << std::endl;
         }
     }
+  catch(std::exception& err)
+    {
+      std::cout << "Error: " << err.what() << std::endl;
+    }
 }
 
 void console_wait_cmd(const std::vector<std::string>& args)
@@ -683,7 +1961,10 @@ void console_ctrlreq_cmd(const std::vector<std::string>& args)
                                                value, index,
                                                data,
                                                len);
-      std::cout << " -> " << ret << " '" << strerror(-ret) << "'" << std::endl;
+      std::cout << " -> " << ret;
+      if (ret < 0)
+        std::cout << " '" << libusb_error_name(ret) << "'";
+      std::cout << std::endl;
 
       if (!data)
         std::cout << "no data";
@@ -710,13 +1991,13 @@ void console_setconfiguration_cmd(const std::vector<std::string>& args)
 
 void console_setaltinterface_cmd(const std::vector<std::string>& args)
 {
-  if (args.size() != 2)
+  if (args.size() != 3)
     {
-      std::cout << "Usage: " << args[0] << " INTERFACE" << std::endl;
+      std::cout << "Usage: " << args[0] << " INTERFACE ALTSETTING" << std::endl;
     }
   else
     {
-      USBDevice::current()->set_altinterface(atoi(args[1].c_str()));
+      USBDevice::current()->set_altinterface(atoi(args[1].c_str()), atoi(args[2].c_str()));
     }
 }
 
@@ -732,7 +2013,7 @@ void console_reset_ep_cmd(const std::vector<std::string>& args)
     }
 }
 
-void console_reset_cmd(const std::vector<std::string>& args)
+void console_reset_cmd(const std::vector<std::string>& /*args*/)
 {
   USBDevice::current()->reset();
 }
@@ -768,7 +2049,10 @@ void console_ctrl_cmd(const std::vector<std::string>& args)
                                                value, index,
                                                data.empty() ? NULL : &*data.begin(),
                                                data.size());
-      std::cout << " -> " << ret << " '" << strerror(-ret) << "'" << std::endl;
+      std::cout << " -> " << ret;
+      if (ret < 0)
+        std::cout << " '" << libusb_error_name(ret) << "'";
+      std::cout << std::endl;
     }
 }
 
@@ -805,14 +2089,32 @@ void dispatch_command(const std::vector<std::string>& args)
       std::cout << "claim [INTERFACE]...\n   Claim the given interfaces\n" << std::endl;
       std::cout << "release [INTERFACE]...\n   Release the given interfaces\n" << std::endl;
       std::cout << "detach [INTERFACE]...\n   Detach kernel driver from interfaces\n" << std::endl;
-      std::cout << "listen [ENDPOINT]...\n   On the given endpoints\n" << std::endl;
+      std::cout << "listen [ENDPOINT]...\n   Print the data arriving on the given endpoints\n" << std::endl;
+      std::cout << "unlisten [ENDPOINT]...\n   Stop listening on the given endpoints\n" << std::endl;
       std::cout << "info\n   Print some info on the current device\n" << std::endl;
       std::cout << "send [ENDPOINT] [DATA]...\n   Send data to an USB Endpoint\n" << std::endl;
+      std::cout << "probe [OPTION]... ENDPOINT [SEQUENCE]...\n"
+                << "ctrlprobe [OPTION]... REQUESTTYPE REQUEST VALUE INDEX [SEQUENCE]...\n"
+                << "   Send every combination of the sequences, e.g. 0-ff,100, with several\n"
+                << "   requests in flight. Responses on listened endpoints are paired with\n"
+                << "   the request that completed last, use --depth 1 for exact pairing.\n"
+                << "   --depth N      Requests in flight per device (default: 16)\n"
+                << "   --listen EP    Listen on EP and pair its data with the requests\n"
+                << "   --log FILE     Write requests and responses to the binary FILE\n"
+                << "   --resume       Continue the probe logged in FILE\n"
+                << "   --start POS    First position, --count N positions\n"
+                << "   --devices N    Split the positions across N identical devices\n"
+                << "   --shard K/N    Only run the K-th of N parts, for several processes\n"
+                << "   --length N     Bytes to read for device-to-host control requests\n" << std::endl;
     }
   else if (args[0] == "listen")
     {
       console_listen_cmd(args);
     }
+  else if (args[0] == "unlisten")
+    {
+      console_unlisten_cmd(args);
+    }
   else if (args[0] == "info")
     {
       console_info_cmd(args);
@@ -825,7 +2127,7 @@ void dispatch_command(const std::vector<std::string>& args)
     {
       console_release_cmd(args);
     }
-  else if (args[0] == "probe")
+  else if (args[0] == "probe" || args[0] == "ctrlprobe")
     {
       console_probe_cmd(args);
     }
@@ -930,27 +2232,35 @@ int main(int argc, char** argv)
     }
   else
     {
-      usb_init();
-      usb_find_busses();
-      usb_find_devices();
-
       uint16_t idVendor;
       uint16_t idProduct;
       if (sscanf(argv[1], "%hx:%hx", &idVendor, &idProduct) == 2)
         {
-          struct usb_device* dev = find_usb_device(idVendor, idProduct);
-
-          if (dev)
+          try
             {
-              std::cout << boost::format("Opening device with idVendor: 0x%h04x, idProduct: 0x%h04x") % idVendor % idProduct << std::endl;
-              USBDevice* usbdev = new USBDevice(dev);
-              signal(SIGINT, signal_callback);
-              run_console();
-              delete usbdev;
+              unsebu::USBSubsystem usb_subsystem;
+              OutputWriter output;
+              EventThread event_thread;
+              libusb_device* dev = unsebu::usb_find_device_by_id(idVendor, idProduct);
+
+              if (dev)
+                {
+                  std::cout << fmt::format("Opening device with idVendor: 0x{:04x}, idProduct: 0x{:04x}", idVendor, idProduct) << std::endl;
+                  USBDevice* usbdev = new USBDevice(dev, event_thread, output);
+                  libusb_unref_device(dev);
+                  signal(SIGINT, signal_callback);
+                  run_console();
+                  delete usbdev;
+                }
+              else
+                {
+                  std::cout << "Couldn't device with " << argv[1] << std::endl;
+                }
             }
-          else
+          catch(std::exception const& err)
             {
-              std::cout << "Couldn't device with " << argv[1] << std::endl;
+              std::cout << "Error: " << err.what() << std::endl;
+              return EXIT_FAILURE;
             }
         }
       else
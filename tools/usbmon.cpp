@@ -0,0 +1,221 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "usb_mon_reader.hpp"
+#include "usb_pcapng_writer.hpp"
+
+using namespace unsebu;
+
+namespace {
+
+volatile sig_atomic_t g_quit = 0;
+
+struct Options
+{
+  int bus = 0;
+  size_t ring_size = 0;
+  USBMonFilter filter;
+  std::string fixture;
+  std::string filename;
+};
+
+uint64_t get_timestamp(USBMonHeader const& header)
+{
+  return static_cast<uint64_t>(header.ts_sec) * 1000000000ull +
+    static_cast<uint64_t>(header.ts_usec) * 1000ull;
+}
+
+/** Replay a recorded ring through the same fetch and flush cycle as
+    a live capture */
+int
+capture_fixture(Options const& opts, USBPcapngWriter& writer)
+{
+  USBMonReader reader(opts.fixture);
+  reader.set_filter(opts.filter);
+
+  size_t count = 0;
+  while (!reader.is_exhausted())
+    {
+      count += reader.fetch(0, [&writer](USBMonHeader const& header, uint8_t const* payload) {
+          writer.write_packet(header, payload, get_timestamp(header));
+        });
+    }
+
+  std::cerr << fmt::format("{} packets from {}", count, opts.fixture) << std::endl;
+  return EXIT_SUCCESS;
+}
+
+int
+capture_usbmon(Options const& opts, USBPcapngWriter& writer)
+{
+  USBMonReader reader(opts.bus, opts.ring_size);
+  reader.set_filter(opts.filter);
+
+  std::cerr << fmt::format("Capturing from /dev/usbmon{}, {} byte ring", opts.bus, reader.get_ring_size()) << std::endl;
+
+  auto on_packet = [&writer](USBMonHeader const& header, uint8_t const* data) {
+    writer.write_packet(header, data, get_timestamp(header));
+  };
+
+  auto last_status = std::chrono::steady_clock::now();
+  uint64_t last_packets = 0;
+  while (!g_quit)
+    {
+      reader.fetch(250, on_packet);
+
+      auto const now = std::chrono::steady_clock::now();
+      if (now - last_status >= std::chrono::seconds(1))
+        {
+          writer.flush();
+
+          uint64_t const packets = writer.get_packet_count();
+          std::cerr << fmt::format("{} packets/s, {} packets, {} dropped by the kernel, {} dropped",
+                                   packets - last_packets, packets,
+                                   reader.get_kernel_dropped(), writer.get_dropped_count())
+                    << std::endl;
+          last_status = now;
+          last_packets = packets;
+        }
+    }
+
+  return (reader.get_kernel_dropped() > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void
+print_usage(char const* program)
+{
+  std::cout << "Usage: " << program << " [OPTION]... FILE\n"
+            << "Capture USB traffic from usbmon into the pcapng FILE without claiming\n"
+            << "any interfaces, until interrupted.\n"
+            << "\n"
+            << "Options:\n"
+            << "  --bus N          Bus to capture, 0 for all buses (default: 0)\n"
+            << "  --device N       Only capture the device with address N, needs --bus\n"
+            << "  --endpoint N     Only capture endpoint number N\n"
+            << "  --ring-size N    Size of the kernel ring buffer in bytes\n"
+            << "  --fixture FILE   Replay a recorded ring image and its event offsets\n"
+            << "                   instead of reading /dev/usbmonN"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Options opts;
+
+  for(int i = 1; i < argc; ++i)
+    {
+      if (strncmp(argv[i], "--", 2) == 0)
+        {
+          if (i + 1 >= argc)
+            {
+              std::cerr << "Error: " << argv[i] << " requires an argument" << std::endl;
+              return EXIT_FAILURE;
+            }
+
+          if (strcmp(argv[i], "--bus") == 0)
+            {
+              opts.bus = atoi(argv[++i]);
+            }
+          else if (strcmp(argv[i], "--device") == 0)
+            {
+              opts.filter.devnum = atoi(argv[++i]);
+            }
+          else if (strcmp(argv[i], "--endpoint") == 0)
+            {
+              opts.filter.endpoint = atoi(argv[++i]);
+            }
+          else if (strcmp(argv[i], "--ring-size") == 0)
+            {
+              opts.ring_size = strtoul(argv[++i], nullptr, 0);
+            }
+          else if (strcmp(argv[i], "--fixture") == 0)
+            {
+              opts.fixture = argv[++i];
+            }
+          else
+            {
+              std::cerr << "Error: Unknown option " << argv[i] << std::endl;
+              return EXIT_FAILURE;
+            }
+        }
+      else if (opts.filename.empty())
+        {
+          opts.filename = argv[i];
+        }
+      else
+        {
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (opts.filename.empty())
+    {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  // device addresses are only unique within a bus
+  if (opts.filter.devnum >= 0 && opts.bus == 0)
+    {
+      std::cerr << "Error: --device requires --bus" << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (opts.bus != 0)
+    {
+      opts.filter.busnum = opts.bus;
+    }
+
+  // no SA_RESTART, so a waiting fetch returns right away
+  struct sigaction sa = {};
+  sa.sa_handler = [](int) { g_quit = 1; };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  try
+    {
+      USBPcapngWriter writer(opts.filename);
+
+      int const result = opts.fixture.empty() ?
+        capture_usbmon(opts, writer) :
+        capture_fixture(opts, writer);
+
+      std::cerr << fmt::format("{} packets written to {}, {} dropped",
+                               writer.get_packet_count(), opts.filename, writer.get_dropped_count())
+                << std::endl;
+      return (writer.get_dropped_count() > 0) ? EXIT_FAILURE : result;
+    }
+  catch(std::exception const& err)
+    {
+      std::cerr << "Error: " << err.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+}
+
+/* EOF */
@@ -1,58 +1,333 @@
+// unsebu - libusb helper for C++
+// Copyright (C) 2020 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-int main(int argc, char** argv)
+#include <glib.h>
+#include <glib-unix.h>
+#include <libusb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "usb_device.hpp"
+#include "usb_helper.hpp"
+#include "usb_interface.hpp"
+#include "usb_pcapng_writer.hpp"
+#include "usb_subsystem.hpp"
+
+using namespace unsebu;
+
+namespace {
+
+/** Transfers kept in flight per endpoint */
+int const read_depth = 8;
+
+/** Bulk reads get more than a packet per transfer */
+int const bulk_read_size = 16 * 1024;
+
+struct Capture
 {
-  srand(time(NULL));
+  USBPcapngWriter* writer;
+  uint64_t last_packets;
+};
 
-  if (argc == 2 && strcmp("list", argv[1]) == 0)
+/** The IN endpoints of the interface, all of them when endpoints is
+    empty, with the transfer size to use for each */
+std::vector<std::pair<int, int>>
+get_read_endpoints(USBDevice& device, int interface, std::vector<int> const& endpoints)
+{
+  std::vector<std::pair<int, int>> result;
+
+  libusb_config_descriptor const* config = device.get_config_descriptor();
+  if (!config)
+    {
+      return result;
+    }
+
+  for(int i = 0; i < config->bNumInterfaces; ++i)
+    {
+      libusb_interface_descriptor const& altsetting = config->interface[i].altsetting[0];
+      if (altsetting.bInterfaceNumber != interface)
+        {
+          continue;
+        }
+
+      for(int j = 0; j < altsetting.bNumEndpoints; ++j)
+        {
+          libusb_endpoint_descriptor const& ep = altsetting.endpoint[j];
+          int const type = ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+          if (!(ep.bEndpointAddress & LIBUSB_ENDPOINT_IN) ||
+              (type != LIBUSB_TRANSFER_TYPE_BULK && type != LIBUSB_TRANSFER_TYPE_INTERRUPT))
+            {
+              continue;
+            }
+
+          int const number = ep.bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK;
+          if (endpoints.empty() ||
+              std::find(endpoints.begin(), endpoints.end(), number) != endpoints.end())
+            {
+              result.emplace_back(number, (type == LIBUSB_TRANSFER_TYPE_BULK) ?
+                                  bulk_read_size : (ep.wMaxPacketSize & 0x7ff));
+            }
+        }
+    }
+
+  return result;
+}
+
+void
+list_usb_devices()
+{
+  libusb_device** list;
+  ssize_t const num_devices = libusb_get_device_list(nullptr, &list);
+
+  for(ssize_t i = 0; i < num_devices; ++i)
+    {
+      std::cout << fmt::format("Bus {:03d} Device {:03d}: {}",
+                               libusb_get_bus_number(list[i]),
+                               libusb_get_device_address(list[i]),
+                               usb_get_device_label(list[i]))
+                << std::endl;
+    }
+
+  libusb_free_device_list(list, 1);
+}
+
+int
+read_usb_device(char const* filename, uint16_t idVendor, uint16_t idProduct,
+                int interface, std::vector<int> const& endpoints)
+{
+  libusb_device* dev = usb_find_device_by_id(idVendor, idProduct);
+  if (!dev)
+    {
+      std::cerr << fmt::format("Error: Device (idVendor: 0x{:04x}, idProduct: 0x{:04x}) not found",
+                               idVendor, idProduct) << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  USBDevice device(dev);
+  libusb_unref_device(dev);
+
+  std::vector<std::pair<int, int>> const read_endpoints = get_read_endpoints(device, interface, endpoints);
+  if (read_endpoints.empty())
+    {
+      std::cerr << "Error: No matching IN endpoints on interface " << interface << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  std::unique_ptr<USBInterface> iface = device.claim_interface(interface, true);
+
+  GMainLoop* loop = g_main_loop_new(nullptr, FALSE);
+
+  std::shared_ptr<USBPcapngWriter> writer;
+  if (filename)
+    {
+      writer = std::make_shared<USBPcapngWriter>(filename);
+      iface->set_capture(writer);
+    }
+  else
+    {
+      // hex dumps go out once per event handling pass, not per packet
+      setvbuf(stdout, nullptr, _IOFBF, 256 * 1024);
+    }
+
+  for(auto const& endpoint : read_endpoints)
+    {
+      std::cerr << fmt::format("{}: reading endpoint {}, interface {}, {} bytes per transfer",
+                               usb_get_device_label(device.get_device()),
+                               endpoint.first, interface, endpoint.second)
+                << std::endl;
+
+      int const number = endpoint.first;
+      bool const capture = (writer != nullptr);
+      iface->submit_read_batched(number, endpoint.second, read_depth,
+                                 [number, capture](USBReadRecord const* records, size_t count) {
+                                   if (capture)
+                                     {
+                                       // the data already went to the capture on completion
+                                       return;
+                                     }
+
+                                   for(size_t i = 0; i < count; ++i)
+                                     {
+                                       if (records[i].status != LIBUSB_TRANSFER_COMPLETED)
+                                         {
+                                           fmt::print("ep: {} status: {}\n", number, records[i].status);
+                                           continue;
+                                         }
+
+                                       fmt::print("ep: {} len: {} data:", number, records[i].len);
+                                       for(int j = 0; j < records[i].len; ++j)
+                                         {
+                                           fmt::print(" 0x{:02x}", records[i].data[j]);
+                                         }
+                                       fmt::print("\n");
+                                     }
+                                   fflush(stdout);
+                                 });
+    }
+
+  iface->set_disconnect_callback([loop]{
+      std::cerr << "Device disconnected" << std::endl;
+      g_main_loop_quit(loop);
+    });
+
+  guint const sigint_id = g_unix_signal_add(SIGINT, [](gpointer data) -> gboolean {
+      g_main_loop_quit(static_cast<GMainLoop*>(data));
+      return TRUE;
+    }, loop);
+
+  Capture capture{writer.get(), 0};
+  guint status_id = 0;
+  if (writer)
+    {
+      status_id = g_timeout_add_seconds(1, [](gpointer data) -> gboolean {
+          Capture& capture_ = *static_cast<Capture*>(data);
+          capture_.writer->flush();
+
+          uint64_t const packets = capture_.writer->get_packet_count();
+          std::cerr << fmt::format("{} packets/s, {} packets, {} dropped",
+                                   packets - capture_.last_packets, packets,
+                                   capture_.writer->get_dropped_count())
+                    << std::endl;
+          capture_.last_packets = packets;
+          return TRUE;
+        }, &capture);
+    }
+
+  g_main_loop_run(loop);
+
+  if (status_id)
     {
-      usb_init();
-      usb_find_busses();
-      usb_find_devices();
+      g_source_remove(status_id);
+    }
+  g_source_remove(sigint_id);
+
+  // the cancelled transfers have to come back before the writer
+  // finishes and the handle gets closed
+  size_t pending = read_endpoints.size();
+  for(auto const& endpoint : read_endpoints)
+    {
+      iface->cancel_read(endpoint.first, [&pending, loop]{
+          pending -= 1;
+          if (pending == 0)
+            {
+              g_main_loop_quit(loop);
+            }
+        });
+    }
+  if (pending > 0)
+    {
+      g_main_loop_run(loop);
+    }
+  g_main_loop_unref(loop);
+
+  int result = EXIT_SUCCESS;
+  if (writer)
+    {
+      iface->set_capture(nullptr);
+      uint64_t const packets = writer->get_packet_count();
+      uint64_t const dropped = writer->get_dropped_count();
+
+      // waits for the writer thread to finish the file
+      writer.reset();
 
+      std::cerr << fmt::format("{} packets written to {}, {} dropped", packets, filename, dropped) << std::endl;
+      if (dropped > 0)
+        {
+          result = EXIT_FAILURE;
+        }
+    }
+
+  return result;
+}
+
+void
+print_usage(char const* program)
+{
+  std::cout << "Usage: " << program << " list\n"
+            << "       " << program << " cat IDVENDOR IDPRODUCT [INTERFACE] [ENDPOINT]...\n"
+            << "       " << program << " capture FILE IDVENDOR IDPRODUCT [INTERFACE] [ENDPOINT]...\n"
+            << "\n"
+            << "capture writes the completions of the IN endpoints of the interface,\n"
+            << "all of them when none are given, to FILE in pcapng format."
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc == 2 && strcmp("list", argv[1]) == 0)
+    {
+      USBSubsystem usb_subsystem;
       list_usb_devices();
+      return EXIT_SUCCESS;
     }
-  else if ((argc == 4 || argc == 5 || argc == 6) && strcmp("cat", argv[1]) == 0)
+  else if ((argc >= 4 && strcmp("cat", argv[1]) == 0) ||
+           (argc >= 5 && strcmp("capture", argv[1]) == 0))
     {
+      bool const capture = (strcmp("capture", argv[1]) == 0);
+      int arg = capture ? 3 : 2;
+      char const* filename = capture ? argv[2] : nullptr;
+
       uint16_t idVendor;
       uint16_t idProduct;
-      int interface = 0;
-      int endpoint  = 1;
-
-      if (sscanf(argv[2], "0x%hx", &idVendor) == 1 &&
-          sscanf(argv[3], "0x%hx", &idProduct) == 1)
+      if (sscanf(argv[arg], "0x%hx", &idVendor) != 1 ||
+          sscanf(argv[arg + 1], "0x%hx", &idProduct) != 1)
         {
-          if (argc >= 5)
-            interface = atoi(argv[4]);
+          std::cerr << "Error: Expected IDVENDOR IDPRODUCT" << std::endl;
+          return EXIT_FAILURE;
+        }
+      arg += 2;
 
-          if (argc == 6)
-            endpoint  = atoi(argv[5]);
+      int interface = 0;
+      if (arg < argc)
+        interface = atoi(argv[arg++]);
 
-          usb_init();
-          usb_find_busses();
-          usb_find_devices();
+      std::vector<int> endpoints;
+      for(; arg < argc; ++arg)
+        endpoints.push_back(atoi(argv[arg]));
 
-          struct usb_device* dev = find_usb_device(idVendor, idProduct);
-          if (!dev)
-            {
-              std::cout << "Error: Device (" << boost::format("idVendor: 0x%04hx, idProduct: 0x%04hx")
-                % idVendor % idProduct << ") not found" << std::endl;
-            }
-          else
-            {
-              std::cout << "Reading data from: " << dev << " Interface: " << interface << " Endpoint: " << endpoint << std::endl;
-              cat_usb_device(dev, interface, endpoint);
-            }
+      if (!capture && endpoints.empty())
+        endpoints.push_back(1);
+
+      try
+        {
+          USBSubsystem usb_subsystem;
+          return read_usb_device(filename, idVendor, idProduct, interface, endpoints);
         }
-      else
+      catch(std::exception const& err)
         {
-          std::cout << "Error: Expected IDVENDOR IDPRODUCT" << std::endl;
+          std::cerr << "Error: " << err.what() << std::endl;
+          return EXIT_FAILURE;
         }
     }
   else
     {
-      std::cout << "Usage: " << argv[0] << " list\n"
-                << "       " << argv[0] << " cat IDVENDOR IDPRODUCT [INTERFACE] [ENDPOINT]"
-                << std::endl;
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
     }
 }
 